@@ -4,16 +4,27 @@
 // Trung Le 101264698
 //
 // Hold down '1' key to view scene in wireframe mode.
+// Start with --keep-waves to resume the pond from the last run kept with it.
+// Press 'O' to swap the FFT ocean for the simulated clipmap sea and back.
 //***************************************************************************************
 
 #include "../../Common/d3dApp.h"
 #include "../../Common/MathHelper.h"
 #include "../../Common/UploadBuffer.h"
 #include "../../Common/GeometryGenerator.h"
+#include "../../Common/JobSystem.h"
+#include "../../Common/MeshOptimizer.h"
+#include "../../Common/MeshletBuilder.h"
 #include "FrameResource.h"
 #include "Waves.h"
+#include "WavesWorker.h"
+#include "OceanFFT.h"
+#include "WaveClipmap.h"
+#include "MeshCache.h"
+#include "GeometryArena.h"
 #include <stdlib.h>     /* srand, rand */
 #include <time.h>       /* time */
+#include <string.h>     /* strstr */
 
 
 using Microsoft::WRL::ComPtr;
@@ -25,6 +36,31 @@ using namespace DirectX::PackedVector;
 
 const int gNumFrameResources = 3;
 
+// Water surfaces are split into chunks of at most this many quads per side.
+const int gWaterChunkQuads = 64;
+
+// With gKeepWavesSwitch on the command line, the pond is saved here on exit and
+// picked up again on the next start.  Without it nothing is read or written.
+const char* const gWavesSnapshotPath = "waves.snapshot";
+const char* const gKeepWavesSwitch = "--keep-waves";
+
+// Layout of the pond's surroundings, shared by the render items and the pond's water
+// mask.  The castle base is the unit truncated pyramid, its top this fraction of its
+// bottom width, scaled to gCastleBaseWidth x gCastleBaseHeight and centred at
+// gCastleBaseY.  The hills are drawn gHillsOffset from GetHillsHeight.
+const float gPondLevel = -10.0f;
+const float gHillsOffset = -5.0f;
+const float gPyramidTopWidth = 0.5f;
+const float gCastleBaseWidth = 120.0f;
+const float gCastleBaseHeight = 20.0f;
+const float gCastleBaseY = -10.1f;
+
+// Draw argument of the clipmap level triangles that leave out the hole at row0, col0.
+static std::string ClipmapDrawArg(int row0, int col0)
+{
+    return "hole" + std::to_string(row0) + "_" + std::to_string(col0);
+}
+
 enum class ShapeType {
     kBox = 0,
     kSphere,
@@ -40,11 +76,25 @@ enum class RenderLayer : int
 {
     Opaque = 0,
     Transparent,
+    Water,
     AlphaTested,
     AlphaTestedTreeSprites,
     Count
 };
 
+// A rectangular piece of a water grid with its own vertices, indices and bounds, so it
+// can be culled on its own.  Its vertices are the grid rows [Row0, Row0 + Rows) and
+// columns [Col0, Col0 + Cols), stored row by row from Draw.BaseVertexLocation.
+struct WaterChunk
+{
+    int Row0 = 0;
+    int Col0 = 0;
+    int Rows = 0;
+    int Cols = 0;
+    SubmeshGeometry Draw;
+    bool Visible = true;
+};
+
 // Lightweight structure stores parameters to draw a shape.  This will
 // vary from app-to-app.
 struct RenderItem
@@ -79,6 +129,18 @@ struct RenderItem
     UINT IndexCount = 0;
     UINT StartIndexLocation = 0;
     int BaseVertexLocation = 0;
+
+    // Chunked items (the water) draw their visible chunks instead of the range above.
+    std::vector<WaterChunk> Chunks;
+
+    // Items split into meshlets (the land) draw the parts of the range above whose
+    // meshlets survived culling.  The ranges are relative to StartIndexLocation.
+    const MeshletBuilder::MeshletData* Meshlets = nullptr;
+    std::vector<MeshletBuilder::IndexRange> MeshletRanges;
+
+    // Items with a per frame vertex stream (the pond's heights and normals) bind it to
+    // input slot 1, next to the static stream of Geo.
+    D3D12_VERTEX_BUFFER_VIEW DynamicStream = {};
 };
 
 class ShapesApp : public D3DApp
@@ -107,6 +169,12 @@ private:
     void UpdateMaterialCBs(const GameTimer& gt);
     void UpdateMainPassCB(const GameTimer& gt);
     void UpdateWaves(const GameTimer& gt);
+    void UpdatePondSurface();
+    void UpdateWaterSurface(IWaveSimulator& waves, float dt, UploadBuffer<Vertex>* vb, RenderItem* ritem);
+    void UpdateClipmapSurface(float dt);
+    void ShowClipmapSea(bool show);
+    void CullWaterChunks(RenderItem* ritem, std::vector<const WaterChunk*>& visible)const;
+    void CullMeshlets(RenderItem* ritem)const;
 
     void LoadTextures();
     void BuildRootSignature();
@@ -114,11 +182,16 @@ private:
     void BuildShadersAndInputLayout();
     void BuildLandGeometry();
     void BuildWavesGeometry();
+    void BuildWaterGeometry(const IWaveSimulator& waves, const std::string& geoName, float maxHeight, bool compactStream);
+    void BuildClipmapGeometry();
     void BuildOneShapeGeometry(std::string shape_type, std::string shape_name, float param_a, float param_b, float param_c, float param_d = -999, float param_e = -999);
+    std::shared_ptr<MeshGeometry> AppendShapeMesh(GeometryGenerator::MeshData& mesh, const std::string& name, const std::string& drawArg);
+    void OptimizeMesh(GeometryGenerator::MeshData& mesh);
     void BuildShapeGeometry();
     void BuildTreeSpritesGeometry();
     void BuildCloudSpritesGeometry();
     void BuildWyvernSpritesGeometry();
+    void UploadGeometryArenas();
     void BuildPSOs();
     void BuildFrameResources();
     void BuildMaterials();
@@ -132,6 +205,7 @@ private:
 
     float GetHillsHeight(float x, float z)const;
     XMFLOAT3 GetHillsNormal(float x, float z)const;
+    std::vector<bool> BuildWaterMask(int m, int n, float dx)const;
 private:
 
     std::vector<std::unique_ptr<FrameResource>> mFrameResources;
@@ -145,7 +219,21 @@ private:
 
     ComPtr<ID3D12DescriptorHeap> mSrvDescriptorHeap = nullptr;
 
-    std::unordered_map<std::string, std::unique_ptr<MeshGeometry>> mGeometries;
+    // Shapes built from the same mesh share one geometry.
+    std::unordered_map<std::string, std::shared_ptr<MeshGeometry>> mGeometries;
+    MeshCache mMeshCache;
+
+    // The static meshes, packed into one pair of buffers per vertex format.
+    GeometryArena mStaticArena{ "staticGeo", sizeof(Vertex) };
+    GeometryArena mSpriteArena{ "spriteGeo", sizeof(XMFLOAT3) + sizeof(XMFLOAT2) };
+
+    // Post-transform cache cost of the generated and water meshes as built and as drawn.
+    MeshOptimizer::CacheStats mMeshCacheBefore;
+    MeshOptimizer::CacheStats mMeshCacheAfter;
+
+    // The land's meshlets, culled against the camera every frame.
+    MeshletBuilder::MeshletData mLandMeshlets;
+
     std::unordered_map<std::string, std::unique_ptr<Material>> mMaterials;
     std::unordered_map<std::string, std::unique_ptr<Texture>> mTextures;
     std::unordered_map<std::string, ComPtr<ID3DBlob>> mShaders;
@@ -154,8 +242,11 @@ private:
     //std::vector<D3D12_INPUT_ELEMENT_DESC> mInputLayout;
     std::vector<D3D12_INPUT_ELEMENT_DESC> mStdInputLayout;
     std::vector<D3D12_INPUT_ELEMENT_DESC> mTreeSpriteInputLayout;
+    std::vector<D3D12_INPUT_ELEMENT_DESC> mWaterInputLayout;
 
     RenderItem* mWavesRitem = nullptr;
+    RenderItem* mOceanRitem = nullptr;
+    std::vector<RenderItem*> mClipmapRitems; // one per clipmap level, finest first
 
     // List of all the render items.
     std::vector<std::unique_ptr<RenderItem>> mAllRitems;
@@ -164,6 +255,15 @@ private:
     std::vector<RenderItem*> mRitemLayer[(int)RenderLayer::Count];
 
     std::unique_ptr<Waves> mWaves;
+    std::unique_ptr<WavesWorker> mWavesWorker; // steps mWaves off the frame thread
+    bool mKeepWaves = false;                   // save and restore the pond across runs
+    std::unique_ptr<OceanFFT> mOcean;          // open sea around the castle
+    std::unique_ptr<WaveClipmap> mClipmap;     // simulated open sea, shown instead of mOcean
+    bool mShowClipmap = false;
+    bool mSeaKeyDown = false;
+
+    // Chunk layout of each water geometry, by geometry name.
+    std::unordered_map<std::string, std::vector<WaterChunk>> mWaterChunks;
 
     PassConstants mMainPassCB;
 
@@ -179,6 +279,7 @@ private:
     // XMFLOAT3 mEyePos = { 0.0f, 0.0f, 0.0f };
     XMFLOAT4X4 mView = MathHelper::Identity4x4();
     XMFLOAT4X4 mProj = MathHelper::Identity4x4();
+    BoundingFrustum mCamFrustum; // in view space
 
     float mTheta = 1.5f * XM_PI;
     float mPhi = 0.2f * XM_PI;
@@ -219,6 +320,11 @@ ShapesApp::~ShapesApp()
 {
     if (md3dDevice != nullptr)
         FlushCommandQueue();
+
+    // Stop the worker before reading the solution it steps.
+    mWavesWorker.reset();
+    if (mWaves != nullptr && mKeepWaves)
+        mWaves->SaveSnapshot(gWavesSnapshotPath);
 }
 
 bool ShapesApp::Initialize()
@@ -237,7 +343,20 @@ bool ShapesApp::Initialize()
     // so we have to query this information.
     mCbvSrvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 
-    mWaves = std::make_unique<Waves>(240, 240, 1.0f, 0.03f, 4.0f, 0.2f);
+    mWaves = std::make_unique<Waves>(240, 240, 1.0f, 0.03f, 4.0f, 0.2f, BuildWaterMask(240, 240, 1.0f));
+    mWaves->EnableTangents(false); // Vertex has no tangent
+    mWaves->SetSleepThreshold(0.001f); // let calm stretches of water sleep
+    mWaves->SetAbsorbingBoundary(16); // waves leave through the open grid edges
+    mKeepWaves = strstr(GetCommandLineA(), gKeepWavesSwitch) != nullptr;
+    if (mKeepWaves)
+        mWaves->LoadSnapshot(gWavesSnapshotPath); // resume where the last run stopped, if it matches
+
+    // One periodic kilometre of ocean, 8 units per sample, with a 10 m/s wind.
+    mOcean = std::make_unique<OceanFFT>(128, 1024.0f, XMFLOAT2(10.0f, 4.0f), 1.5e-8f, 1.0f);
+
+    // Or the same kilometre simulated around the camera: three nested 129x129 grids,
+    // the finest 2 units per sample, stepped only while shown in the ocean's place.
+    mClipmap = std::make_unique<WaveClipmap>(3, 129, 2.0f, 0.03f, 8.0f, 0.2f);
 
     LoadTextures();
     BuildRootSignature();
@@ -249,6 +368,7 @@ bool ShapesApp::Initialize()
     BuildTreeSpritesGeometry();
     BuildCloudSpritesGeometry();
     BuildWyvernSpritesGeometry();
+    UploadGeometryArenas();
     BuildMaterials();
     BuildRenderItems();
     BuildFrameResources();
@@ -263,6 +383,10 @@ bool ShapesApp::Initialize()
     // Wait until initialization is complete.
     FlushCommandQueue();
 
+    // Start stepping the pond last: from here on only the worker touches *mWaves, apart
+    // from its grid layout.
+    mWavesWorker = std::make_unique<WavesWorker>(*mWaves);
+
     ::OutputDebugStringA(">>> Init DONE!\n");
 
     return true;
@@ -275,6 +399,8 @@ void ShapesApp::OnResize()
     // The window resized, so update the aspect ratio and recompute the projection matrix.
     XMMATRIX P = XMMatrixPerspectiveFovLH(0.25f * MathHelper::Pi, AspectRatio(), 1.0f, 1000.0f);
     XMStoreFloat4x4(&mProj, P);
+
+    BoundingFrustum::CreateFromMatrix(mCamFrustum, P);
 }
 
 void ShapesApp::Update(const GameTimer& gt)
@@ -296,11 +422,19 @@ void ShapesApp::Update(const GameTimer& gt)
         CloseHandle(eventHandle);
     }
 
+    // The water goes first: the clipmap levels follow the camera, and their new places
+    // belong in this frame's object constants.
+    UpdateWaves(gt);
     AnimateMaterials(gt);
     UpdateObjectCBs(gt);
     UpdateMaterialCBs(gt);
     UpdateMainPassCB(gt);
-    UpdateWaves(gt);
+
+    for (auto& ritem : mAllRitems)
+    {
+        if (ritem->Meshlets != nullptr)
+            CullMeshlets(ritem.get());
+    }
 }
 
 void ShapesApp::Draw(const GameTimer& gt)
@@ -363,6 +497,9 @@ void ShapesApp::Draw(const GameTimer& gt)
     mCommandList->SetPipelineState(mPSOs["treeSprites"].Get());
     DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::AlphaTestedTreeSprites]);
 
+    mCommandList->SetPipelineState(mPSOs["water"].Get());
+    DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Water]);
+
     mCommandList->SetPipelineState(mPSOs["transparent"].Get());
     DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Transparent]);
 
@@ -457,6 +594,12 @@ void ShapesApp::OnKeyboardInput(const GameTimer& gt)
     if (GetAsyncKeyState('D') & 0x8000) {
         position -= rightVec * 0.9f;
     }
+
+    // 'O' swaps the open sea once per press.
+    bool seaKeyDown = (GetAsyncKeyState('O') & 0x8000) != 0;
+    if (seaKeyDown && !mSeaKeyDown)
+        ShowClipmapSea(!mShowClipmap);
+    mSeaKeyDown = seaKeyDown;
 }
 
 void ShapesApp::UpdateCamera(const GameTimer& gt)
@@ -633,30 +776,221 @@ void ShapesApp::UpdateWaves(const GameTimer& gt)
 
         float r = MathHelper::RandF(0.1f, 1.0f); // EDIT WAVE INTENSITY
 
-        mWaves->Disturb(i, j, r);
+        mWavesWorker->Disturb(i, j, r);
+
+        if (mShowClipmap)
+        {
+            // And one somewhere in the finest clipmap level, around the camera.
+            XMFLOAT3 eye;
+            XMStoreFloat3(&eye, position);
+
+            Waves::Impulse drop;
+            drop.X = eye.x + MathHelper::RandF(-100.0f, 100.0f);
+            drop.Z = eye.z + MathHelper::RandF(-100.0f, 100.0f);
+            drop.Radius = 4.0f;
+            drop.Magnitude = MathHelper::RandF(0.5f, 2.0f);
+            mClipmap->DisturbBatch(&drop, 1);
+        }
     }
 
-    // Update the wave simulation.
-    mWaves->Update(gt.DeltaTime());
+    // The pond and the ocean share no state, so the pond's upload runs as a job while
+    // this thread steps the ocean; both split their own work further on the job system.
+    JobSystem& jobs = JobSystem::Default();
+    JobSystem::Counter pondDone;
+    jobs.Run([this] { UpdatePondSurface(); }, &pondDone);
+
+    if (mShowClipmap)
+        UpdateClipmapSurface(gt.DeltaTime());
+    else
+        UpdateWaterSurface(*mOcean, gt.DeltaTime(), mCurrFrameResource->OceanVB.get(), mOceanRitem);
+
+    jobs.Wait(pondDone);
+}
+
+// The water simulators write Vertex data in place as SurfaceVertex.
+static_assert(sizeof(Vertex) == sizeof(IWaveSimulator::SurfaceVertex) &&
+    offsetof(Vertex, Normal) == offsetof(IWaveSimulator::SurfaceVertex, Normal) &&
+    offsetof(Vertex, TexC) == offsetof(IWaveSimulator::SurfaceVertex, TexC),
+    "Vertex and IWaveSimulator::SurfaceVertex must share a layout");
 
-    // Update the wave vertex buffer with the new solution.
-    auto currWavesVB = mCurrFrameResource->WavesVB.get();
-    for (int i = 0; i < mWaves->VertexCount(); ++i)
+void ShapesApp::UpdatePondSurface()
+{
+    // The pond steps on its own thread; just pick up its newest finished step.
+    const WavesWorker::Snapshot& snapshot = mWavesWorker->AcquireSnapshot();
+
+    std::vector<const WaterChunk*> visible;
+    CullWaterChunks(mWavesRitem, visible);
+
+    // Only the heights and normals change, so only they are uploaded, as a compact
+    // stream next to the static x/z and texture coordinate stream of the geometry.
+    // Chunks this frame resource already received at the snapshot's revision are
+    // left alone, which skips the upload entirely on frames without a new step.
+    const WaterChunk* chunks = mWavesRitem->Chunks.data();
+    std::vector<std::uint64_t>& received = mCurrFrameResource->WavesChunkRevisions;
+    visible.erase(std::remove_if(visible.begin(), visible.end(), [&](const WaterChunk* chunk)
     {
-        Vertex v;
-        v.Pos = mWaves->Position(i);
-        v.Normal = mWaves->Normal(i);
+        return received[chunk - chunks] == snapshot.Revision;
+    }), visible.end());
 
-        // Derive tex-coords from position by 
-        // mapping [-w/2,w/2] --> [0,1]
-        v.TexC.x = 0.5f + v.Pos.x / mWaves->Width();
-        v.TexC.y = 0.5f - v.Pos.z / mWaves->Depth();
+    auto vb = mCurrFrameResource->WavesVB.get();
+    Waves::CompactVertex* vertices = vb->MappedData(0);
+    const WavesWorker& waves = *mWavesWorker;
+    JobSystem::Default().ParallelFor(0, (int)visible.size(), [&](int k)
+    {
+        const WaterChunk& chunk = *visible[k];
+        std::uint64_t& revision = received[&chunk - chunks];
 
-        currWavesVB->CopyData(i, v);
-    }
+        // Rewrite each run of rows that changed since this buffer last got the chunk.
+        const std::uint64_t* rowRevisions = &snapshot.RowRevisions[chunk.Row0];
+        for (int r0 = 0; r0 < chunk.Rows; )
+        {
+            if (rowRevisions[r0] <= revision)
+            {
+                ++r0;
+                continue;
+            }
+
+            int r1 = r0 + 1;
+            while (r1 < chunk.Rows && rowRevisions[r1] > revision)
+                ++r1;
+
+            waves.WriteCompactVertices(chunk.Row0 + r0, chunk.Col0, r1 - r0, chunk.Cols,
+                vertices + chunk.Draw.BaseVertexLocation + r0 * chunk.Cols);
+            r0 = r1;
+        }
+
+        revision = snapshot.Revision;
+    });
+
+    // Bind the current frame's stream to the pond.
+    UINT vertexCount = mWavesRitem->Geo->VertexBufferByteSize / mWavesRitem->Geo->VertexByteStride;
+    mWavesRitem->DynamicStream.BufferLocation = vb->Resource()->GetGPUVirtualAddress();
+    mWavesRitem->DynamicStream.StrideInBytes = sizeof(Waves::CompactVertex);
+    mWavesRitem->DynamicStream.SizeInBytes = vertexCount * sizeof(Waves::CompactVertex);
+}
+
+void ShapesApp::UpdateWaterSurface(IWaveSimulator& waves, float dt, UploadBuffer<Vertex>* vb, RenderItem* ritem)
+{
+    waves.Update(dt);
+
+    std::vector<const WaterChunk*> visible;
+    CullWaterChunks(ritem, visible);
+
+    // Update the wave vertex buffer with the new solution.  The simulator writes the
+    // vertices straight into the mapped buffer, each chunk to its own contiguous range,
+    // so the chunks are filled in parallel.
+    Vertex* vertices = vb->MappedData(0);
+    JobSystem::Default().ParallelFor(0, (int)visible.size(), [&waves, &visible, vertices](int k)
+    {
+        const WaterChunk& chunk = *visible[k];
+        waves.WriteVertices(chunk.Row0, chunk.Col0, chunk.Rows, chunk.Cols,
+            reinterpret_cast<IWaveSimulator::SurfaceVertex*>(vertices + chunk.Draw.BaseVertexLocation));
+    });
 
     // Set the dynamic VB of the wave renderitem to the current frame VB.
-    mWavesRitem->Geo->VertexBufferGPU = currWavesVB->Resource();
+    ritem->Geo->VertexBufferGPU = vb->Resource();
+}
+
+void ShapesApp::UpdateClipmapSurface(float dt)
+{
+    XMFLOAT3 eye;
+    XMStoreFloat3(&eye, position);
+    mClipmap->Update(dt, XMFLOAT2(eye.x, eye.z));
+
+    // Every level writes its whole grid to its own block of the buffer.
+    const int levels = mClipmap->LevelCount();
+    const int n = mClipmap->Level(0).RowCount();
+    auto vb = mCurrFrameResource->ClipmapVB.get();
+    Vertex* vertices = vb->MappedData(0);
+    const WaveClipmap& clipmap = *mClipmap;
+    JobSystem::Default().ParallelFor(0, levels, [&clipmap, n, vertices](int l)
+    {
+        clipmap.Level(l).WriteVertices(0, 0, n, n,
+            reinterpret_cast<IWaveSimulator::SurfaceVertex*>(vertices + l * n * n));
+    });
+
+    // The levels scroll with the camera, so their places and holes change with it.  The
+    // texture is tiled as densely as on the ocean and stays put in the world.
+    const float texScale = 20.0f / mClipmap->Width();
+    for (int l = 0; l < levels; ++l)
+    {
+        RenderItem* ritem = mClipmapRitems[l];
+        XMFLOAT2 center = mClipmap->LevelCenter(l);
+        float width = mClipmap->Level(l).Width();
+
+        XMStoreFloat4x4(&ritem->World, XMMatrixTranslation(center.x, -12.0f, center.y));
+        XMStoreFloat4x4(&ritem->TexTransform, XMMatrixScaling(width * texScale, width * texScale, 1.0f) *
+            XMMatrixTranslation((center.x - 0.5f * width) * texScale, (-center.y - 0.5f * width) * texScale, 0.0f));
+        ritem->NumFramesDirty = gNumFrameResources;
+
+        int row0, col0, rows, cols;
+        mClipmap->LevelHole(l, row0, col0, rows, cols);
+        const SubmeshGeometry& draw = ritem->Geo->DrawArgs[ClipmapDrawArg(row0, col0)];
+        ritem->IndexCount = draw.IndexCount;
+        ritem->StartIndexLocation = draw.StartIndexLocation;
+    }
+
+    // The levels share one geometry.
+    mClipmapRitems[0]->Geo->VertexBufferGPU = vb->Resource();
+}
+
+void ShapesApp::ShowClipmapSea(bool show)
+{
+    // The open sea in the transparent layer is either the ocean or the clipmap levels.
+    std::vector<RenderItem*>& layer = mRitemLayer[(int)RenderLayer::Transparent];
+    layer.erase(std::remove_if(layer.begin(), layer.end(), [this](RenderItem* ritem)
+    {
+        return ritem == mOceanRitem || std::find(mClipmapRitems.begin(), mClipmapRitems.end(), ritem) != mClipmapRitems.end();
+    }), layer.end());
+
+    if (show)
+        layer.insert(layer.end(), mClipmapRitems.begin(), mClipmapRitems.end());
+    else
+        layer.push_back(mOceanRitem);
+
+    mShowClipmap = show;
+}
+
+void ShapesApp::CullWaterChunks(RenderItem* ritem, std::vector<const WaterChunk*>& visible)const
+{
+    // Bring the camera frustum into the water's local space; chunks outside it are
+    // neither uploaded nor drawn this frame.
+    XMMATRIX view = XMLoadFloat4x4(&mView);
+    XMMATRIX world = XMLoadFloat4x4(&ritem->World);
+    XMVECTOR viewDet = XMMatrixDeterminant(view);
+    XMVECTOR worldDet = XMMatrixDeterminant(world);
+    XMMATRIX viewToLocal = XMMatrixMultiply(XMMatrixInverse(&viewDet, view), XMMatrixInverse(&worldDet, world));
+
+    BoundingFrustum localFrustum;
+    mCamFrustum.Transform(localFrustum, viewToLocal);
+
+    for (WaterChunk& chunk : ritem->Chunks)
+    {
+        chunk.Visible = localFrustum.Contains(chunk.Draw.Bounds) != DISJOINT;
+        if (chunk.Visible)
+            visible.push_back(&chunk);
+    }
+}
+
+void ShapesApp::CullMeshlets(RenderItem* ritem)const
+{
+    // Like the water chunks, but meshlets facing away from the camera are dropped too,
+    // so the camera position is brought into local space as well.
+    XMMATRIX view = XMLoadFloat4x4(&mView);
+    XMMATRIX world = XMLoadFloat4x4(&ritem->World);
+    XMVECTOR viewDet = XMMatrixDeterminant(view);
+    XMVECTOR worldDet = XMMatrixDeterminant(world);
+    XMMATRIX worldToLocal = XMMatrixInverse(&worldDet, world);
+    XMMATRIX viewToLocal = XMMatrixMultiply(XMMatrixInverse(&viewDet, view), worldToLocal);
+
+    BoundingFrustum localFrustum;
+    mCamFrustum.Transform(localFrustum, viewToLocal);
+
+    XMFLOAT3 localEye;
+    XMStoreFloat3(&localEye, XMVector3TransformCoord(position, worldToLocal));
+
+    ritem->MeshletRanges.clear();
+    MeshletBuilder::Cull(*ritem->Meshlets, localFrustum, localEye, ritem->MeshletRanges);
 }
 
 void ShapesApp::LoadTextures() //EDIT TEXTURES HERE
@@ -1130,6 +1464,7 @@ void ShapesApp::BuildShadersAndInputLayout()
     mShaders["standardVS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["opaquePS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", defines, "PS", "ps_5_1");
     mShaders["alphaTestedPS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", alphaTestDefines, "PS", "ps_5_1");
+    mShaders["waterVS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "WaterVS", "vs_5_1");
 
     mShaders["treeSpriteVS"] = d3dUtil::CompileShader(L"Shaders\\TreeSprite.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["treeSpriteGS"] = d3dUtil::CompileShader(L"Shaders\\TreeSprite.hlsl", nullptr, "GS", "gs_5_1");
@@ -1148,6 +1483,16 @@ void ShapesApp::BuildShadersAndInputLayout()
         { "SIZE", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
     };
 
+    // Slot 0 is the static WaterGridVertex stream, slot 1 the per frame
+    // Waves::CompactVertex stream.
+    mWaterInputLayout =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+        { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 8, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+        { "HEIGHT", 0, DXGI_FORMAT_R16_FLOAT, 1, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+        { "NORMAL", 0, DXGI_FORMAT_R8G8_SNORM, 1, 2, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
+
     ::OutputDebugStringA(">>> BuildShadersAndInputLayout DONE!\n");
 }
 
@@ -1157,89 +1502,276 @@ void ShapesApp::BuildLandGeometry()
     GeometryGenerator::MeshData grid = geoGen.CreateGrid(300.0f, 300.0f, 50, 50);
 
     //
-    // Extract the vertex elements we are interested and apply the height function to
-    // each vertex.  In addition, color the vertices based on their height so we have
-    // sandy looking beaches, grassy low hills, and snow mountain peaks.
+    // Apply the height function to each vertex.  In addition, color the vertices based
+    // on their height so we have sandy looking beaches, grassy low hills, and snow
+    // mountain peaks.  The hills are in place before the triangles are reordered, so
+    // the overdraw pass sees their slopes.
     //
 
+    for (auto& v : grid.Vertices)
+    {
+        v.Normal = GetHillsNormal(v.Position.x, v.Position.z);
+        v.Position.y = GetHillsHeight(v.Position.x, v.Position.z);
+    }
+    OptimizeMesh(grid);
+
+    // The meshlets keep the optimised triangle order, so they index the land's own
+    // index range.
+    MeshletBuilder::Build(grid, mLandMeshlets);
+
+    std::string text = ">>> Land meshlets: " + std::to_string(mLandMeshlets.Meshlets.size()) + " for " +
+        std::to_string(grid.Indices32.size() / 3) + " triangles\n";
+    ::OutputDebugStringA(text.c_str());
+
     std::vector<Vertex> vertices(grid.Vertices.size());
     for (size_t i = 0; i < grid.Vertices.size(); ++i)
     {
-        auto& p = grid.Vertices[i].Position;
-        vertices[i].Pos = p;
-        vertices[i].Pos.y = GetHillsHeight(p.x, p.z);
-        vertices[i].Normal = GetHillsNormal(p.x, p.z);
+        vertices[i].Pos = grid.Vertices[i].Position;
+        vertices[i].Normal = grid.Vertices[i].Normal;
         vertices[i].TexC = grid.Vertices[i].TexC;
     }
 
-    const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
-
     std::vector<std::uint16_t> indices = grid.GetIndices16();
-    const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
+
+    mGeometries["landGeo"] = mStaticArena.Append("landGeo", "grid",
+        vertices.data(), (UINT)vertices.size(), indices.data(), (UINT)indices.size());
+}
+
+void ShapesApp::BuildWavesGeometry()
+{
+    ::OutputDebugStringA(">>> BuildWavesGeometry started...\n");
+
+    // Bounds are padded by the largest expected wave height and displacement.
+    // The ocean's choppy displacement moves its x/z, so only the pond can draw from a
+    // static grid stream plus compact heights and normals.
+    BuildWaterGeometry(*mWaves, "waterGeo", 4.0f, true);
+    BuildWaterGeometry(*mOcean, "oceanGeo", 4.0f, false);
+    BuildClipmapGeometry();
+
+    ::OutputDebugStringA(">>> BuildWavesGeometry DONE!\n");
+}
+
+void ShapesApp::BuildWaterGeometry(const IWaveSimulator& waves, const std::string& geoName, float maxHeight, bool compactStream)
+{
+    int m = waves.RowCount();
+    int n = waves.ColumnCount();
+
+    // Split the grid into chunks.  Each chunk stores its own copy of the vertices it
+    // shares with its neighbours, so its indices are local and normally fit in 16 bits.
+    std::vector<WaterChunk> chunks;
+    UINT vertexCount = 0;
+    UINT indexCount = 0;
+    int maxChunkVertices = 0;
+    for (int r0 = 0; r0 < m - 1; r0 += gWaterChunkQuads)
+    {
+        for (int c0 = 0; c0 < n - 1; c0 += gWaterChunkQuads)
+        {
+            WaterChunk chunk;
+            chunk.Row0 = r0;
+            chunk.Col0 = c0;
+            chunk.Rows = std::min(gWaterChunkQuads, m - 1 - r0) + 1;
+            chunk.Cols = std::min(gWaterChunkQuads, n - 1 - c0) + 1;
+            chunk.Draw.IndexCount = 6 * (chunk.Rows - 1) * (chunk.Cols - 1);
+            chunk.Draw.StartIndexLocation = indexCount;
+            chunk.Draw.BaseVertexLocation = vertexCount;
+
+            // Bound the chunk at rest, grown by the largest expected displacement.  The
+            // pond may already be stepping on its worker, so its heights are not read.
+            XMVECTOR vMin = XMVectorReplicate(+MathHelper::Infinity);
+            XMVECTOR vMax = XMVectorReplicate(-MathHelper::Infinity);
+            for (int r = 0; r < chunk.Rows; ++r)
+            {
+                for (int c = 0; c < chunk.Cols; ++c)
+                {
+                    XMFLOAT3 pos = waves.RestPosition((r0 + r) * n + c0 + c);
+                    XMVECTOR P = XMLoadFloat3(&pos);
+                    vMin = XMVectorMin(vMin, P);
+                    vMax = XMVectorMax(vMax, P);
+                }
+            }
+            XMStoreFloat3(&chunk.Draw.Bounds.Center, 0.5f * (vMin + vMax));
+            XMStoreFloat3(&chunk.Draw.Bounds.Extents, 0.5f * (vMax - vMin) + XMVectorReplicate(maxHeight));
+
+            vertexCount += chunk.Rows * chunk.Cols;
+            indexCount += chunk.Draw.IndexCount;
+            maxChunkVertices = std::max(maxChunkVertices, chunk.Rows * chunk.Cols);
+            chunks.push_back(chunk);
+        }
+    }
+
+    // The chunks' vertices stay in grid order, which the per frame uploads rely on, so
+    // only their triangles are reordered for the vertex cache.
+    auto buildIndices = [this, &chunks](auto& indices)
+    {
+        std::vector<std::uint32_t> chunkIndices;
+        for (const WaterChunk& chunk : chunks)
+        {
+            // Iterate over each quad.
+            int cols = chunk.Cols;
+            chunkIndices.clear();
+            for (int i = 0; i < chunk.Rows - 1; ++i)
+            {
+                for (int j = 0; j < cols - 1; ++j)
+                {
+                    chunkIndices.push_back(i * cols + j);
+                    chunkIndices.push_back(i * cols + j + 1);
+                    chunkIndices.push_back((i + 1) * cols + j);
+
+                    chunkIndices.push_back((i + 1) * cols + j);
+                    chunkIndices.push_back(i * cols + j + 1);
+                    chunkIndices.push_back((i + 1) * cols + j + 1);
+                }
+            }
+
+            size_t vertexCount = chunk.Rows * chunk.Cols;
+            mMeshCacheBefore += MeshOptimizer::AnalyzeVertexCache(chunkIndices.data(), chunkIndices.size(), vertexCount);
+            MeshOptimizer::OptimizeVertexCache(chunkIndices.data(), chunkIndices.size(), vertexCount);
+            mMeshCacheAfter += MeshOptimizer::AnalyzeVertexCache(chunkIndices.data(), chunkIndices.size(), vertexCount);
+
+            indices.insert(indices.end(), chunkIndices.begin(), chunkIndices.end());
+        }
+    };
+
+    // Fall back to 32-bit indices if the chunks are ever made too large for 16.
+    std::vector<std::uint16_t> indices16;
+    std::vector<std::uint32_t> indices32;
+    const void* indexData = nullptr;
+    UINT ibByteSize = 0;
+    DXGI_FORMAT indexFormat;
+    if (maxChunkVertices <= 0x10000)
+    {
+        indices16.reserve(indexCount);
+        buildIndices(indices16);
+        indexData = indices16.data();
+        ibByteSize = (UINT)indices16.size() * sizeof(std::uint16_t);
+        indexFormat = DXGI_FORMAT_R16_UINT;
+    }
+    else
+    {
+        indices32.reserve(indexCount);
+        buildIndices(indices32);
+        indexData = indices32.data();
+        ibByteSize = (UINT)indices32.size() * sizeof(std::uint32_t);
+        indexFormat = DXGI_FORMAT_R32_UINT;
+    }
+
+    UINT vertexByteStride = compactStream ? sizeof(WaterGridVertex) : sizeof(Vertex);
+    UINT vbByteSize = vertexCount * vertexByteStride;
 
     auto geo = std::make_unique<MeshGeometry>();
-    geo->Name = "landGeo";
+    geo->Name = geoName;
 
-    ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-    CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
+    // Set dynamically, unless the vertices are split into a static and a compact
+    // per frame stream.
+    geo->VertexBufferCPU = nullptr;
+    geo->VertexBufferGPU = nullptr;
+    if (compactStream)
+    {
+        std::vector<WaterGridVertex> grid;
+        grid.reserve(vertexCount);
+        for (const WaterChunk& chunk : chunks)
+        {
+            for (int r = 0; r < chunk.Rows; ++r)
+            {
+                for (int c = 0; c < chunk.Cols; ++c)
+                {
+                    // Only x/z is kept, so the layout is enough; the heights belong
+                    // to the pond's worker.
+                    XMFLOAT3 pos = waves.RestPosition((chunk.Row0 + r) * n + chunk.Col0 + c);
+
+                    // Derive tex-coords from position by 
+                    // mapping [-w/2,w/2] --> [0,1]
+                    WaterGridVertex v;
+                    v.PosXZ = XMFLOAT2(pos.x, pos.z);
+                    v.TexC = XMFLOAT2(0.5f + pos.x / waves.Width(), 0.5f - pos.z / waves.Depth());
+                    grid.push_back(v);
+                }
+            }
+        }
 
-    ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-    CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
+        geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
+            mCommandList.Get(), grid.data(), vbByteSize, geo->VertexBufferUploader);
+    }
 
-    geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
+    ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
+    CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indexData, ibByteSize);
 
     geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+        mCommandList.Get(), indexData, ibByteSize, geo->IndexBufferUploader);
 
-    geo->VertexByteStride = sizeof(Vertex);
+    geo->VertexByteStride = vertexByteStride;
     geo->VertexBufferByteSize = vbByteSize;
-    geo->IndexFormat = DXGI_FORMAT_R16_UINT;
+    geo->IndexFormat = indexFormat;
     geo->IndexBufferByteSize = ibByteSize;
 
-    SubmeshGeometry submesh;
-    submesh.IndexCount = (UINT)indices.size();
-    submesh.StartIndexLocation = 0;
-    submesh.BaseVertexLocation = 0;
-
-    geo->DrawArgs["grid"] = submesh;
+    for (size_t k = 0; k < chunks.size(); ++k)
+        geo->DrawArgs["chunk" + std::to_string(k)] = chunks[k].Draw;
 
-    mGeometries["landGeo"] = std::move(geo);
+    mGeometries[geoName] = std::move(geo);
+    mWaterChunks[geoName] = std::move(chunks);
 }
 
-void ShapesApp::BuildWavesGeometry()
+void ShapesApp::BuildClipmapGeometry()
 {
-    ::OutputDebugStringA(">>> BuildWavesGeometry started...\n");
+    // The levels share one index buffer and take turns at the vertex buffer, a block of
+    // n x n vertices each.  A level draws all but the block of cells the next finer one
+    // covers.  That block sits at most one cell off the middle either way, so there is a
+    // triangle list for each of those nine holes, and one without a hole for the finest
+    // level, whose LevelHole is empty at row 0, column 0.
+    const int levels = mClipmap->LevelCount();
+    const int n = mClipmap->Level(0).RowCount();
+    const int middle = (n - 1) / 4;
+    const int holeCells = (n - 1) / 2;
+    assert(n * n <= 0x10000);
 
-    std::vector<std::uint16_t> indices(3 * mWaves->TriangleCount()); // 3 indices per face
-    assert(mWaves->VertexCount() < 0x0000ffff);
+    auto geo = std::make_unique<MeshGeometry>();
+    geo->Name = "clipmapGeo";
 
-    // Iterate over each quad.
-    int m = mWaves->RowCount();
-    int n = mWaves->ColumnCount();
-    int k = 0;
-    for (int i = 0; i < m - 1; ++i)
+    std::vector<std::uint16_t> indices;
+    std::vector<std::uint32_t> levelIndices;
+    auto addHole = [&](int row0, int col0, int cells)
     {
-        for (int j = 0; j < n - 1; ++j)
+        levelIndices.clear();
+        for (int i = 0; i < n - 1; ++i)
         {
-            indices[k] = i * n + j;
-            indices[k + 1] = i * n + j + 1;
-            indices[k + 2] = (i + 1) * n + j;
+            for (int j = 0; j < n - 1; ++j)
+            {
+                if (i >= row0 && i < row0 + cells && j >= col0 && j < col0 + cells)
+                    continue;
+
+                levelIndices.push_back(i * n + j);
+                levelIndices.push_back(i * n + j + 1);
+                levelIndices.push_back((i + 1) * n + j);
+
+                levelIndices.push_back((i + 1) * n + j);
+                levelIndices.push_back(i * n + j + 1);
+                levelIndices.push_back((i + 1) * n + j + 1);
+            }
+        }
 
-            indices[k + 3] = (i + 1) * n + j;
-            indices[k + 4] = i * n + j + 1;
-            indices[k + 5] = (i + 1) * n + j + 1;
+        size_t vertexCount = n * n;
+        mMeshCacheBefore += MeshOptimizer::AnalyzeVertexCache(levelIndices.data(), levelIndices.size(), vertexCount);
+        MeshOptimizer::OptimizeVertexCache(levelIndices.data(), levelIndices.size(), vertexCount);
+        mMeshCacheAfter += MeshOptimizer::AnalyzeVertexCache(levelIndices.data(), levelIndices.size(), vertexCount);
 
-            k += 6; // next quad
-        }
+        SubmeshGeometry draw;
+        draw.IndexCount = (UINT)levelIndices.size();
+        draw.StartIndexLocation = (UINT)indices.size();
+        draw.BaseVertexLocation = 0;
+        geo->DrawArgs[ClipmapDrawArg(row0, col0)] = draw;
+
+        indices.insert(indices.end(), levelIndices.begin(), levelIndices.end());
+    };
+
+    addHole(0, 0, 0);
+    for (int row0 = middle - 1; row0 <= middle + 1; ++row0)
+    {
+        for (int col0 = middle - 1; col0 <= middle + 1; ++col0)
+            addHole(row0, col0, holeCells);
     }
 
-    UINT vbByteSize = mWaves->VertexCount() * sizeof(Vertex);
     UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
 
-    auto geo = std::make_unique<MeshGeometry>();
-    geo->Name = "waterGeo";
-
     // Set dynamically.
     geo->VertexBufferCPU = nullptr;
     geo->VertexBufferGPU = nullptr;
@@ -1251,66 +1783,88 @@ void ShapesApp::BuildWavesGeometry()
         mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
 
     geo->VertexByteStride = sizeof(Vertex);
-    geo->VertexBufferByteSize = vbByteSize;
+    geo->VertexBufferByteSize = levels * n * n * sizeof(Vertex);
     geo->IndexFormat = DXGI_FORMAT_R16_UINT;
     geo->IndexBufferByteSize = ibByteSize;
 
-    SubmeshGeometry submesh;
-    submesh.IndexCount = (UINT)indices.size();
-    submesh.StartIndexLocation = 0;
-    submesh.BaseVertexLocation = 0;
-
-    geo->DrawArgs["grid"] = submesh;
-
-    mGeometries["waterGeo"] = std::move(geo);
-
-    ::OutputDebugStringA(">>> BuildWavesGeometry DONE!\n");
+    mGeometries[geo->Name] = std::move(geo);
 }
 
 
 void ShapesApp::BuildOneShapeGeometry(std::string shape_type, std::string shape_name, float param_a, float param_b, float param_c, float param_d, float param_e) {
     GeometryGenerator geoGen;
-    GeometryGenerator::MeshData mesh;
+    MeshCache::GenerateFunction generate;
+    std::string key;
     if (shape_type == "box" ||
         shape_type == "outterWall" ||
         shape_type == "tower" ||
         shape_type == "gate") {
-        mesh = geoGen.CreateBox(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("Box", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateBox(param_a, param_b, param_c, param_d); };
     }
     if (shape_type == "grid") {
-        mesh = geoGen.CreateGrid(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("Grid", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateGrid(param_a, param_b, param_c, param_d); };
     }
     if (shape_type == "sphere") {
-        mesh = geoGen.CreateSphere(param_a, param_b, param_c);
+        key = MeshCache::Key("Sphere", { param_a, param_b, param_c });
+        generate = [&] { return geoGen.CreateSphere(param_a, param_b, param_c); };
     }
     if (shape_type == "cylinder" ||
         shape_type == "rolo") {
-        mesh = geoGen.CreateCylinder(param_a, param_b, param_c, param_d, param_e);
+        key = MeshCache::Key("Cylinder", { param_a, param_b, param_c, param_d, param_e });
+        generate = [&] { return geoGen.CreateCylinder(param_a, param_b, param_c, param_d, param_e); };
     }
     if (shape_type == "wedge") {
-        mesh = geoGen.CreateWedge(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("Wedge", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateWedge(param_a, param_b, param_c, param_d); };
     }
     if (shape_type == "cone") {
-        mesh = geoGen.CreateCone(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("Cone", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateCone(param_a, param_b, param_c, param_d); };
     }
     if (shape_type == "pyramid") {
-        mesh = geoGen.CreatePyramid(param_a, param_b, param_c);
+        key = MeshCache::Key("Pyramid", { param_a, param_b, param_c });
+        generate = [&] { return geoGen.CreatePyramid(param_a, param_b, param_c); };
     }
     if (shape_type == "truncatedPyramid") {
-        mesh = geoGen.CreateTruncatedPyramid(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("TruncatedPyramid", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateTruncatedPyramid(param_a, param_b, param_c, param_d); };
     }
     if (shape_type == "diamond" ||
         shape_type == "charm") {
-        mesh = geoGen.CreateDiamond(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("Diamond", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateDiamond(param_a, param_b, param_c, param_d); };
     }
     if (shape_type == "prism") {
-        mesh = geoGen.CreateTriangularPrism(param_a, param_b, param_c);
+        key = MeshCache::Key("TriangularPrism", { param_a, param_b, param_c });
+        generate = [&] { return geoGen.CreateTriangularPrism(param_a, param_b, param_c); };
     }
     if (shape_type == "torus") {
-        mesh = geoGen.CreateTorus(param_a, param_b, param_c, param_d);
+        key = MeshCache::Key("Torus", { param_a, param_b, param_c, param_d });
+        generate = [&] { return geoGen.CreateTorus(param_a, param_b, param_c, param_d); };
     }
 
+    // Meshes are optimised before the cache sees them, so identical shapes still match
+    // by content.
+    auto generateOptimized = [&]
+    {
+        GeometryGenerator::MeshData mesh = generate();
+        OptimizeMesh(mesh);
+        return mesh;
+    };
+
+    std::shared_ptr<MeshGeometry> geo = mMeshCache.Get(key, generateOptimized,
+        [&](GeometryGenerator::MeshData& mesh) { return AppendShapeMesh(mesh, shape_name, shape_type); });
+
+    // A shared mesh is drawn under every shape type that uses it.
+    geo->DrawArgs[shape_type] = mStaticArena.Submesh(*geo);
+
+    mGeometries[shape_name] = geo;
+}
 
+std::shared_ptr<MeshGeometry> ShapesApp::AppendShapeMesh(GeometryGenerator::MeshData& mesh, const std::string& name, const std::string& drawArg)
+{
     std::vector<Vertex> vertices(mesh.Vertices.size());
     for (size_t i = 0; i < mesh.Vertices.size(); ++i)
     {
@@ -1320,39 +1874,18 @@ void ShapesApp::BuildOneShapeGeometry(std::string shape_type, std::string shape_
         vertices[i].TexC = mesh.Vertices[i].TexC;
     }
 
-    const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
-
-    std::vector<std::uint16_t> indices = mesh.GetIndices16();
-    const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
-
-    auto geo = std::make_unique<MeshGeometry>();
-    geo->Name = shape_name;
-
-    ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-    CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-    ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-    CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
+    std::vector<std::uint16_t>& indices = mesh.GetIndices16();
 
-    geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-    geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-    geo->VertexByteStride = sizeof(Vertex);
-    geo->VertexBufferByteSize = vbByteSize;
-    geo->IndexFormat = DXGI_FORMAT_R16_UINT;
-    geo->IndexBufferByteSize = ibByteSize;
-
-    SubmeshGeometry submesh;
-    submesh.IndexCount = (UINT)indices.size();
-    submesh.StartIndexLocation = 0;
-    submesh.BaseVertexLocation = 0;
-
-    geo->DrawArgs[shape_type] = submesh;
+    return mStaticArena.Append(name, drawArg,
+        vertices.data(), (UINT)vertices.size(), indices.data(), (UINT)indices.size());
+}
 
-    mGeometries[shape_name] = std::move(geo);
+void ShapesApp::OptimizeMesh(GeometryGenerator::MeshData& mesh)
+{
+    MeshOptimizer::CacheStats before, after;
+    MeshOptimizer::Optimize(mesh, &before, &after);
+    mMeshCacheBefore += before;
+    mMeshCacheAfter += after;
 }
 
 void ShapesApp::BuildShapeGeometry()
@@ -1370,12 +1903,21 @@ void ShapesApp::BuildShapeGeometry()
     BuildOneShapeGeometry("wedge", "wedgeGeo", 1.0, 1.0f, 1.0, 3);
     BuildOneShapeGeometry("cone", "coneGeo", 1.0f, 2.0f, 20, 20);
     BuildOneShapeGeometry("pyramid", "pyramidGeo", 1.0, 1.0f, 20);
-    BuildOneShapeGeometry("truncatedPyramid", "truncatedPyramidGeo", 1.0, 1.0f, 0.5f, 1);
+    BuildOneShapeGeometry("truncatedPyramid", "truncatedPyramidGeo", 1.0, 1.0f, gPyramidTopWidth, 1);
     BuildOneShapeGeometry("diamond", "diamondGeo", 1.0f, 1.0f, 1.0f, 1);
     BuildOneShapeGeometry("charm", "charmGeo", 1.0f, 1.0f, 1.0f, 1);
     BuildOneShapeGeometry("prism", "prismGeo", 1.0f, 1.0f, 1);
     BuildOneShapeGeometry("torus", "torusGeo", 2.0f, 0.5f, 20, 20);
 
+    const MeshCache::Stats& stats = mMeshCache.GetStats();
+    std::string text = ">>> Mesh cache: " + std::to_string(stats.Requests) + " shapes, " +
+        std::to_string(stats.Built) + " meshes built, " +
+        std::to_string(stats.KeyHits + stats.ContentHits) + " shared (" +
+        std::to_string(stats.ContentHits) + " by content), " +
+        std::to_string(stats.BytesSaved) + " bytes and " +
+        std::to_string(stats.MillisecondsSaved) + " ms saved\n";
+    ::OutputDebugStringA(text.c_str());
+
     ::OutputDebugStringA(">>> BuildShapeGeometry DONE!\n");
 }
 
@@ -1409,37 +1951,8 @@ void ShapesApp::BuildTreeSpritesGeometry()
         8, 9, 10, 11, 12, 13, 14, 15
     };
 
-    const UINT vbByteSize = (UINT)vertices.size() * sizeof(TreeSpriteVertex);
-    const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
-
-    auto geo = std::make_unique<MeshGeometry>();
-    geo->Name = "treeSpritesGeo";
-
-    ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-    CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-    ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-    CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
-
-    geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-    geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-    geo->VertexByteStride = sizeof(TreeSpriteVertex);
-    geo->VertexBufferByteSize = vbByteSize;
-    geo->IndexFormat = DXGI_FORMAT_R16_UINT;
-    geo->IndexBufferByteSize = ibByteSize;
-
-    SubmeshGeometry submesh;
-    submesh.IndexCount = (UINT)indices.size();
-    submesh.StartIndexLocation = 0;
-    submesh.BaseVertexLocation = 0;
-
-    geo->DrawArgs["points"] = submesh;
-
-    mGeometries["treeSpritesGeo"] = std::move(geo);
+    mGeometries["treeSpritesGeo"] = mSpriteArena.Append("treeSpritesGeo", "points",
+        vertices.data(), (UINT)vertices.size(), indices.data(), (UINT)indices.size());
 }
 
 void ShapesApp::BuildCloudSpritesGeometry()
@@ -1478,37 +1991,8 @@ void ShapesApp::BuildCloudSpritesGeometry()
         8, 9, 10, 11, 12, 13, 14, 15
     };
 
-    const UINT vbByteSize = (UINT)vertices.size() * sizeof(TreeSpriteVertex);
-    const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
-
-    auto geo = std::make_unique<MeshGeometry>();
-    geo->Name = "cloudSpritesGeo";
-
-    ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-    CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-    ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-    CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
-
-    geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-    geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-    geo->VertexByteStride = sizeof(TreeSpriteVertex);
-    geo->VertexBufferByteSize = vbByteSize;
-    geo->IndexFormat = DXGI_FORMAT_R16_UINT;
-    geo->IndexBufferByteSize = ibByteSize;
-
-    SubmeshGeometry submesh;
-    submesh.IndexCount = (UINT)indices.size();
-    submesh.StartIndexLocation = 0;
-    submesh.BaseVertexLocation = 0;
-
-    geo->DrawArgs["points"] = submesh;
-
-    mGeometries["cloudSpritesGeo"] = std::move(geo);
+    mGeometries["cloudSpritesGeo"] = mSpriteArena.Append("cloudSpritesGeo", "points",
+        vertices.data(), (UINT)vertices.size(), indices.data(), (UINT)indices.size());
 }
 
 void ShapesApp::BuildWyvernSpritesGeometry()
@@ -1533,37 +2017,25 @@ void ShapesApp::BuildWyvernSpritesGeometry()
         0
     };
 
-    const UINT vbByteSize = (UINT)vertices.size() * sizeof(TreeSpriteVertex);
-    const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
-
-    auto geo = std::make_unique<MeshGeometry>();
-    geo->Name = "wyvernSpritesGeo";
-
-    ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-    CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-    ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-    CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
-
-    geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-    geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-        mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-    geo->VertexByteStride = sizeof(TreeSpriteVertex);
-    geo->VertexBufferByteSize = vbByteSize;
-    geo->IndexFormat = DXGI_FORMAT_R8_UINT;
-    geo->IndexBufferByteSize = ibByteSize;
-
-    SubmeshGeometry submesh;
-    submesh.IndexCount = (UINT)indices.size();
-    submesh.StartIndexLocation = 0;
-    submesh.BaseVertexLocation = 0;
-
-    geo->DrawArgs["points"] = submesh;
+    mGeometries["wyvernSpritesGeo"] = mSpriteArena.Append("wyvernSpritesGeo", "points",
+        vertices.data(), (UINT)vertices.size(), indices.data(), (UINT)indices.size());
+}
 
-    mGeometries["wyvernSpritesGeo"] = std::move(geo);
+void ShapesApp::UploadGeometryArenas()
+{
+    mStaticArena.Upload(md3dDevice.Get(), mCommandList.Get());
+    mSpriteArena.Upload(md3dDevice.Get(), mCommandList.Get());
+
+    std::string text = ">>> Geometry arenas: " +
+        std::to_string(mStaticArena.MeshCount()) + " static meshes in " +
+        std::to_string(mStaticArena.VertexBufferByteSize() + mStaticArena.IndexBufferByteSize()) + " bytes, " +
+        std::to_string(mSpriteArena.MeshCount()) + " sprite meshes in " +
+        std::to_string(mSpriteArena.VertexBufferByteSize() + mSpriteArena.IndexBufferByteSize()) + " bytes\n";
+    ::OutputDebugStringA(text.c_str());
+
+    text = ">>> Mesh optimiser: ACMR " + std::to_string(mMeshCacheBefore.Acmr()) + " -> " + std::to_string(mMeshCacheAfter.Acmr()) +
+        ", ATVR " + std::to_string(mMeshCacheBefore.Atvr()) + " -> " + std::to_string(mMeshCacheAfter.Atvr()) + "\n";
+    ::OutputDebugStringA(text.c_str());
 }
 
 void ShapesApp::BuildPSOs()
@@ -1625,6 +2097,19 @@ void ShapesApp::BuildPSOs()
     transparentPsoDesc.BlendState.RenderTarget[0] = transparencyBlendDesc;
     ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&transparentPsoDesc, IID_PPV_ARGS(&mPSOs["transparent"])));
 
+    //
+    // PSO for the pond, drawn from its static grid and compact per frame streams
+    //
+
+    D3D12_GRAPHICS_PIPELINE_STATE_DESC waterPsoDesc = transparentPsoDesc;
+    waterPsoDesc.InputLayout = { mWaterInputLayout.data(), (UINT)mWaterInputLayout.size() };
+    waterPsoDesc.VS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["waterVS"]->GetBufferPointer()),
+        mShaders["waterVS"]->GetBufferSize()
+    };
+    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&waterPsoDesc, IID_PPV_ARGS(&mPSOs["water"])));
+
     //
     // PSO for alpha tested objects
     //
@@ -1681,7 +2166,11 @@ void ShapesApp::BuildFrameResources()
     for (int i = 0; i < gNumFrameResources; ++i)
     {
         mFrameResources.push_back(std::make_unique<FrameResource>(md3dDevice.Get(),
-            1, (UINT)mAllRitems.size(), (UINT)mMaterials.size(), mWaves->VertexCount()));
+            1, (UINT)mAllRitems.size(), (UINT)mMaterials.size(),
+            mGeometries["waterGeo"]->VertexBufferByteSize / mGeometries["waterGeo"]->VertexByteStride,
+            mGeometries["oceanGeo"]->VertexBufferByteSize / sizeof(Vertex),
+            mGeometries["clipmapGeo"]->VertexBufferByteSize / sizeof(Vertex)));
+        mFrameResources.back()->WavesChunkRevisions.assign(mWaterChunks["waterGeo"].size(), 0);
     }
 
     ::OutputDebugStringA(">>> BuildFrameResources DONE!\n");
@@ -2012,25 +2501,56 @@ void ShapesApp::BuildRenderItems()
     // waves
     auto wavesRitem = std::make_unique<RenderItem>();
     //wavesRitem->World = MathHelper::Identity4x4();
-    XMStoreFloat4x4(&wavesRitem->World, XMMatrixScaling(1, 1, 1) * XMMatrixTranslation(0.0f, -10, 0));
+    XMStoreFloat4x4(&wavesRitem->World, XMMatrixScaling(1, 1, 1) * XMMatrixTranslation(0.0f, gPondLevel, 0));
     XMStoreFloat4x4(&wavesRitem->TexTransform, XMMatrixScaling(5, 5, 1.0f));
     wavesRitem->ObjCBIndex = index_cache;
     wavesRitem->Mat = mMaterials["water"].get();
     wavesRitem->Geo = mGeometries["waterGeo"].get();
     wavesRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-    wavesRitem->IndexCount = wavesRitem->Geo->DrawArgs["grid"].IndexCount;
-    wavesRitem->StartIndexLocation = wavesRitem->Geo->DrawArgs["grid"].StartIndexLocation;
-    wavesRitem->BaseVertexLocation = wavesRitem->Geo->DrawArgs["grid"].BaseVertexLocation;
+    wavesRitem->Chunks = mWaterChunks["waterGeo"];
     index_cache++;
 
     //// we use mVavesRitem in updatewaves() to set the dynamic VB of the wave renderitem to the current frame VB.
     mWavesRitem = wavesRitem.get();
-    mRitemLayer[(int)RenderLayer::Transparent].push_back(wavesRitem.get());
+    mRitemLayer[(int)RenderLayer::Water].push_back(wavesRitem.get());
     mAllRitems.push_back(std::move(wavesRitem)); //EXTREME MEGA IMPORTANT LINE
 
+    // ocean, a little below the pond so its crests stay under the pond surface
+    auto oceanRitem = std::make_unique<RenderItem>();
+    XMStoreFloat4x4(&oceanRitem->World, XMMatrixTranslation(0.0f, -12.0f, 0.0f));
+    XMStoreFloat4x4(&oceanRitem->TexTransform, XMMatrixScaling(20.0f, 20.0f, 1.0f));
+    oceanRitem->ObjCBIndex = index_cache;
+    oceanRitem->Mat = mMaterials["water"].get();
+    oceanRitem->Geo = mGeometries["oceanGeo"].get();
+    oceanRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+    oceanRitem->Chunks = mWaterChunks["oceanGeo"];
+    index_cache++;
+
+    mOceanRitem = oceanRitem.get();
+    mRitemLayer[(int)RenderLayer::Transparent].push_back(oceanRitem.get());
+    mAllRitems.push_back(std::move(oceanRitem));
+
+    // clipmap sea levels, placed around the camera by UpdateClipmapSurface and drawn
+    // instead of the ocean while ShowClipmapSea has them in the transparent layer
+    for (int l = 0; l < mClipmap->LevelCount(); ++l)
+    {
+        const Waves& level = mClipmap->Level(l);
+
+        auto levelRitem = std::make_unique<RenderItem>();
+        levelRitem->ObjCBIndex = index_cache;
+        levelRitem->Mat = mMaterials["water"].get();
+        levelRitem->Geo = mGeometries["clipmapGeo"].get();
+        levelRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+        levelRitem->BaseVertexLocation = l * level.RowCount() * level.ColumnCount();
+        index_cache++;
+
+        mClipmapRitems.push_back(levelRitem.get());
+        mAllRitems.push_back(std::move(levelRitem));
+    }
+
     // HILLS
     auto gridRitem = std::make_unique<RenderItem>();
-    XMStoreFloat4x4(&gridRitem->World, XMMatrixScaling(1, 1, 1) * XMMatrixTranslation(0.0f, -5, 0));
+    XMStoreFloat4x4(&gridRitem->World, XMMatrixScaling(1, 1, 1) * XMMatrixTranslation(0.0f, gHillsOffset, 0));
     XMStoreFloat4x4(&gridRitem->TexTransform, XMMatrixScaling(5.0f, 5.0f, 1.0f));
     gridRitem->ObjCBIndex = index_cache;
     gridRitem->Mat = mMaterials["tile0"].get();
@@ -2039,13 +2559,14 @@ void ShapesApp::BuildRenderItems()
     gridRitem->IndexCount = gridRitem->Geo->DrawArgs["grid"].IndexCount;
     gridRitem->StartIndexLocation = gridRitem->Geo->DrawArgs["grid"].StartIndexLocation;
     gridRitem->BaseVertexLocation = gridRitem->Geo->DrawArgs["grid"].BaseVertexLocation;
+    gridRitem->Meshlets = &mLandMeshlets;
     index_cache++;
 
     mRitemLayer[(int)RenderLayer::Opaque].push_back(gridRitem.get());
     mAllRitems.push_back(std::move(gridRitem));
 
     // base
-    BuildOneRenderItem("truncatedPyramid", "truncatedPyramidGeo", "tile0", XMMatrixScaling(120, 20, 120), XMMatrixTranslation(0.0f, -10.1, 0.0f), XMMatrixScaling(1, 1, 1), index_cache++);
+    BuildOneRenderItem("truncatedPyramid", "truncatedPyramidGeo", "tile0", XMMatrixScaling(gCastleBaseWidth, gCastleBaseHeight, gCastleBaseWidth), XMMatrixTranslation(0.0f, gCastleBaseY, 0.0f), XMMatrixScaling(1, 1, 1), index_cache++);
 
 
     // grid
@@ -2346,14 +2867,43 @@ void ShapesApp::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::v
     auto objectCB = mCurrFrameResource->ObjectCB->Resource();
     auto matCB = mCurrFrameResource->MaterialCB->Resource();
 
+    // Items drawn from the same buffers, such as those of a geometry arena, only bind
+    // them once.
+    D3D12_VERTEX_BUFFER_VIEW boundStreams[2] = {};
+    D3D12_INDEX_BUFFER_VIEW boundIndices = {};
+    D3D12_PRIMITIVE_TOPOLOGY boundTopology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
+
+    auto sameStream = [](const D3D12_VERTEX_BUFFER_VIEW& a, const D3D12_VERTEX_BUFFER_VIEW& b)
+    {
+        return a.BufferLocation == b.BufferLocation && a.SizeInBytes == b.SizeInBytes && a.StrideInBytes == b.StrideInBytes;
+    };
+
     // For each render item...
     for (size_t i = 0; i < ritems.size(); ++i)
     {
         auto ri = ritems[i];
 
-        cmdList->IASetVertexBuffers(0, 1, &ri->Geo->VertexBufferView());
-        cmdList->IASetIndexBuffer(&ri->Geo->IndexBufferView());
-        cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
+        D3D12_VERTEX_BUFFER_VIEW streams[] = { ri->Geo->VertexBufferView(), ri->DynamicStream };
+        if (!sameStream(streams[0], boundStreams[0]) || !sameStream(streams[1], boundStreams[1]))
+        {
+            cmdList->IASetVertexBuffers(0, ri->DynamicStream.BufferLocation != 0 ? 2 : 1, streams);
+            boundStreams[0] = streams[0];
+            boundStreams[1] = streams[1];
+        }
+
+        D3D12_INDEX_BUFFER_VIEW indices = ri->Geo->IndexBufferView();
+        if (indices.BufferLocation != boundIndices.BufferLocation || indices.SizeInBytes != boundIndices.SizeInBytes ||
+            indices.Format != boundIndices.Format)
+        {
+            cmdList->IASetIndexBuffer(&indices);
+            boundIndices = indices;
+        }
+
+        if (ri->PrimitiveType != boundTopology)
+        {
+            cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
+            boundTopology = ri->PrimitiveType;
+        }
 
         CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
         tex.Offset(ri->Mat->DiffuseSrvHeapIndex, mCbvSrvDescriptorSize);
@@ -2365,7 +2915,26 @@ void ShapesApp::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::v
         cmdList->SetGraphicsRootConstantBufferView(1, objCBAddress);
         cmdList->SetGraphicsRootConstantBufferView(3, matCBAddress);
 
-        cmdList->DrawIndexedInstanced(ri->IndexCount, 1, ri->StartIndexLocation, ri->BaseVertexLocation, 0);
+        if (ri->Meshlets != nullptr)
+        {
+            // Split items only draw the meshlets that survived culling.
+            for (const MeshletBuilder::IndexRange& range : ri->MeshletRanges)
+                cmdList->DrawIndexedInstanced(range.IndexCount, 1, ri->StartIndexLocation + range.StartIndex, ri->BaseVertexLocation, 0);
+            continue;
+        }
+
+        if (ri->Chunks.empty())
+        {
+            cmdList->DrawIndexedInstanced(ri->IndexCount, 1, ri->StartIndexLocation, ri->BaseVertexLocation, 0);
+            continue;
+        }
+
+        // Chunked items only draw the chunks that survived culling.
+        for (const WaterChunk& chunk : ri->Chunks)
+        {
+            if (chunk.Visible)
+                cmdList->DrawIndexedInstanced(chunk.Draw.IndexCount, 1, chunk.Draw.StartIndexLocation, chunk.Draw.BaseVertexLocation, 0);
+        }
     }
 }
 
@@ -2444,3 +3013,33 @@ XMFLOAT3 ShapesApp::GetHillsNormal(float x, float z)const
 
     return n;
 }
+
+std::vector<bool> ShapesApp::BuildWaterMask(int m, int n, float dx)const
+{
+    // The castle base narrows evenly from its bottom to its top, so the square it cuts
+    // out of the water is found from where the water level lies between the two.
+    // Points up to one unit above the water stay wet so the waves still run up under
+    // the shoreline.
+    const float margin = 1.0f;
+    float baseRise = (gPondLevel - (gCastleBaseY - 0.5f * gCastleBaseHeight)) / gCastleBaseHeight;
+    float baseHalfWidth = 0.5f * gCastleBaseWidth * (1.0f + baseRise * (gPyramidTopWidth - 1.0f));
+
+    float halfWidth = (n - 1) * dx * 0.5f;
+    float halfDepth = (m - 1) * dx * 0.5f;
+
+    std::vector<bool> wet(m * n);
+    for (int i = 0; i < m; ++i)
+    {
+        float z = halfDepth - i * dx;
+        for (int j = 0; j < n; ++j)
+        {
+            float x = -halfWidth + j * dx;
+
+            bool underBase = fabsf(x) < baseHalfWidth - margin && fabsf(z) < baseHalfWidth - margin;
+            bool underHills = gHillsOffset + GetHillsHeight(x, z) > gPondLevel + margin;
+            wet[i * n + j] = !underBase && !underHills;
+        }
+    }
+
+    return wet;
+}
@@ -3,6 +3,7 @@
 #include "../../Common/d3dUtil.h"
 #include "../../Common/MathHelper.h"
 #include "../../Common/UploadBuffer.h"
+#include "Waves.h"
 
 struct ObjectConstants
 {
@@ -48,13 +49,21 @@ struct Vertex
 	DirectX::XMFLOAT2 TexC;
 };
 
+// Static stream of the pond: the parts of a water vertex that never change.  The heights
+// and normals come from a second, per frame stream of Waves::CompactVertex.
+struct WaterGridVertex
+{
+    DirectX::XMFLOAT2 PosXZ;
+    DirectX::XMFLOAT2 TexC;
+};
+
 // Stores the resources needed for the CPU to build the command lists
 // for a frame.  
 struct FrameResource
 {
 public:
     
-    FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT waveVertCount);
+    FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT waveVertCount, UINT oceanVertCount = 0, UINT clipmapVertCount = 0);
 	FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount);
     FrameResource(const FrameResource& rhs) = delete;
     FrameResource& operator=(const FrameResource& rhs) = delete;
@@ -73,7 +82,14 @@ public:
 
     // We cannot update a dynamic vertex buffer until the GPU is done processing
     // the commands that reference it.  So each frame needs their own.
-    std::unique_ptr<UploadBuffer<Vertex>> WavesVB = nullptr;
+    std::unique_ptr<UploadBuffer<Waves::CompactVertex>> WavesVB = nullptr;
+    std::unique_ptr<UploadBuffer<Vertex>> OceanVB = nullptr;
+    std::unique_ptr<UploadBuffer<Vertex>> ClipmapVB = nullptr;
+
+    // Waves revision of the pond each chunk of WavesVB was last written at (0 if
+    // never), so a frame only rewrites the rows that changed since this buffer was
+    // last used.
+    std::vector<std::uint64_t> WavesChunkRevisions;
 
     // Fence value to mark commands up to this fence point.  This lets us
     // check if these frame resources are still in use by the GPU.
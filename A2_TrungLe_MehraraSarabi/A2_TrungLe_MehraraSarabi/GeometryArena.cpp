@@ -0,0 +1,157 @@
+//***************************************************************************************
+// GeometryArena.cpp
+//***************************************************************************************
+
+#include "GeometryArena.h"
+#include <algorithm>
+#include <cassert>
+
+GeometryArena::GeometryArena(const std::string& name, UINT vertexStride)
+	: mName(name), mVertexStride(vertexStride)
+{
+}
+
+GeometryArena::~GeometryArena()
+{
+}
+
+std::shared_ptr<MeshGeometry> GeometryArena::Append(const std::string& name, const std::string& drawArg,
+	const void* vertices, UINT vertexCount, const std::uint16_t* indices, UINT indexCount)
+{
+	assert(vertexCount <= 65536);
+
+	Mesh mesh;
+	mesh.Geometry = std::make_shared<MeshGeometry>();
+	mesh.Geometry->Name = name;
+	mesh.Geometry->VertexByteStride = mVertexStride;
+	mesh.Geometry->IndexFormat = DXGI_FORMAT_R16_UINT;
+	mesh.BaseVertex = (UINT)(mVertices.size() / mVertexStride);
+	mesh.VertexCount = vertexCount;
+	mesh.StartIndex = (UINT)mIndices.size();
+	mesh.IndexCount = indexCount;
+
+	const unsigned char* bytes = static_cast<const unsigned char*>(vertices);
+	mVertices.insert(mVertices.end(), bytes, bytes + vertexCount*mVertexStride);
+	mIndices.insert(mIndices.end(), indices, indices + indexCount);
+
+	mesh.Geometry->DrawArgs[drawArg] = MakeSubmesh(mesh);
+	mMeshes.push_back(mesh);
+
+	return mesh.Geometry;
+}
+
+SubmeshGeometry GeometryArena::Submesh(const MeshGeometry& geometry)const
+{
+	const Mesh* mesh = FindMesh(geometry);
+	assert(mesh != nullptr);
+	return MakeSubmesh(*mesh);
+}
+
+void GeometryArena::Remove(const MeshGeometry& geometry)
+{
+	auto it = std::find_if(mMeshes.begin(), mMeshes.end(),
+		[&geometry](const Mesh& mesh) { return mesh.Geometry.get() == &geometry; });
+	assert(it != mMeshes.end());
+	mMeshes.erase(it);
+}
+
+void GeometryArena::Compact()
+{
+	// The meshes stay in the order they were appended, so each one moves down only.
+	UINT vertexEnd = 0;
+	UINT indexEnd = 0;
+	for(Mesh& mesh : mMeshes)
+	{
+		if(mesh.BaseVertex != vertexEnd)
+		{
+			std::copy_n(&mVertices[mesh.BaseVertex*mVertexStride], mesh.VertexCount*mVertexStride,
+				&mVertices[vertexEnd*mVertexStride]);
+			mesh.BaseVertex = vertexEnd;
+		}
+
+		if(mesh.StartIndex != indexEnd)
+		{
+			std::copy_n(&mIndices[mesh.StartIndex], mesh.IndexCount, &mIndices[indexEnd]);
+			mesh.StartIndex = indexEnd;
+		}
+
+		vertexEnd += mesh.VertexCount;
+		indexEnd += mesh.IndexCount;
+		SetDrawArgs(mesh);
+	}
+
+	mVertices.resize(vertexEnd*mVertexStride);
+	mIndices.resize(indexEnd);
+}
+
+void GeometryArena::Upload(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList)
+{
+	const UINT vbByteSize = VertexBufferByteSize();
+	const UINT ibByteSize = IndexBufferByteSize();
+	if(vbByteSize == 0 || ibByteSize == 0)
+		return;
+
+	ThrowIfFailed(D3DCreateBlob(vbByteSize, &mVertexBufferCPU));
+	CopyMemory(mVertexBufferCPU->GetBufferPointer(), mVertices.data(), vbByteSize);
+
+	ThrowIfFailed(D3DCreateBlob(ibByteSize, &mIndexBufferCPU));
+	CopyMemory(mIndexBufferCPU->GetBufferPointer(), mIndices.data(), ibByteSize);
+
+	mVertexBufferGPU = d3dUtil::CreateDefaultBuffer(device,
+		cmdList, mVertices.data(), vbByteSize, mVertexBufferUploader);
+
+	mIndexBufferGPU = d3dUtil::CreateDefaultBuffer(device,
+		cmdList, mIndices.data(), ibByteSize, mIndexBufferUploader);
+
+	for(const Mesh& mesh : mMeshes)
+	{
+		MeshGeometry& geo = *mesh.Geometry;
+		geo.VertexBufferCPU = mVertexBufferCPU;
+		geo.IndexBufferCPU = mIndexBufferCPU;
+		geo.VertexBufferGPU = mVertexBufferGPU;
+		geo.IndexBufferGPU = mIndexBufferGPU;
+		geo.VertexBufferByteSize = vbByteSize;
+		geo.IndexBufferByteSize = ibByteSize;
+	}
+}
+
+UINT GeometryArena::MeshCount()const
+{
+	return (UINT)mMeshes.size();
+}
+
+UINT GeometryArena::VertexBufferByteSize()const
+{
+	return (UINT)mVertices.size();
+}
+
+UINT GeometryArena::IndexBufferByteSize()const
+{
+	return (UINT)(mIndices.size()*sizeof(std::uint16_t));
+}
+
+const GeometryArena::Mesh* GeometryArena::FindMesh(const MeshGeometry& geometry)const
+{
+	for(const Mesh& mesh : mMeshes)
+	{
+		if(mesh.Geometry.get() == &geometry)
+			return &mesh;
+	}
+
+	return nullptr;
+}
+
+SubmeshGeometry GeometryArena::MakeSubmesh(const Mesh& mesh)
+{
+	SubmeshGeometry submesh;
+	submesh.IndexCount = mesh.IndexCount;
+	submesh.StartIndexLocation = mesh.StartIndex;
+	submesh.BaseVertexLocation = (INT)mesh.BaseVertex;
+	return submesh;
+}
+
+void GeometryArena::SetDrawArgs(const Mesh& mesh)
+{
+	for(auto& drawArg : mesh.Geometry->DrawArgs)
+		drawArg.second = MakeSubmesh(mesh);
+}
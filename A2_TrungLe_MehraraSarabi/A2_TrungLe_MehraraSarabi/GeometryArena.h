@@ -0,0 +1,85 @@
+//***************************************************************************************
+// GeometryArena.h
+//
+// Packs many static meshes of one vertex format into a single vertex buffer and a
+// single 16-bit index buffer.
+//
+// Every mesh appended gets its own MeshGeometry, so it is looked up and drawn like any
+// other geometry, but all of them view the same two buffers and differ only in their
+// DrawArgs.  Items drawn from one arena can therefore be drawn back to back without
+// binding buffers in between.  The arena keeps a system memory copy of the meshes, so
+// removed meshes can be compacted away and the buffers created again.
+//***************************************************************************************
+
+#pragma once
+
+#include "../../Common/d3dUtil.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class GeometryArena
+{
+public:
+	// Meshes of vertexStride bytes per vertex.  Indices are relative to the mesh's
+	// first vertex, so each mesh may have up to 65536 vertices.
+	GeometryArena(const std::string& name, UINT vertexStride);
+	GeometryArena(const GeometryArena& rhs) = delete;
+	GeometryArena& operator=(const GeometryArena& rhs) = delete;
+	~GeometryArena();
+
+	// Adds a mesh and returns its geometry, whose DrawArgs[drawArg] covers the whole
+	// mesh.  The geometry has no buffers to draw from until the next Upload.
+	std::shared_ptr<MeshGeometry> Append(const std::string& name, const std::string& drawArg,
+		const void* vertices, UINT vertexCount, const std::uint16_t* indices, UINT indexCount);
+
+	// Where the mesh of a geometry returned by Append lies in the buffers.
+	SubmeshGeometry Submesh(const MeshGeometry& geometry)const;
+
+	// Drops a mesh.  Its space is only reclaimed by Compact.
+	void Remove(const MeshGeometry& geometry);
+
+	// Moves the meshes down over the space of removed ones and updates every DrawArgs
+	// entry of their geometries, which all cover the whole mesh.  Render items hold
+	// copies of DrawArgs and must copy them again; the buffers need another Upload.
+	void Compact();
+
+	// Creates the buffers from everything appended so far and points every geometry
+	// at them.  The copies are recorded on cmdList and the upload buffers are kept
+	// until the next Upload, which must wait until the GPU is done with the old ones.
+	void Upload(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList);
+
+	UINT MeshCount()const;
+	UINT VertexBufferByteSize()const;
+	UINT IndexBufferByteSize()const;
+
+private:
+	struct Mesh
+	{
+		std::shared_ptr<MeshGeometry> Geometry;
+		UINT BaseVertex = 0;
+		UINT VertexCount = 0;
+		UINT StartIndex = 0;
+		UINT IndexCount = 0;
+	};
+
+	const Mesh* FindMesh(const MeshGeometry& geometry)const;
+	static SubmeshGeometry MakeSubmesh(const Mesh& mesh);
+	static void SetDrawArgs(const Mesh& mesh);
+
+private:
+	std::string mName;
+	UINT mVertexStride = 0;
+
+	std::vector<Mesh> mMeshes;
+	std::vector<unsigned char> mVertices;
+	std::vector<std::uint16_t> mIndices;
+
+	Microsoft::WRL::ComPtr<ID3DBlob> mVertexBufferCPU;
+	Microsoft::WRL::ComPtr<ID3DBlob> mIndexBufferCPU;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mVertexBufferGPU;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mIndexBufferGPU;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mVertexBufferUploader;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mIndexBufferUploader;
+};
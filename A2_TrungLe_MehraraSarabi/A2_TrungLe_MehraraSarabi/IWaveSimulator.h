@@ -0,0 +1,54 @@
+//***************************************************************************************
+// IWaveSimulator.h
+//
+// Interface for the water surface simulations the application draws.  A simulator
+// produces a RowCount() x ColumnCount() grid of vertices in row major order, triangulated
+// as a regular grid, and centred on the origin of its local x/z plane.
+//***************************************************************************************
+
+#pragma once
+
+#include <DirectXMath.h>
+
+class IWaveSimulator
+{
+public:
+	// The vertex layout WriteVertices produces, the same as the application's Vertex.
+	struct SurfaceVertex
+	{
+		DirectX::XMFLOAT3 Pos;
+		DirectX::XMFLOAT3 Normal;
+		DirectX::XMFLOAT2 TexC;
+	};
+
+	virtual ~IWaveSimulator() = default;
+
+	virtual int RowCount()const = 0;
+	virtual int ColumnCount()const = 0;
+	virtual int VertexCount()const = 0;
+	virtual int TriangleCount()const = 0;
+	virtual float Width()const = 0;
+	virtual float Depth()const = 0;
+
+	// Returns the position and normal of the ith grid vertex.
+	virtual DirectX::XMFLOAT3 Position(int i)const = 0;
+	virtual DirectX::XMFLOAT3 Normal(int i)const = 0;
+
+	// Returns the ith grid vertex at rest: undisplaced and at height 0.  Only reads the
+	// grid layout, so it may be called while another thread steps the simulation.
+	virtual DirectX::XMFLOAT3 RestPosition(int i)const = 0;
+
+	// Writes the vertices of the rows x cols block of grid points starting at row row0,
+	// column col0 to dst, in row major order, with texture coordinates mapping
+	// [-w/2,w/2] to [0,1].  dst is written once, front to back, and never read, so it
+	// may point straight into write-combined memory such as a mapped upload buffer.
+	// Safe to call concurrently for different blocks.
+	virtual void WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const = 0;
+
+	// Advances the simulation by dt seconds of frame time.
+	virtual void Update(float dt) = 0;
+
+	// Pushes the water at grid point (i, j).  Simulations without local dynamics may
+	// ignore it.
+	virtual void Disturb(int i, int j, float magnitude) = 0;
+};
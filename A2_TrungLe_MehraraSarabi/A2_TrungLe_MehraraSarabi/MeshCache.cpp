@@ -0,0 +1,135 @@
+//***************************************************************************************
+// MeshCache.cpp
+//***************************************************************************************
+
+#include "MeshCache.h"
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+	double MillisecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// 64-bit FNV-1a.
+	std::uint64_t HashBytes(std::uint64_t hash, const void* data, size_t size)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for(size_t i = 0; i < size; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+}
+
+MeshCache::MeshCache()
+{
+}
+
+MeshCache::~MeshCache()
+{
+}
+
+std::string MeshCache::Key(const char* generator, std::initializer_list<float> params)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	std::string key = generator;
+	for(float param : params)
+	{
+		std::uint32_t bits;
+		std::memcpy(&bits, &param, sizeof(bits));
+
+		key += ' ';
+		for(int shift = 28; shift >= 0; shift -= 4)
+			key += digits[(bits >> shift) & 0xf];
+	}
+	return key;
+}
+
+std::shared_ptr<MeshGeometry> MeshCache::Get(const std::string& key,
+	const GenerateFunction& generate, const UploadFunction& upload)
+{
+	++mStats.Requests;
+
+	auto byKey = mByKey.find(key);
+	if(byKey != mByKey.end())
+	{
+		++mStats.KeyHits;
+		CountSaved(*byKey->second, byKey->second->GenerateMilliseconds + byKey->second->UploadMilliseconds);
+		return byKey->second->Geometry;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	GeometryGenerator::MeshData mesh = generate();
+	double generateMilliseconds = MillisecondsSince(start);
+
+	// A different key may still make the same mesh, e.g. an alias of a generator or
+	// parameters the generator rounds to the same values.
+	std::uint64_t hash = HashMesh(mesh);
+	auto range = mByContent.equal_range(hash);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		if(SameMesh(it->second->Mesh, mesh))
+		{
+			++mStats.ContentHits;
+			CountSaved(*it->second, it->second->UploadMilliseconds);
+			mByKey[key] = it->second;
+			return it->second->Geometry;
+		}
+	}
+
+	auto entry = std::make_unique<Entry>();
+	entry->GenerateMilliseconds = generateMilliseconds;
+
+	start = std::chrono::steady_clock::now();
+	entry->Geometry = upload(mesh);
+	entry->UploadMilliseconds = MillisecondsSince(start);
+	entry->Bytes = (std::uint64_t)mesh.Vertices.size()*entry->Geometry->VertexByteStride +
+		mesh.Indices32.size()*(entry->Geometry->IndexFormat == DXGI_FORMAT_R32_UINT ? 4 : 2);
+	entry->Mesh = std::move(mesh);
+	++mStats.Built;
+
+	mByKey[key] = entry.get();
+	mByContent.emplace(hash, entry.get());
+	mEntries.push_back(std::move(entry));
+
+	return mEntries.back()->Geometry;
+}
+
+const MeshCache::Stats& MeshCache::GetStats()const
+{
+	return mStats;
+}
+
+void MeshCache::Clear()
+{
+	mByKey.clear();
+	mByContent.clear();
+	mEntries.clear();
+}
+
+std::uint64_t MeshCache::HashMesh(const GeometryGenerator::MeshData& mesh)
+{
+	std::uint64_t hash = 14695981039346656037ull;
+	hash = HashBytes(hash, mesh.Vertices.data(), mesh.Vertices.size()*sizeof(GeometryGenerator::Vertex));
+	hash = HashBytes(hash, mesh.Indices32.data(), mesh.Indices32.size()*sizeof(GeometryGenerator::uint32));
+	return hash;
+}
+
+bool MeshCache::SameMesh(const GeometryGenerator::MeshData& a, const GeometryGenerator::MeshData& b)
+{
+	return a.Vertices.size() == b.Vertices.size() &&
+		a.Indices32 == b.Indices32 &&
+		std::memcmp(a.Vertices.data(), b.Vertices.data(), a.Vertices.size()*sizeof(GeometryGenerator::Vertex)) == 0;
+}
+
+void MeshCache::CountSaved(const Entry& entry, double milliseconds)
+{
+	mStats.BytesSaved += entry.Bytes;
+	mStats.MillisecondsSaved += milliseconds;
+}
@@ -0,0 +1,84 @@
+//***************************************************************************************
+// MeshCache.h
+//
+// Builds every distinct generated mesh once and hands the same MeshGeometry to every
+// shape that asks for it.
+//
+// A request names the generator and its exact parameters.  A repeated key returns the
+// geometry built for it without running the generator.  A new key runs the generator,
+// and if the mesh it makes is identical to one already built under another key (found
+// by a hash of its vertices and indices) that geometry is returned instead, so its
+// buffers are never created twice.
+//***************************************************************************************
+
+#pragma once
+
+#include "../../Common/d3dUtil.h"
+#include "../../Common/GeometryGenerator.h"
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class MeshCache
+{
+public:
+	using GenerateFunction = std::function<GeometryGenerator::MeshData()>;
+	using UploadFunction = std::function<std::shared_ptr<MeshGeometry>(GeometryGenerator::MeshData&)>;
+
+	struct Stats
+	{
+		int Requests = 0;
+		int Built = 0;
+		int KeyHits = 0;
+		int ContentHits = 0;
+
+		// Vertex and index buffer bytes that were not created, and the generator and
+		// upload time the hits would have taken, as measured when the meshes were built.
+		std::uint64_t BytesSaved = 0;
+		double MillisecondsSaved = 0.0;
+	};
+
+	MeshCache();
+	MeshCache(const MeshCache& rhs) = delete;
+	MeshCache& operator=(const MeshCache& rhs) = delete;
+	~MeshCache();
+
+	// A key naming 'generator' and the exact bits of its parameters, so parameters
+	// that print alike but differ still get their own mesh.
+	static std::string Key(const char* generator, std::initializer_list<float> params);
+
+	// The geometry for 'key', from the cache or else made with 'generate' and 'upload'.
+	// The returned geometry may be shared; its DrawArgs are shared with it.
+	std::shared_ptr<MeshGeometry> Get(const std::string& key,
+		const GenerateFunction& generate, const UploadFunction& upload);
+
+	const Stats& GetStats()const;
+
+	// Drops the cache's references and the meshes kept to check hash matches.  Shared
+	// geometry lives on with the shapes that hold it.
+	void Clear();
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<MeshGeometry> Geometry;
+		GeometryGenerator::MeshData Mesh;
+		std::uint64_t Bytes = 0;
+		double GenerateMilliseconds = 0.0;
+		double UploadMilliseconds = 0.0;
+	};
+
+	static std::uint64_t HashMesh(const GeometryGenerator::MeshData& mesh);
+	static bool SameMesh(const GeometryGenerator::MeshData& a, const GeometryGenerator::MeshData& b);
+	void CountSaved(const Entry& entry, double milliseconds);
+
+private:
+	std::vector<std::unique_ptr<Entry>> mEntries;
+	std::unordered_map<std::string, Entry*> mByKey;
+	std::unordered_multimap<std::uint64_t, Entry*> mByContent;
+	Stats mStats;
+};
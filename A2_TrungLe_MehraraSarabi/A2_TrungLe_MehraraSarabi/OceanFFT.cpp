@@ -0,0 +1,450 @@
+//***************************************************************************************
+// OceanFFT.cpp
+//***************************************************************************************
+
+#include "OceanFFT.h"
+#include "../../Common/JobSystem.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <random>
+
+#if defined(__AVX__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define OCEAN_SIMD_SSE
+#endif
+
+using namespace DirectX;
+
+namespace
+{
+	const float Gravity = 9.81f;
+
+	// Phillips spectrum for wave vector (kx, kz) under wind velocity w.
+	float Phillips(float kx, float kz, XMFLOAT2 w, float amplitude)
+	{
+		float kSq = kx*kx + kz*kz;
+		float windSpeedSq = w.x*w.x + w.y*w.y;
+		if(kSq == 0.0f || windSpeedSq == 0.0f)
+			return 0.0f;
+
+		// Largest wave arising from a continuous wind of this speed.
+		float largest = windSpeedSq / Gravity;
+
+		float kDotW = (kx*w.x + kz*w.y) / std::sqrt(kSq*windSpeedSq);
+
+		// Damp waves much shorter than the largest one.
+		float smallest = largest*0.001f;
+
+		return amplitude*std::exp(-1.0f / (kSq*largest*largest)) / (kSq*kSq) *
+			kDotW*kDotW*std::exp(-kSq*smallest*smallest);
+	}
+}
+
+OceanFFT::OceanFFT(int fftSize, float patchSize, XMFLOAT2 wind,
+	float amplitude, float choppiness, unsigned seed)
+{
+	assert(fftSize >= 4 && (fftSize & (fftSize - 1)) == 0);
+
+	const int n = fftSize;
+	mSize = n;
+	mPatchSize = patchSize;
+	mSpacing = patchSize / n;
+	mChoppiness = choppiness;
+
+	const int count = n*n;
+	mKx.resize(count);
+	mKz.resize(count);
+	mOmega.resize(count);
+	mH0Re.resize(count);
+	mH0Im.resize(count);
+
+	// Sample (r, c) holds wave vector 2pi/L * (c - n/2, r - n/2).  The n/2 Nyquist row
+	// and column have no conjugate partner and are left empty, which keeps every
+	// field the inverse transform produces real.
+	std::mt19937 random(seed);
+	std::normal_distribution<float> gauss(0.0f, 1.0f);
+	for(int r = 0; r < n; ++r)
+	{
+		for(int c = 0; c < n; ++c)
+		{
+			int k = r*n + c;
+			mKx[k] = XM_2PI*(c - n/2) / patchSize;
+			mKz[k] = XM_2PI*(r - n/2) / patchSize;
+			mOmega[k] = std::sqrt(Gravity*std::sqrt(mKx[k]*mKx[k] + mKz[k]*mKz[k]));
+
+			float xiRe = gauss(random);
+			float xiIm = gauss(random);
+			float scale = (r == 0 || c == 0) ? 0.0f :
+				std::sqrt(0.5f*Phillips(mKx[k], mKz[k], wind, amplitude));
+			mH0Re[k] = xiRe*scale;
+			mH0Im[k] = xiIm*scale;
+		}
+	}
+
+	// conj(h0(-k)); -k lives at ((n - r) mod n, (n - c) mod n).
+	mH0ConjRe.resize(count);
+	mH0ConjIm.resize(count);
+	for(int r = 0; r < n; ++r)
+	{
+		for(int c = 0; c < n; ++c)
+		{
+			int mirror = ((n - r) & (n - 1))*n + ((n - c) & (n - 1));
+			mH0ConjRe[r*n + c] = mH0Re[mirror];
+			mH0ConjIm[r*n + c] = -mH0Im[mirror];
+		}
+	}
+
+	// Stage s (half length h = 2^s) uses exp(i*pi*j/h), j < h, stored from offset h - 1.
+	mTwiddleRe.resize(n - 1);
+	mTwiddleIm.resize(n - 1);
+	for(int h = 1; h < n; h *= 2)
+	{
+		for(int j = 0; j < h; ++j)
+		{
+			mTwiddleRe[h - 1 + j] = std::cos(XM_PI*j / h);
+			mTwiddleIm[h - 1 + j] = std::sin(XM_PI*j / h);
+		}
+	}
+
+	int logSize = 0;
+	while((1 << logSize) < n)
+		++logSize;
+
+	mBitReverse.resize(n);
+	for(int i = 0; i < n; ++i)
+	{
+		int reversed = 0;
+		for(int b = 0; b < logSize; ++b)
+			reversed |= ((i >> b) & 1) << (logSize - 1 - b);
+		mBitReverse[i] = reversed;
+	}
+
+	for(int p = 0; p < PlaneCount; ++p)
+	{
+		mPlaneRe[p].resize(count);
+		mPlaneIm[p].resize(count);
+	}
+
+	mHeights.assign(count, 0.0f);
+	mDisplaceX.assign(count, 0.0f);
+	mDisplaceZ.assign(count, 0.0f);
+	mNormals.assign(count, XMFLOAT3(0.0f, 1.0f, 0.0f));
+
+	Update(0.0f);
+}
+
+OceanFFT::~OceanFFT()
+{
+}
+
+int OceanFFT::RowCount()const
+{
+	return mSize + 1;
+}
+
+int OceanFFT::ColumnCount()const
+{
+	return mSize + 1;
+}
+
+int OceanFFT::VertexCount()const
+{
+	return (mSize + 1)*(mSize + 1);
+}
+
+int OceanFFT::TriangleCount()const
+{
+	return mSize*mSize*2;
+}
+
+float OceanFFT::Width()const
+{
+	return mPatchSize;
+}
+
+float OceanFFT::Depth()const
+{
+	return mPatchSize;
+}
+
+int OceanFFT::SampleIndex(int i)const
+{
+	// Vertex rows run towards -z while field rows run towards +z; both wrap around.
+	int row = i / (mSize + 1);
+	int col = i - row*(mSize + 1);
+
+	return ((mSize - row) & (mSize - 1))*mSize + (col & (mSize - 1));
+}
+
+XMFLOAT3 OceanFFT::Position(int i)const
+{
+	int row = i / (mSize + 1);
+	int col = i - row*(mSize + 1);
+	int s = SampleIndex(i);
+
+	return XMFLOAT3(
+		-0.5f*mPatchSize + col*mSpacing + mChoppiness*mDisplaceX[s],
+		mHeights[s],
+		0.5f*mPatchSize - row*mSpacing + mChoppiness*mDisplaceZ[s]);
+}
+
+XMFLOAT3 OceanFFT::Normal(int i)const
+{
+	return mNormals[SampleIndex(i)];
+}
+
+XMFLOAT3 OceanFFT::RestPosition(int i)const
+{
+	int row = i / (mSize + 1);
+	int col = i - row*(mSize + 1);
+
+	return XMFLOAT3(-0.5f*mPatchSize + col*mSpacing, 0.0f, 0.5f*mPatchSize - row*mSpacing);
+}
+
+void OceanFFT::WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const
+{
+	// The texture follows the displaced surface, so only its scale is precomputed.
+	float invPatchSize = 1.0f / mPatchSize;
+	for(int row = row0; row < row0 + rows; ++row)
+	{
+		const int fieldRow = ((mSize - row) & (mSize - 1))*mSize;
+		const float z = 0.5f*mPatchSize - row*mSpacing;
+		for(int col = col0; col < col0 + cols; ++col)
+		{
+			int s = fieldRow + (col & (mSize - 1));
+
+			SurfaceVertex v;
+			v.Pos = XMFLOAT3(
+				-0.5f*mPatchSize + col*mSpacing + mChoppiness*mDisplaceX[s],
+				mHeights[s],
+				z + mChoppiness*mDisplaceZ[s]);
+			v.Normal = mNormals[s];
+			v.TexC = XMFLOAT2(0.5f + v.Pos.x*invPatchSize, 0.5f - v.Pos.z*invPatchSize);
+			*dst++ = v;
+		}
+	}
+}
+
+void OceanFFT::Update(float dt)
+{
+	mTime += dt;
+
+	EvaluateSpectrum();
+
+	for(int p = 0; p < PlaneCount; ++p)
+		InverseFFT2D(mPlaneRe[p].data(), mPlaneIm[p].data());
+
+	ResolveFields();
+}
+
+void OceanFFT::Disturb(int /*i*/, int /*j*/, float /*magnitude*/)
+{
+	// The spectral ocean has no local dynamics to push.
+}
+
+void OceanFFT::EvaluateSpectrum()
+{
+	const int n = mSize;
+
+	JobSystem::Default().ParallelFor(0, n, RowGrain, [this, n](int r)
+	{
+		for(int k = r*n; k < r*n + n; ++k)
+		{
+			// h(k, t) = h0(k) e^(iwt) + conj(h0(-k)) e^(-iwt)
+			float c = std::cos(mOmega[k]*mTime);
+			float s = std::sin(mOmega[k]*mTime);
+			float hRe = (mH0Re[k] + mH0ConjRe[k])*c - (mH0Im[k] - mH0ConjIm[k])*s;
+			float hIm = (mH0Im[k] + mH0ConjIm[k])*c + (mH0Re[k] - mH0ConjRe[k])*s;
+
+			// Slopes are i*k*h, displacements -i*k/|k|*h.
+			float kx = mKx[k];
+			float kz = mKz[k];
+			float kLength = std::sqrt(kx*kx + kz*kz);
+			float ux = kLength > 0.0f ? kx / kLength : 0.0f;
+			float uz = kLength > 0.0f ? kz / kLength : 0.0f;
+
+			float slopeXRe = -kx*hIm, slopeXIm = kx*hRe;
+			float slopeZRe = -kz*hIm, slopeZIm = kz*hRe;
+			float dispXRe = ux*hIm, dispXIm = -ux*hRe;
+			float dispZRe = uz*hIm, dispZIm = -uz*hRe;
+
+			// Two Hermitian spectra A and B share a plane as A + iB; the inverse
+			// transform then yields field a in the real part and b in the imaginary one.
+			mPlaneRe[0][k] = hRe - slopeXIm;
+			mPlaneIm[0][k] = hIm + slopeXRe;
+			mPlaneRe[1][k] = slopeZRe - dispXIm;
+			mPlaneIm[1][k] = slopeZIm + dispXRe;
+			mPlaneRe[2][k] = dispZRe;
+			mPlaneIm[2][k] = dispZIm;
+		}
+	});
+}
+
+void OceanFFT::InverseFFT2D(float* re, float* im)
+{
+	InverseFFTRows(re, im);
+	InverseFFTColumns(re, im);
+}
+
+void OceanFFT::InverseFFTRows(float* re, float* im)
+{
+	const int n = mSize;
+
+	JobSystem::Default().ParallelFor(0, n, RowGrain, [this, re, im, n](int row)
+	{
+		float* xr = re + row*n;
+		float* xi = im + row*n;
+
+		for(int i = 0; i < n; ++i)
+		{
+			int j = mBitReverse[i];
+			if(i < j)
+			{
+				std::swap(xr[i], xr[j]);
+				std::swap(xi[i], xi[j]);
+			}
+		}
+
+		for(int h = 1; h < n; h *= 2)
+		{
+			const float* wr = &mTwiddleRe[h - 1];
+			const float* wi = &mTwiddleIm[h - 1];
+
+			for(int s = 0; s < n; s += 2*h)
+			{
+				float* ar = xr + s;
+				float* ai = xi + s;
+				float* br = xr + s + h;
+				float* bi = xi + s + h;
+
+				int j = 0;
+
+#if defined(OCEAN_SIMD_SSE)
+				// Four butterflies at a time once a stage is at least four wide.
+				for(; j + 4 <= h; j += 4)
+				{
+					__m128 twr = _mm_loadu_ps(wr + j);
+					__m128 twi = _mm_loadu_ps(wi + j);
+					__m128 xbr = _mm_loadu_ps(br + j);
+					__m128 xbi = _mm_loadu_ps(bi + j);
+					__m128 tr = _mm_sub_ps(_mm_mul_ps(xbr, twr), _mm_mul_ps(xbi, twi));
+					__m128 ti = _mm_add_ps(_mm_mul_ps(xbr, twi), _mm_mul_ps(xbi, twr));
+					__m128 xar = _mm_loadu_ps(ar + j);
+					__m128 xai = _mm_loadu_ps(ai + j);
+					_mm_storeu_ps(ar + j, _mm_add_ps(xar, tr));
+					_mm_storeu_ps(ai + j, _mm_add_ps(xai, ti));
+					_mm_storeu_ps(br + j, _mm_sub_ps(xar, tr));
+					_mm_storeu_ps(bi + j, _mm_sub_ps(xai, ti));
+				}
+#endif
+
+				for(; j < h; ++j)
+				{
+					float tr = br[j]*wr[j] - bi[j]*wi[j];
+					float ti = br[j]*wi[j] + bi[j]*wr[j];
+					br[j] = ar[j] - tr;
+					bi[j] = ai[j] - ti;
+					ar[j] += tr;
+					ai[j] += ti;
+				}
+			}
+		}
+	});
+}
+
+void OceanFFT::InverseFFTColumns(float* re, float* im)
+{
+	const int n = mSize;
+	const int stripCount = (n + ColumnStrip - 1) / ColumnStrip;
+
+	// The columns are transformed in place, a strip of neighbouring columns per job.
+	// Every butterfly combines two rows of the strip with one twiddle factor, so it
+	// runs across the columns in contiguous memory and no transpose is needed.
+	JobSystem::Default().ParallelFor(0, stripCount, [this, re, im, n](int strip)
+	{
+		const int c0 = strip*ColumnStrip;
+		const int width = std::min(ColumnStrip, n - c0);
+
+		for(int i = 0; i < n; ++i)
+		{
+			int j = mBitReverse[i];
+			if(i < j)
+			{
+				std::swap_ranges(re + i*n + c0, re + i*n + c0 + width, re + j*n + c0);
+				std::swap_ranges(im + i*n + c0, im + i*n + c0 + width, im + j*n + c0);
+			}
+		}
+
+		for(int h = 1; h < n; h *= 2)
+		{
+			for(int s = 0; s < n; s += 2*h)
+			{
+				for(int j = 0; j < h; ++j)
+				{
+					const float wr = mTwiddleRe[h - 1 + j];
+					const float wi = mTwiddleIm[h - 1 + j];
+					float* ar = re + (s + j)*n + c0;
+					float* ai = im + (s + j)*n + c0;
+					float* br = re + (s + j + h)*n + c0;
+					float* bi = im + (s + j + h)*n + c0;
+
+					int c = 0;
+
+#if defined(OCEAN_SIMD_SSE)
+					const __m128 twr = _mm_set1_ps(wr);
+					const __m128 twi = _mm_set1_ps(wi);
+					for(; c + 4 <= width; c += 4)
+					{
+						__m128 xbr = _mm_loadu_ps(br + c);
+						__m128 xbi = _mm_loadu_ps(bi + c);
+						__m128 tr = _mm_sub_ps(_mm_mul_ps(xbr, twr), _mm_mul_ps(xbi, twi));
+						__m128 ti = _mm_add_ps(_mm_mul_ps(xbr, twi), _mm_mul_ps(xbi, twr));
+						__m128 xar = _mm_loadu_ps(ar + c);
+						__m128 xai = _mm_loadu_ps(ai + c);
+						_mm_storeu_ps(ar + c, _mm_add_ps(xar, tr));
+						_mm_storeu_ps(ai + c, _mm_add_ps(xai, ti));
+						_mm_storeu_ps(br + c, _mm_sub_ps(xar, tr));
+						_mm_storeu_ps(bi + c, _mm_sub_ps(xai, ti));
+					}
+#endif
+
+					for(; c < width; ++c)
+					{
+						float tr = br[c]*wr - bi[c]*wi;
+						float ti = br[c]*wi + bi[c]*wr;
+						br[c] = ar[c] - tr;
+						bi[c] = ai[c] - ti;
+						ar[c] += tr;
+						ai[c] += ti;
+					}
+				}
+			}
+		}
+	});
+}
+
+void OceanFFT::ResolveFields()
+{
+	const int n = mSize;
+
+	JobSystem::Default().ParallelFor(0, n, RowGrain, [this, n](int r)
+	{
+		for(int c = 0; c < n; ++c)
+		{
+			int k = r*n + c;
+
+			// Centring the spectrum multiplies sample (r, c) by (-1)^(r + c).
+			float sign = ((r + c) & 1) ? -1.0f : 1.0f;
+
+			mHeights[k] = sign*mPlaneRe[0][k];
+			mDisplaceX[k] = sign*mPlaneIm[1][k];
+			mDisplaceZ[k] = sign*mPlaneRe[2][k];
+
+			float slopeX = sign*mPlaneIm[0][k];
+			float slopeZ = sign*mPlaneRe[1][k];
+			float invLength = 1.0f / std::sqrt(slopeX*slopeX + 1.0f + slopeZ*slopeZ);
+			mNormals[k] = XMFLOAT3(-slopeX*invLength, invLength, -slopeZ*invLength);
+		}
+	});
+}
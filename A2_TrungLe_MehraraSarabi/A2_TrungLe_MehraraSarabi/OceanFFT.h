@@ -0,0 +1,97 @@
+//***************************************************************************************
+// OceanFFT.h
+//
+// Deep water ocean after Tessendorf, "Simulating Ocean Water".  A Phillips spectrum of
+// wind driven waves is evolved in frequency space and turned back into height,
+// horizontal displacement and slope fields with inverse FFTs on every update.
+//
+// The fields are periodic, so one patch tiles seamlessly, and the cost of an update
+// depends only on the FFT size, not on the area the patch covers.
+//***************************************************************************************
+
+#pragma once
+
+#include "IWaveSimulator.h"
+#include <vector>
+
+class OceanFFT : public IWaveSimulator
+{
+public:
+	// fftSize is the number of samples per side, a power of two no smaller than 4.
+	// patchSize is the width of one periodic patch.  wind is the wind velocity in the
+	// x/z plane, amplitude the Phillips spectrum constant and choppiness the scale of
+	// the horizontal displacement (0 gives plain height field waves).
+	OceanFFT(int fftSize, float patchSize, DirectX::XMFLOAT2 wind,
+		float amplitude, float choppiness, unsigned seed = 1);
+	OceanFFT(const OceanFFT& rhs) = delete;
+	OceanFFT& operator=(const OceanFFT& rhs) = delete;
+	~OceanFFT()override;
+
+	// The vertex grid has one more row and column than the FFT; the last ones repeat
+	// the first, so neighbouring patches meet without a seam.
+	int RowCount()const override;
+	int ColumnCount()const override;
+	int VertexCount()const override;
+	int TriangleCount()const override;
+	float Width()const override;
+	float Depth()const override;
+
+	DirectX::XMFLOAT3 Position(int i)const override;
+	DirectX::XMFLOAT3 Normal(int i)const override;
+	DirectX::XMFLOAT3 RestPosition(int i)const override;
+	void WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const override;
+
+	void Update(float dt)override;
+
+	// The spectral ocean has no local dynamics; disturbances are ignored.
+	void Disturb(int i, int j, float magnitude)override;
+
+private:
+	int SampleIndex(int i)const;
+
+	void EvaluateSpectrum();
+	void InverseFFT2D(float* re, float* im);
+	void InverseFFTRows(float* re, float* im);
+	void InverseFFTColumns(float* re, float* im);
+	void ResolveFields();
+
+private:
+	int mSize = 0;
+	float mPatchSize = 0.0f;
+	float mSpacing = 0.0f;
+	float mChoppiness = 0.0f;
+	float mTime = 0.0f;
+
+	// Per wave vector, in the same row major order as the fields with the zero
+	// frequency in the middle: the wave numbers, the dispersion and the initial
+	// amplitudes h0(k) and conj(h0(-k)).
+	std::vector<float> mKx;
+	std::vector<float> mKz;
+	std::vector<float> mOmega;
+	std::vector<float> mH0Re;
+	std::vector<float> mH0Im;
+	std::vector<float> mH0ConjRe;
+	std::vector<float> mH0ConjIm;
+
+	// Radix-2 twiddle factors, the mSize/2 factors of the last stage preceded by those
+	// of every smaller stage, and the bit reversal permutation.
+	std::vector<float> mTwiddleRe;
+	std::vector<float> mTwiddleIm;
+	std::vector<int> mBitReverse;
+
+	// Complex planes in structure of arrays form.  The fields are real, so each plane
+	// carries two of them: (height, slope x), (slope z, displacement x), (displacement z).
+	static const int PlaneCount = 3;
+
+	// Grid rows per job of the row parallel passes, and columns per job of the column
+	// FFT.
+	static const int RowGrain = 8;
+	static const int ColumnStrip = 16;
+	std::vector<float> mPlaneRe[PlaneCount];
+	std::vector<float> mPlaneIm[PlaneCount];
+
+	std::vector<float> mHeights;
+	std::vector<float> mDisplaceX;
+	std::vector<float> mDisplaceZ;
+	std::vector<DirectX::XMFLOAT3> mNormals;
+};
@@ -112,6 +112,37 @@ VertexOut VS(VertexIn vin)
     return vout;
 }
 
+// The pond's vertices come in two streams: the static grid x/z and texture coordinates,
+// and per frame the height and the octahedron encoded normal (Waves::CompactVertex).
+struct WaterVertexIn
+{
+	float2 PosXZ     : POSITION;
+	float2 TexC      : TEXCOORD;
+	float  Height    : HEIGHT;
+	float2 NormalOct : NORMAL;
+};
+
+// Inverse of EncodeOctahedral in Waves.cpp: the pole is +y and the lower hemisphere
+// is folded over the diagonals.
+float3 DecodeOctahedral(float2 e)
+{
+    float3 n = float3(e.x, 1.0f - abs(e.x) - abs(e.y), e.y);
+    if (n.y < 0.0f)
+        n.xz = (1.0f - abs(n.zx)) * (n.xz >= 0.0f ? 1.0f : -1.0f);
+
+    return normalize(n);
+}
+
+VertexOut WaterVS(WaterVertexIn win)
+{
+    VertexIn vin;
+    vin.PosL = float3(win.PosXZ.x, win.Height, win.PosXZ.y);
+    vin.NormalL = DecodeOctahedral(win.NormalOct);
+    vin.TexC = win.TexC;
+
+    return VS(vin);
+}
+
 float4 PS(VertexOut pin) : SV_Target
 {
     float4 diffuseAlbedo = gDiffuseMap.Sample(gsamAnisotropicWrap, pin.TexC) * gDiffuseAlbedo;
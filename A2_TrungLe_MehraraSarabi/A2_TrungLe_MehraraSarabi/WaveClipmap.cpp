@@ -0,0 +1,319 @@
+//***************************************************************************************
+// WaveClipmap.cpp
+//***************************************************************************************
+
+#include "WaveClipmap.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+
+using namespace DirectX;
+
+WaveClipmap::WaveClipmap(int levels, int size, float dx, float dt, float speed, float damping,
+	Waves::Storage storage)
+	: mSize(size), mSpacing(dx)
+{
+	// A level spans an even number of coarser cells and its centre may sit one coarser
+	// cell off the coarser level's centre, which must still leave it inside.
+	assert(levels >= 1 && size >= 9 && (size - 1) % 4 == 0);
+
+	for(int l = 0; l < levels; ++l)
+		mWorld.AddPond(size, size, dx*(float)(1 << l), dt, speed, damping, std::vector<bool>(), storage);
+
+	// Waves leave the outermost level through an absorbing band instead of reflecting
+	// back towards the viewer.  The band stays clear of the next finer level.
+	mWorld.Pond(levels - 1).SetAbsorbingBoundary(std::max(2, size / 16));
+
+	mCenterX.assign(levels, 0);
+	mCenterZ.assign(levels, 0);
+}
+
+WaveClipmap::~WaveClipmap()
+{
+}
+
+int WaveClipmap::LevelCount()const
+{
+	return mWorld.PondCount();
+}
+
+Waves& WaveClipmap::Level(int level)
+{
+	return mWorld.Pond(level);
+}
+
+const Waves& WaveClipmap::Level(int level)const
+{
+	return mWorld.Pond(level);
+}
+
+float WaveClipmap::Width()const
+{
+	return (mSize - 1)*Spacing(LevelCount() - 1);
+}
+
+XMFLOAT2 WaveClipmap::LevelCenter(int level)const
+{
+	return XMFLOAT2(mCenterX[level]*Spacing(level), mCenterZ[level]*Spacing(level));
+}
+
+void WaveClipmap::LevelHole(int level, int& row0, int& col0, int& rows, int& cols)const
+{
+	if(level == 0)
+	{
+		row0 = col0 = rows = cols = 0;
+		return;
+	}
+
+	row0 = OffsetZ(level - 1) / 2;
+	col0 = OffsetX(level - 1) / 2;
+	rows = cols = (mSize - 1) / 2;
+}
+
+void WaveClipmap::Update(float dt, const XMFLOAT2& eye)
+{
+	Recenter(eye);
+
+	// The levels share their time step and substep limit, so their clocks agree.
+	// All of them advance, which keeps their interpolation factors equal too.
+	int steps = 0;
+	for(int l = 0; l < LevelCount(); ++l)
+		steps = Level(l).AdvanceClock(dt);
+
+	for(int k = 0; k < steps; ++k)
+		Step();
+}
+
+void WaveClipmap::SetMaxSubsteps(int steps)
+{
+	for(int l = 0; l < LevelCount(); ++l)
+		Level(l).SetMaxSubsteps(steps);
+}
+
+void WaveClipmap::EnableInterpolation(bool enable)
+{
+	for(int l = 0; l < LevelCount(); ++l)
+		Level(l).EnableInterpolation(enable);
+}
+
+void WaveClipmap::Step()
+{
+	// All levels step in one batched dispatch.  The coarser levels then take the finer
+	// solutions inside, from the finest outwards, and the finer levels their new
+	// boundaries, from the coarsest inwards.
+	mWorld.Step();
+
+	const int levels = LevelCount();
+	for(int l = 0; l + 1 < levels; ++l)
+		Restrict(l);
+
+	for(int l = levels - 2; l >= 0; --l)
+		ProlongBoundary(l);
+}
+
+void WaveClipmap::DisturbBatch(const Waves::Impulse* impulses, int count)
+{
+	for(int l = 0; l < LevelCount(); ++l)
+	{
+		XMFLOAT2 center = LevelCenter(l);
+
+		mLevelImpulses.clear();
+		for(int k = 0; k < count; ++k)
+		{
+			// Keep clear of the level's boundary ring, which the coupling overwrites.
+			if(FinestLevelAt(impulses[k].X, impulses[k].Z, 2.0f) != l)
+				continue;
+
+			Waves::Impulse impulse = impulses[k];
+			impulse.X -= center.x;
+			impulse.Z -= center.y;
+			mLevelImpulses.push_back(impulse);
+		}
+
+		if(!mLevelImpulses.empty())
+			Level(l).DisturbBatch(mLevelImpulses.data(), (int)mLevelImpulses.size());
+	}
+}
+
+void WaveClipmap::SampleHeights(const XMFLOAT2* xz, float* heights, int count)const
+{
+	for(int k = 0; k < count; ++k)
+	{
+		// Points outside every level clamp to the edge of the outermost one.
+		int l = FinestLevelAt(xz[k].x, xz[k].y, 0.0f);
+		if(l < 0)
+			l = LevelCount() - 1;
+
+		XMFLOAT2 center = LevelCenter(l);
+		XMFLOAT2 local(xz[k].x - center.x, xz[k].y - center.y);
+		Level(l).SampleHeights(&local, &heights[k], 1);
+	}
+}
+
+void WaveClipmap::Recenter(const XMFLOAT2& eye)
+{
+	const int n = mSize;
+	const int levels = LevelCount();
+
+	// Coarser levels move first, so the finer ones fill in from where they already are.
+	bool moved = false;
+	for(int l = levels - 1; l >= 0; --l)
+	{
+		float step = 2.0f*Spacing(l);
+		int centerX = 2*(int)std::floor(eye.x / step + 0.5f);
+		int centerZ = 2*(int)std::floor(eye.y / step + 0.5f);
+		if(centerX == mCenterX[l] && centerZ == mCenterZ[l])
+			continue;
+
+		// Columns run along +x and rows along -z.
+		int rows = mCenterZ[l] - centerZ;
+		int cols = centerX - mCenterX[l];
+		Level(l).Shift(rows, cols);
+		mCenterX[l] = centerX;
+		mCenterZ[l] = centerZ;
+		moved = true;
+
+		// The outermost level has nothing around it; the water scrolled in is calm.
+		if(l == levels - 1)
+			continue;
+
+		// The rows scrolled in, then the columns scrolled in beside them.
+		int newRows = std::min(std::abs(rows), n);
+		int newCols = std::min(std::abs(cols), n);
+		Prolong(l, rows > 0 ? n - newRows : 0, 0, newRows, n);
+		Prolong(l, rows > 0 ? 0 : newRows, cols > 0 ? n - newCols : 0, n - newRows, newCols);
+	}
+
+	// The boundaries follow the levels' new places in each other.
+	if(moved)
+	{
+		for(int l = levels - 2; l >= 0; --l)
+			ProlongBoundary(l);
+	}
+}
+
+void WaveClipmap::Restrict(int level)
+{
+	// The coarser points inside the finer level take the full weighted average of the
+	// finer points around them, which filters out the waves too short for the coarser
+	// grid instead of aliasing them.  The points on the finer level's edge keep their
+	// own solution; they are what the finer boundary is made of.
+	const int n = mSize;
+	const int offsetX = OffsetX(level);
+	const int offsetZ = OffsetZ(level);
+
+	mFinePrev.resize(n*n);
+	mFineCurr.resize(n*n);
+	Level(level).ReadTimeLevels(0, 0, n, n, mFinePrev.data(), mFineCurr.data());
+
+	const int row0 = offsetZ / 2 + 1;
+	const int col0 = offsetX / 2 + 1;
+	const int count = (n - 1) / 2 - 1;
+	mCoarsePrev.resize(count*count);
+	mCoarseCurr.resize(count*count);
+
+	auto fullWeight = [n](const float* p)
+	{
+		return (4.0f*p[0] +
+			2.0f*(p[-1] + p[1] + p[-n] + p[n]) +
+			p[-n-1] + p[-n+1] + p[n-1] + p[n+1]) * (1.0f / 16.0f);
+	};
+
+	for(int r = 0; r < count; ++r)
+	{
+		int i = 2*(row0 + r) - offsetZ;
+		for(int c = 0; c < count; ++c)
+		{
+			int j = 2*(col0 + c) - offsetX;
+			mCoarsePrev[r*count + c] = fullWeight(&mFinePrev[i*n + j]);
+			mCoarseCurr[r*count + c] = fullWeight(&mFineCurr[i*n + j]);
+		}
+	}
+
+	Level(level + 1).WriteTimeLevels(row0, col0, count, count, mCoarsePrev.data(), mCoarseCurr.data());
+}
+
+void WaveClipmap::Prolong(int level, int row0, int col0, int rows, int cols)
+{
+	// Bilinearly interpolates the rows x cols block of 'level' from the next coarser
+	// level.  Points halfway between coarser points get the mean of the two or four
+	// around them, so the finer surface meets the coarser one without cracks.
+	if(rows <= 0 || cols <= 0)
+		return;
+
+	const int offsetX = OffsetX(level);
+	const int offsetZ = OffsetZ(level);
+
+	// The coarser points around the block.
+	const int coarseRow0 = (row0 + offsetZ) / 2;
+	const int coarseCol0 = (col0 + offsetX) / 2;
+	const int coarseRows = (row0 + rows - 1 + offsetZ + 1) / 2 - coarseRow0 + 1;
+	const int coarseCols = (col0 + cols - 1 + offsetX + 1) / 2 - coarseCol0 + 1;
+
+	mCoarsePrev.resize(coarseRows*coarseCols);
+	mCoarseCurr.resize(coarseRows*coarseCols);
+	Level(level + 1).ReadTimeLevels(coarseRow0, coarseCol0, coarseRows, coarseCols,
+		mCoarsePrev.data(), mCoarseCurr.data());
+
+	mFinePrev.resize(rows*cols);
+	mFineCurr.resize(rows*cols);
+	for(int i = 0; i < rows; ++i)
+	{
+		int a = row0 + i + offsetZ;
+		for(int j = 0; j < cols; ++j)
+		{
+			int b = col0 + j + offsetX;
+
+			// Odd coordinates lie halfway to the next coarser point.
+			int k00 = (a/2 - coarseRow0)*coarseCols + b/2 - coarseCol0;
+			int k10 = k00 + (a & 1)*coarseCols;
+			int k01 = k00 + (b & 1);
+			int k11 = k10 + (b & 1);
+
+			mFinePrev[i*cols + j] = 0.25f*(mCoarsePrev[k00] + mCoarsePrev[k10] + mCoarsePrev[k01] + mCoarsePrev[k11]);
+			mFineCurr[i*cols + j] = 0.25f*(mCoarseCurr[k00] + mCoarseCurr[k10] + mCoarseCurr[k01] + mCoarseCurr[k11]);
+		}
+	}
+
+	Level(level).WriteTimeLevels(row0, col0, rows, cols, mFinePrev.data(), mFineCurr.data());
+}
+
+void WaveClipmap::ProlongBoundary(int level)
+{
+	// The outer ring of grid points: top and bottom rows, then the sides between them.
+	const int n = mSize;
+	Prolong(level, 0, 0, 1, n);
+	Prolong(level, n - 1, 0, 1, n);
+	Prolong(level, 1, 0, n - 2, 1);
+	Prolong(level, 1, n - 1, n - 2, 1);
+}
+
+int WaveClipmap::FinestLevelAt(float x, float z, float margin)const
+{
+	// 'margin' is in grid points of the level tested.
+	for(int l = 0; l < LevelCount(); ++l)
+	{
+		XMFLOAT2 center = LevelCenter(l);
+		float extent = ((mSize - 1) / 2 - margin)*Spacing(l);
+		if(std::abs(x - center.x) <= extent && std::abs(z - center.y) <= extent)
+			return l;
+	}
+
+	return -1;
+}
+
+float WaveClipmap::Spacing(int level)const
+{
+	return mSpacing*(float)(1 << level);
+}
+
+int WaveClipmap::OffsetX(int level)const
+{
+	return mCenterX[level] - 2*mCenterX[level + 1] + (mSize - 1) / 2;
+}
+
+int WaveClipmap::OffsetZ(int level)const
+{
+	return 2*mCenterZ[level + 1] - mCenterZ[level] + (mSize - 1) / 2;
+}
@@ -0,0 +1,99 @@
+//***************************************************************************************
+// WaveClipmap.h
+//
+// Simulates open water around a moving viewer with nested Waves grids (a clipmap).
+// Every level has the same number of points and is centred on the viewer, at twice
+// the spacing of the level inside it, so each level covers four times the area of the
+// one inside it at the same cost.  Detail is finest where the viewer is.
+//
+// The levels are stepped together and coupled after every step.  Where two levels
+// overlap the coarser one takes the finer solution (restriction), and the outer ring
+// of the finer level takes the coarser solution (prolongation), which is its boundary
+// for the next step.  As the viewer moves, the levels scroll by whole grid points and
+// the points scrolled into a level are filled in from the level around it.
+//***************************************************************************************
+
+#pragma once
+
+#include "WaveWorld.h"
+#include <DirectXMath.h>
+#include <vector>
+
+class WaveClipmap
+{
+public:
+	// 'levels' grids of size x size points, the finest one with spacing dx; size - 1
+	// must be a multiple of 4.  The other arguments are those of Waves and must keep
+	// the finest level stable.  The levels start out centred on the origin.
+	WaveClipmap(int levels, int size, float dx, float dt, float speed, float damping,
+		Waves::Storage storage = Waves::Storage::Float32);
+	WaveClipmap(const WaveClipmap& rhs) = delete;
+	WaveClipmap& operator=(const WaveClipmap& rhs) = delete;
+	~WaveClipmap();
+
+	int LevelCount()const;
+	Waves& Level(int level);
+	const Waves& Level(int level)const;
+
+	// Width and depth of the area all levels together cover.
+	float Width()const;
+
+	// World x/z of the centre of a level; adding it to the level's Position() gives
+	// world coordinates.
+	DirectX::XMFLOAT2 LevelCenter(int level)const;
+
+	// The block of grid cells of 'level' that the next finer level covers, as its first
+	// row and column and its size in cells.  A renderer draws every level but this
+	// block.  The finest level has no hole (rows = cols = 0).
+	void LevelHole(int level, int& row0, int& col0, int& rows, int& cols)const;
+
+	// Scrolls the levels to stay centred on 'eye' (world x/z), then advances the
+	// simulation by dt seconds of frame time, taking the steps that are due as
+	// Waves::Update does.
+	void Update(float dt, const DirectX::XMFLOAT2& eye);
+
+	// Waves::SetMaxSubsteps and Waves::EnableInterpolation for every level.
+	void SetMaxSubsteps(int steps);
+	void EnableInterpolation(bool enable);
+
+	// Steps every level once and couples them.
+	void Step();
+
+	// Impulses in world x/z.  Each goes to the finest level whose interior holds its
+	// centre; the coarser levels receive it through the coupling.
+	void DisturbBatch(const Waves::Impulse* impulses, int count);
+
+	// Bilinearly samples the finest level covering each world x/z position.
+	void SampleHeights(const DirectX::XMFLOAT2* xz, float* heights, int count)const;
+
+private:
+	void Recenter(const DirectX::XMFLOAT2& eye);
+	void Restrict(int level);
+	void Prolong(int level, int row0, int col0, int rows, int cols);
+	void ProlongBoundary(int level);
+	int FinestLevelAt(float x, float z, float margin)const;
+	float Spacing(int level)const;
+
+	// Where a level lies in the next coarser one: its point at row i, column j is at
+	// row (i + OffsetZ)/2, column (j + OffsetX)/2 of the coarser level.  Both offsets
+	// are even, so every other point of the finer level sits on a coarser one.
+	int OffsetX(int level)const;
+	int OffsetZ(int level)const;
+
+private:
+	WaveWorld mWorld;
+	int mSize = 0;
+	float mSpacing = 0.0f;
+
+	// Centre of every level in units of its own spacing; always even, so a level's
+	// points line up with those of the next coarser level.
+	std::vector<int> mCenterX;
+	std::vector<int> mCenterZ;
+
+	// Scratch time levels for the coupling.
+	std::vector<float> mFinePrev;
+	std::vector<float> mFineCurr;
+	std::vector<float> mCoarsePrev;
+	std::vector<float> mCoarseCurr;
+	std::vector<Waves::Impulse> mLevelImpulses;
+};
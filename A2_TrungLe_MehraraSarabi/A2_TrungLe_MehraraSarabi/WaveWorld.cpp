@@ -0,0 +1,117 @@
+//***************************************************************************************
+// WaveWorld.cpp
+//***************************************************************************************
+
+#include "WaveWorld.h"
+#include "../../Common/JobSystem.h"
+#include <algorithm>
+
+WaveWorld::WaveWorld()
+{
+}
+
+WaveWorld::~WaveWorld()
+{
+}
+
+int WaveWorld::AddPond(int m, int n, float dx, float dt, float speed, float damping,
+	const std::vector<bool>& wetMask, Waves::Storage storage)
+{
+	mPonds.push_back(std::make_unique<Waves>(m, n, dx, dt, speed, damping, wetMask, storage));
+
+	return (int)mPonds.size() - 1;
+}
+
+int WaveWorld::PondCount()const
+{
+	return (int)mPonds.size();
+}
+
+Waves& WaveWorld::Pond(int i)
+{
+	return *mPonds[i];
+}
+
+const Waves& WaveWorld::Pond(int i)const
+{
+	return *mPonds[i];
+}
+
+void WaveWorld::Update(float dt)
+{
+	int rounds = 0;
+	mStepsDue.clear();
+	for(const auto& pond : mPonds)
+	{
+		mStepsDue.push_back(pond->AdvanceClock(dt));
+		rounds = std::max(rounds, mStepsDue.back());
+	}
+
+	// Ponds may be due several steps.  Each round steps every pond still due one, so
+	// the ponds stay batched together.
+	for(int round = 0; round < rounds; ++round)
+	{
+		mDuePonds.clear();
+		for(size_t p = 0; p < mPonds.size(); ++p)
+		{
+			if(mStepsDue[p] > round)
+				mDuePonds.push_back(mPonds[p].get());
+		}
+
+		StepPonds(mDuePonds);
+	}
+}
+
+void WaveWorld::Step()
+{
+	mDuePonds.clear();
+	for(const auto& pond : mPonds)
+		mDuePonds.push_back(pond.get());
+
+	StepPonds(mDuePonds);
+}
+
+void WaveWorld::StepPonds(const std::vector<Waves*>& ponds)
+{
+	if(ponds.empty())
+		return;
+
+	// The per pond bookkeeping before and after the sweeps is independent too.
+	JobSystem::Default().ParallelFor(0, (int)ponds.size(), [&ponds](int p)
+	{
+		ponds[p]->BeginStep();
+	});
+
+	int passes = 0;
+	for(Waves* pond : ponds)
+		passes = std::max(passes, pond->SweepPassCount());
+
+	for(int pass = 0; pass < passes; ++pass)
+	{
+		// Number the bands of all ponds in this pass consecutively.
+		mPassPonds.clear();
+		mBandStart.clear();
+		int bandCount = 0;
+		for(Waves* pond : ponds)
+		{
+			if(pass >= pond->SweepPassCount())
+				continue;
+
+			mPassPonds.push_back(pond);
+			mBandStart.push_back(bandCount);
+			bandCount += pond->BandCount();
+		}
+
+		JobSystem::Default().ParallelFor(0, bandCount, [this, pass](int band)
+		{
+			// The pond owning the band is the last one starting at or before it.
+			int p = (int)(std::upper_bound(mBandStart.begin(), mBandStart.end(), band) - mBandStart.begin()) - 1;
+			mPassPonds[p]->SweepBand(pass, band - mBandStart[p]);
+		});
+	}
+
+	JobSystem::Default().ParallelFor(0, (int)ponds.size(), [&ponds](int p)
+	{
+		ponds[p]->EndStep();
+	});
+}
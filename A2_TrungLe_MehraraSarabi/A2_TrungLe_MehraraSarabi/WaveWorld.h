@@ -0,0 +1,53 @@
+//***************************************************************************************
+// WaveWorld.h
+//
+// Owns any number of independent Waves ponds of different sizes and steps them together.
+//
+// Each pond keeps its own clock.  The ponds that are due on an Update are stepped in one
+// parallel dispatch per solver pass, over the bands of all of them at once, so many
+// small ponds keep every core busy instead of each paying for its own fork and join.
+//***************************************************************************************
+
+#pragma once
+
+#include "Waves.h"
+#include <memory>
+#include <vector>
+
+class WaveWorld
+{
+public:
+	WaveWorld();
+	WaveWorld(const WaveWorld& rhs) = delete;
+	WaveWorld& operator=(const WaveWorld& rhs) = delete;
+	~WaveWorld();
+
+	// Adds a pond built from the Waves constructor arguments and returns its index.
+	int AddPond(int m, int n, float dx, float dt, float speed, float damping,
+		const std::vector<bool>& wetMask = std::vector<bool>(),
+		Waves::Storage storage = Waves::Storage::Float32);
+
+	int PondCount()const;
+	Waves& Pond(int i);
+	const Waves& Pond(int i)const;
+
+	// Advances the clock of every pond by dt seconds and takes the steps each pond is
+	// due, with the same result as calling Update(dt) on each of them.
+	void Update(float dt);
+
+	// Steps every pond once, whatever its clock.
+	void Step();
+
+private:
+	void StepPonds(const std::vector<Waves*>& ponds);
+
+private:
+	std::vector<std::unique_ptr<Waves>> mPonds;
+
+	// Scratch lists: the steps each pond is due, the ponds being stepped, those taking
+	// part in the current pass and the first flattened band of each of the latter.
+	std::vector<Waves*> mDuePonds;
+	std::vector<int> mStepsDue;
+	std::vector<Waves*> mPassPonds;
+	std::vector<int> mBandStart;
+};
@@ -3,15 +3,672 @@
 //***************************************************************************************
 
 #include "Waves.h"
-#include <ppl.h>
+#include "../../Common/JobSystem.h"
 #include <algorithm>
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The kernels follow the compiler's target: the x64 project configurations build with
+// /arch:AVX2, other targets fall back to SSE2 or scalar code.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define WAVES_SIMD_AVX
+#if defined(__AVX2__)
+#define WAVES_SIMD_AVX2
+#endif
+// F16C converts half precision heights in registers.  MSVC has no switch for it, but
+// every processor with AVX2 supports it.
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define WAVES_SIMD_F16C
+#endif
+#elif defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define WAVES_SIMD_SSE
+#endif
 
 using namespace DirectX;
 
-Waves::Waves(int m, int n, float dx, float dt, float speed, float damping)
+namespace
+{
+	// IEEE half precision conversions.  Both round to nearest even and keep subnormals,
+	// like the F16C instructions, so the scalar and SIMD paths agree bit for bit.
+	std::uint16_t FloatToHalf(float value)
+	{
+		std::uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+
+		std::uint32_t sign = (bits >> 16) & 0x8000;
+		std::uint32_t magnitude = bits & 0x7fffffff;
+
+		// NaN stays a (quiet) NaN; anything from 2^16 up overflows to infinity.
+		if(magnitude > 0x7f800000)
+			return (std::uint16_t)(sign | 0x7e00 | ((magnitude >> 13) & 0x3ff));
+		if(magnitude >= 0x47800000)
+			return (std::uint16_t)(sign | 0x7c00);
+
+		// Below 2^-14 the result is subnormal, below 2^-25 it rounds to zero.
+		if(magnitude < 0x38800000)
+		{
+			if(magnitude < 0x33000000)
+				return (std::uint16_t)sign;
+
+			std::uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+			std::uint32_t shift = 126 - (magnitude >> 23);
+			std::uint32_t result = mantissa >> shift;
+			std::uint32_t rest = mantissa & ((1u << shift) - 1);
+			std::uint32_t halfway = 1u << (shift - 1);
+			if(rest > halfway || (rest == halfway && (result & 1)))
+				++result;
+
+			return (std::uint16_t)(sign | result);
+		}
+
+		// Rebias the exponent and round off 13 mantissa bits; a carry out of the
+		// mantissa correctly bumps the exponent, up to infinity.
+		std::uint32_t result = (magnitude - 0x38000000) >> 13;
+		std::uint32_t rest = magnitude & 0x1fff;
+		if(rest > 0x1000 || (rest == 0x1000 && (result & 1)))
+			++result;
+
+		return (std::uint16_t)(sign | result);
+	}
+
+	float HalfToFloat(std::uint16_t value)
+	{
+		std::uint32_t sign = (std::uint32_t)(value & 0x8000) << 16;
+		std::uint32_t exponent = (value >> 10) & 0x1f;
+		std::uint32_t mantissa = value & 0x3ff;
+
+		std::uint32_t bits;
+		if(exponent == 0x1f)
+			bits = sign | 0x7f800000 | (mantissa ? 0x400000 | (mantissa << 13) : 0);
+		else if(exponent != 0)
+			bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+		else
+		{
+			// Zero or subnormal; mantissa*2^-24 is exact in single precision.
+			float magnitude = mantissa*(1.0f / 16777216.0f);
+			std::memcpy(&bits, &magnitude, sizeof(bits));
+			bits |= sign;
+		}
+
+		float result;
+		std::memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	// Reads and writes of one height plane element, whatever its storage type.
+	float LoadHeight(float value)
+	{
+		return value;
+	}
+
+	float LoadHeight(std::uint16_t value)
+	{
+		return HalfToFloat(value);
+	}
+
+	void StoreHeight(float& dst, float value)
+	{
+		dst = value;
+	}
+
+	void StoreHeight(std::uint16_t& dst, float value)
+	{
+		dst = FloatToHalf(value);
+	}
+
+#if defined(WAVES_SIMD_AVX)
+	// The same for eight or four consecutive elements.
+	__m256 Load8(const std::uint16_t* p)
+	{
+#if defined(WAVES_SIMD_F16C)
+		return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+#else
+		alignas(32) float lanes[8];
+		for(int k = 0; k < 8; ++k)
+			lanes[k] = HalfToFloat(p[k]);
+		return _mm256_load_ps(lanes);
+#endif
+	}
+
+	void Store8(std::uint16_t* p, __m256 v)
+	{
+#if defined(WAVES_SIMD_F16C)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+#else
+		alignas(32) float lanes[8];
+		_mm256_store_ps(lanes, v);
+		for(int k = 0; k < 8; ++k)
+			p[k] = FloatToHalf(lanes[k]);
+#endif
+	}
+#endif
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+	__m128 Load4(const float* p)
+	{
+		return _mm_loadu_ps(p);
+	}
+
+	__m128 Load4(const std::uint16_t* p)
+	{
+#if defined(WAVES_SIMD_F16C)
+		return _mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+#else
+		alignas(16) float lanes[4];
+		for(int k = 0; k < 4; ++k)
+			lanes[k] = HalfToFloat(p[k]);
+		return _mm_load_ps(lanes);
+#endif
+	}
+
+	void Store4(std::uint16_t* p, __m128 v)
+	{
+#if defined(WAVES_SIMD_F16C)
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+#else
+		alignas(16) float lanes[4];
+		_mm_store_ps(lanes, v);
+		for(int k = 0; k < 4; ++k)
+			p[k] = FloatToHalf(lanes[k]);
+#endif
+	}
+#endif
+
+	// Converts 'count' consecutive stored heights to floats.
+	void LoadHeights(const float* src, int count, float* dst)
+	{
+		std::copy(src, src + count, dst);
+	}
+
+	void LoadHeights(const std::uint16_t* src, int count, float* dst)
+	{
+		int j = 0;
+
+#if defined(WAVES_SIMD_AVX)
+		for(; j + 8 <= count; j += 8)
+			_mm256_storeu_ps(dst + j, Load8(src + j));
+#endif
+
+		for(; j < count; ++j)
+			dst[j] = HalfToFloat(src[j]);
+	}
+
+	// The same for heights 'alpha' of the way from the previous solution to the current
+	// one.  Half precision planes hold the change over the last step instead of the
+	// previous heights.
+	void LoadBlendedHeights(const float* prev, const float* curr, int count, float alpha, float* dst)
+	{
+		for(int j = 0; j < count; ++j)
+			dst[j] = prev[j] + alpha*(curr[j] - prev[j]);
+	}
+
+	void LoadBlendedHeights(const std::uint16_t* velocity, const std::uint16_t* curr, int count, float alpha, float* dst)
+	{
+		const float lag = 1.0f - alpha;
+		for(int j = 0; j < count; ++j)
+			dst[j] = HalfToFloat(curr[j]) - lag*HalfToFloat(velocity[j]);
+	}
+
+	// Writes 'count' vertices of one grid row at depth z.  x and texU are indexed by
+	// column like the heights and normals.  Each vertex is assembled first and stored
+	// whole, so the destination sees nothing but sequential writes.
+	void WriteVertexRow(const float* heights, const XMFLOAT3* normals, const float* x,
+		const float* texU, float z, float texV, int count, IWaveSimulator::SurfaceVertex* dst)
+	{
+		for(int j = 0; j < count; ++j)
+		{
+			IWaveSimulator::SurfaceVertex v;
+			v.Pos = XMFLOAT3(x[j], heights[j], z);
+			v.Normal = normals[j];
+			v.TexC = XMFLOAT2(texU[j], texV);
+			dst[j] = v;
+		}
+	}
+
+	// Octahedral encoding of a unit normal in two snorm8 values.  The octahedron's pole
+	// is +y, where water normals cluster; the lower hemisphere is folded over the
+	// diagonals.  Default.hlsl decodes it in DecodeOctahedral.
+	void EncodeOctahedral(const XMFLOAT3& n, std::int8_t* e)
+	{
+		float invLength = 1.0f / (std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z));
+		float u = n.x*invLength;
+		float v = n.z*invLength;
+		if(n.y < 0.0f)
+		{
+			float foldedU = (1.0f - std::fabs(v))*(u >= 0.0f ? 1.0f : -1.0f);
+			float foldedV = (1.0f - std::fabs(u))*(v >= 0.0f ? 1.0f : -1.0f);
+			u = foldedU;
+			v = foldedV;
+		}
+
+		e[0] = (std::int8_t)std::floor(u*127.0f + 0.5f);
+		e[1] = (std::int8_t)std::floor(v*127.0f + 0.5f);
+	}
+
+	void WriteCompactVertexRow(const float* heights, const XMFLOAT3* normals, int count,
+		Waves::CompactVertex* dst)
+	{
+		for(int j = 0; j < count; ++j)
+		{
+			Waves::CompactVertex v;
+			v.Height = FloatToHalf(heights[j]);
+			EncodeOctahedral(normals[j], v.Normal);
+			dst[j] = v;
+		}
+	}
+
+	// Advances 'count' consecutive interior points of one row.  All pointers address the
+	// first point of the segment; 'next' holds the previous solution and is overwritten
+	// in place, 'up'/'down' are the rows i-1/i+1 of the current solution.
+	//
+	// The sums are evaluated in the same order by every path so the SIMD and scalar
+	// kernels produce identical results.
+	void StepRow(float* next, const float* curr, const float* up, const float* down,
+		int count, float k1, float k2, float k3)
+	{
+		int j = 0;
+
+#if defined(WAVES_SIMD_AVX)
+		const __m256 k1x8 = _mm256_set1_ps(k1);
+		const __m256 k2x8 = _mm256_set1_ps(k2);
+		const __m256 k3x8 = _mm256_set1_ps(k3);
+		for(; j + 8 <= count; j += 8)
+		{
+			__m256 s = _mm256_add_ps(_mm256_loadu_ps(down + j), _mm256_loadu_ps(up + j));
+			s = _mm256_add_ps(s, _mm256_loadu_ps(curr + j + 1));
+			s = _mm256_add_ps(s, _mm256_loadu_ps(curr + j - 1));
+
+			__m256 r = _mm256_add_ps(
+				_mm256_mul_ps(k1x8, _mm256_loadu_ps(next + j)),
+				_mm256_mul_ps(k2x8, _mm256_loadu_ps(curr + j)));
+			_mm256_storeu_ps(next + j, _mm256_add_ps(r, _mm256_mul_ps(k3x8, s)));
+		}
+#endif
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+		const __m128 k1x4 = _mm_set1_ps(k1);
+		const __m128 k2x4 = _mm_set1_ps(k2);
+		const __m128 k3x4 = _mm_set1_ps(k3);
+		for(; j + 4 <= count; j += 4)
+		{
+			__m128 s = _mm_add_ps(_mm_loadu_ps(down + j), _mm_loadu_ps(up + j));
+			s = _mm_add_ps(s, _mm_loadu_ps(curr + j + 1));
+			s = _mm_add_ps(s, _mm_loadu_ps(curr + j - 1));
+
+			__m128 r = _mm_add_ps(
+				_mm_mul_ps(k1x4, _mm_loadu_ps(next + j)),
+				_mm_mul_ps(k2x4, _mm_loadu_ps(curr + j)));
+			_mm_storeu_ps(next + j, _mm_add_ps(r, _mm_mul_ps(k3x4, s)));
+		}
+#endif
+
+		for(; j < count; ++j)
+		{
+			next[j] = k1*next[j] + k2*curr[j] +
+				k3*(down[j] + up[j] + curr[j+1] + curr[j-1]);
+		}
+	}
+
+	// The same step for half precision planes, which hold the heights and their change
+	// over the last step (the velocity).  Since k1 + k2 + 4*k3 = 1 the update above
+	// becomes v' = -k1*v + k3*(sum of neighbours - 4*h); only the velocity is written,
+	// the heights follow in CommitHeightRow once no neighbour needs the old ones.
+	void StepVelocityRow(std::uint16_t* velocity, const std::uint16_t* curr, const std::uint16_t* up,
+		const std::uint16_t* down, int count, float damping, float k3)
+	{
+		int j = 0;
+
+#if defined(WAVES_SIMD_AVX)
+		const __m256 damping8 = _mm256_set1_ps(damping);
+		const __m256 k3x8 = _mm256_set1_ps(k3);
+		const __m256 four8 = _mm256_set1_ps(4.0f);
+		for(; j + 8 <= count; j += 8)
+		{
+			__m256 s = _mm256_add_ps(Load8(down + j), Load8(up + j));
+			s = _mm256_add_ps(s, Load8(curr + j + 1));
+			s = _mm256_add_ps(s, Load8(curr + j - 1));
+			s = _mm256_sub_ps(s, _mm256_mul_ps(four8, Load8(curr + j)));
+
+			__m256 v = _mm256_mul_ps(damping8, Load8(velocity + j));
+			Store8(velocity + j, _mm256_add_ps(v, _mm256_mul_ps(k3x8, s)));
+		}
+#endif
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+		const __m128 damping4 = _mm_set1_ps(damping);
+		const __m128 k3x4 = _mm_set1_ps(k3);
+		const __m128 four4 = _mm_set1_ps(4.0f);
+		for(; j + 4 <= count; j += 4)
+		{
+			__m128 s = _mm_add_ps(Load4(down + j), Load4(up + j));
+			s = _mm_add_ps(s, Load4(curr + j + 1));
+			s = _mm_add_ps(s, Load4(curr + j - 1));
+			s = _mm_sub_ps(s, _mm_mul_ps(four4, Load4(curr + j)));
+
+			__m128 v = _mm_mul_ps(damping4, Load4(velocity + j));
+			Store4(velocity + j, _mm_add_ps(v, _mm_mul_ps(k3x4, s)));
+		}
+#endif
+
+		for(; j < count; ++j)
+		{
+			float s = HalfToFloat(down[j]) + HalfToFloat(up[j]) + HalfToFloat(curr[j+1]) + HalfToFloat(curr[j-1]);
+			s = s - 4.0f*HalfToFloat(curr[j]);
+
+			velocity[j] = FloatToHalf(damping*HalfToFloat(velocity[j]) + k3*s);
+		}
+	}
+
+	// Adds the new velocities to 'count' half precision heights.
+	void CommitHeightRow(std::uint16_t* heights, const std::uint16_t* velocity, int count)
+	{
+		int j = 0;
+
+#if defined(WAVES_SIMD_AVX)
+		for(; j + 8 <= count; j += 8)
+			Store8(heights + j, _mm256_add_ps(Load8(heights + j), Load8(velocity + j)));
+#endif
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+		for(; j + 4 <= count; j += 4)
+			Store4(heights + j, _mm_add_ps(Load4(heights + j), Load4(velocity + j)));
+#endif
+
+		for(; j < count; ++j)
+			heights[j] = FloatToHalf(HalfToFloat(heights[j]) + HalfToFloat(velocity[j]));
+	}
+
+	// Returns the largest magnitude among 'count' floats.
+	float MaxAbs(const float* values, int count)
+	{
+		int j = 0;
+		float result = 0.0f;
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		__m128 m4 = _mm_setzero_ps();
+		for(; j + 4 <= count; j += 4)
+			m4 = _mm_max_ps(m4, _mm_andnot_ps(signMask, _mm_loadu_ps(values + j)));
+
+		float lanes[4];
+		_mm_storeu_ps(lanes, m4);
+		result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#endif
+
+		for(; j < count; ++j)
+			result = std::max(result, std::fabs(values[j]));
+
+		return result;
+	}
+
+	// Half precision magnitudes order like their bit patterns without the sign.
+	float MaxAbs(const std::uint16_t* values, int count)
+	{
+		std::uint16_t result = 0;
+		for(int j = 0; j < count; ++j)
+			result = std::max(result, (std::uint16_t)(values[j] & 0x7fff));
+
+		return HalfToFloat(result);
+	}
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+	// Writes four vectors given as x/y/z lanes to consecutive XMFLOAT3s.
+	void StoreFloat3x4(DirectX::XMFLOAT3* dst, __m128 x, __m128 y, __m128 z)
+	{
+		__m128 xyLo = _mm_unpacklo_ps(x, y);                           // x0 y0 x1 y1
+		__m128 xyHi = _mm_unpackhi_ps(x, y);                           // x2 y2 x3 y3
+		__m128 zx = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0));     // z0 z0 x1 x1
+		__m128 yz = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1));     // y1 y1 z1 z1
+		__m128 zxy = _mm_shuffle_ps(z, xyHi, _MM_SHUFFLE(3, 2, 3, 2)); // z2 z3 x3 y3
+
+		float* out = &dst->x;
+		_mm_storeu_ps(out + 0, _mm_shuffle_ps(xyLo, zx, _MM_SHUFFLE(2, 0, 1, 0)));   // x0 y0 z0 x1
+		_mm_storeu_ps(out + 4, _mm_shuffle_ps(yz, xyHi, _MM_SHUFFLE(1, 0, 2, 0)));   // y1 z1 x2 y2
+		_mm_storeu_ps(out + 8, _mm_shuffle_ps(zxy, zxy, _MM_SHUFFLE(1, 3, 2, 0)));   // z2 x3 y3 z3
+	}
+#endif
+
+	// Placement of an m x n grid: row i lies at z = HalfDepth - i*dx and column j at
+	// x = -HalfWidth + j*dx.
+	struct GridFrame
+	{
+		int Rows;
+		int Cols;
+		float HalfWidth;
+		float HalfDepth;
+		float InvStep;
+	};
+
+	// Finds the cell (i, j) holding an x/z position and the fractions fu/fv across it.
+	// Positions outside the grid are clamped to its edge.
+	void LocateSample(const GridFrame& frame, const XMFLOAT2& p, int& i, int& j, float& fu, float& fv)
+	{
+		float u = std::min(std::max(0.0f, (p.x + frame.HalfWidth)*frame.InvStep), frame.Cols - 1.0f);
+		float v = std::min(std::max(0.0f, (frame.HalfDepth - p.y)*frame.InvStep), frame.Rows - 1.0f);
+		j = std::min((int)u, frame.Cols - 2);
+		i = std::min((int)v, frame.Rows - 2);
+		fu = u - j;
+		fv = v - i;
+	}
+
+	float Bilerp(float h00, float h01, float h10, float h11, float fu, float fv)
+	{
+		float top = h00 + (h01 - h00)*fu;
+		float bottom = h10 + (h11 - h10)*fu;
+		return top + (bottom - top)*fv;
+	}
+
+	// Bilinearly samples a full grid holding Stride floats per point at 'count' x/z
+	// positions, writing Stride floats per sample.  The gather path evaluates the
+	// same expressions as the scalar one, so both give identical results.
+	template<int Stride>
+	void SampleGrid(const GridFrame& frame, const float* grid, const XMFLOAT2* xz, float* out, int count)
+	{
+		const int rowOffset = frame.Cols*Stride;
+		int k = 0;
+
+#if defined(WAVES_SIMD_AVX2)
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 halfWidth = _mm256_set1_ps(frame.HalfWidth);
+		const __m256 halfDepth = _mm256_set1_ps(frame.HalfDepth);
+		const __m256 invStep = _mm256_set1_ps(frame.InvStep);
+		const __m256 maxU = _mm256_set1_ps(frame.Cols - 1.0f);
+		const __m256 maxV = _mm256_set1_ps(frame.Rows - 1.0f);
+		const __m256i maxJ = _mm256_set1_epi32(frame.Cols - 2);
+		const __m256i maxI = _mm256_set1_epi32(frame.Rows - 2);
+		const __m256i cols = _mm256_set1_epi32(frame.Cols);
+		const __m256i stride = _mm256_set1_epi32(Stride);
+		for(; k + 8 <= count; k += 8)
+		{
+			// Deinterleave eight x/z pairs.
+			__m256 a = _mm256_loadu_ps(&xz[k].x);      // x0 z0 x1 z1 x2 z2 x3 z3
+			__m256 b = _mm256_loadu_ps(&xz[k + 4].x);  // x4 z4 x5 z5 x6 z6 x7 z7
+			__m256 x = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+				_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+			__m256 z = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+				_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+
+			// max_ps returns its second operand for NaN, like std::max(0, NaN).
+			__m256 u = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(x, halfWidth), invStep), zero), maxU);
+			__m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(halfDepth, z), invStep), zero), maxV);
+			__m256i j = _mm256_min_epi32(_mm256_cvttps_epi32(u), maxJ);
+			__m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(v), maxI);
+			__m256 fu = _mm256_sub_ps(u, _mm256_cvtepi32_ps(j));
+			__m256 fv = _mm256_sub_ps(v, _mm256_cvtepi32_ps(i));
+			__m256i index = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(i, cols), j), stride);
+
+			for(int c = 0; c < Stride; ++c)
+			{
+				const float* corner = grid + c;
+				__m256 h00 = _mm256_i32gather_ps(corner, index, 4);
+				__m256 h01 = _mm256_i32gather_ps(corner + Stride, index, 4);
+				__m256 h10 = _mm256_i32gather_ps(corner + rowOffset, index, 4);
+				__m256 h11 = _mm256_i32gather_ps(corner + rowOffset + Stride, index, 4);
+
+				__m256 top = _mm256_add_ps(h00, _mm256_mul_ps(_mm256_sub_ps(h01, h00), fu));
+				__m256 bottom = _mm256_add_ps(h10, _mm256_mul_ps(_mm256_sub_ps(h11, h10), fu));
+				__m256 h = _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), fv));
+
+				if(Stride == 1)
+					_mm256_storeu_ps(out + k, h);
+				else
+				{
+					alignas(32) float lanes[8];
+					_mm256_store_ps(lanes, h);
+					for(int l = 0; l < 8; ++l)
+						out[(k + l)*Stride + c] = lanes[l];
+				}
+			}
+		}
+#endif
+
+		for(; k < count; ++k)
+		{
+			int i, j;
+			float fu, fv;
+			LocateSample(frame, xz[k], i, j, fu, fv);
+
+			const float* p = grid + (i*frame.Cols + j)*Stride;
+			for(int c = 0; c < Stride; ++c)
+				out[k*Stride + c] = Bilerp(p[c], p[Stride + c], p[rowOffset + c], p[rowOffset + Stride + c], fu, fv);
+		}
+	}
+
+	// Snapshot files (version 1) start with a SnapshotHeader followed by the previous
+	// and the current height planes, each starting on a SnapshotAlignment boundary.
+	// Values are stored in native byte order, the heights in the storage format of the
+	// simulation.
+	const char SnapshotMagic[4] = { 'W', 'A', 'V', 'S' };
+	const std::uint32_t SnapshotVersion = 1;
+	const std::uint64_t SnapshotAlignment = 64;
+
+	struct SnapshotHeader
+	{
+		char Magic[4];
+		std::uint32_t Version;
+		std::int32_t Rows;
+		std::int32_t Cols;
+		std::int32_t StoredCount;
+		std::uint32_t LayoutHash;
+		float SpatialStep;
+		float TimeStep;
+		float K1;
+		float K2;
+		float K3;
+		std::uint32_t StorageFormat;
+		std::uint64_t StepCount;
+		std::uint64_t PrevOffset;
+		std::uint64_t CurrOffset;
+	};
+
+	std::uint64_t AlignSnapshotOffset(std::uint64_t offset)
+	{
+		return (offset + SnapshotAlignment - 1) & ~(SnapshotAlignment - 1);
+	}
+
+	// Read-only mapping of a whole file; Data() is null if it could not be mapped.
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const std::string& path)
+		{
+#if defined(_WIN32)
+			mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER size;
+			if(mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+				return;
+
+			mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if(mMapping == nullptr)
+				return;
+
+			mData = static_cast<const unsigned char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+			if(mData != nullptr)
+				mSize = (std::uint64_t)size.QuadPart;
+#else
+			mFile = open(path.c_str(), O_RDONLY);
+			struct stat info;
+			if(mFile < 0 || fstat(mFile, &info) != 0 || info.st_size == 0)
+				return;
+
+			void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, mFile, 0);
+			if(data == MAP_FAILED)
+				return;
+
+			mData = static_cast<const unsigned char*>(data);
+			mSize = (std::uint64_t)info.st_size;
+#endif
+		}
+
+		MappedFile(const MappedFile& rhs) = delete;
+		MappedFile& operator=(const MappedFile& rhs) = delete;
+
+		~MappedFile()
+		{
+#if defined(_WIN32)
+			if(mData != nullptr)
+				UnmapViewOfFile(mData);
+			if(mMapping != nullptr)
+				CloseHandle(mMapping);
+			if(mFile != INVALID_HANDLE_VALUE)
+				CloseHandle(mFile);
+#else
+			if(mData != nullptr)
+				munmap(const_cast<unsigned char*>(mData), (size_t)mSize);
+			if(mFile >= 0)
+				close(mFile);
+#endif
+		}
+
+		const unsigned char* Data()const { return mData; }
+		std::uint64_t Size()const { return mSize; }
+
+	private:
+		const unsigned char* mData = nullptr;
+		std::uint64_t mSize = 0;
+#if defined(_WIN32)
+		HANDLE mFile = INVALID_HANDLE_VALUE;
+		HANDLE mMapping = nullptr;
+#else
+		int mFile = -1;
+#endif
+	};
+
+	void NormalizeAll(XMFLOAT3* normals, int count)
+	{
+		for(int k = 0; k < count; ++k)
+		{
+			XMFLOAT3& n = normals[k];
+			float invLength = 1.0f / std::sqrt(n.x*n.x + n.y*n.y + n.z*n.z);
+			n.x *= invLength;
+			n.y *= invLength;
+			n.z *= invLength;
+		}
+	}
+}
+
+Waves::Waves(int m, int n, float dx, float dt, float speed, float damping,
+    const std::vector<bool>& wetMask, Storage storage)
 {
+    mStorage = storage;
     mNumRows = m;
     mNumCols = n;
 
@@ -20,6 +677,8 @@ Waves::Waves(int m, int n, float dx, float dt, float speed, float damping)
 
     mTimeStep = dt;
     mSpatialStep = dx;
+    mHalfWidth = (n - 1)*dx*0.5f;
+    mHalfDepth = (m - 1)*dx*0.5f;
 
     float d = damping*dt + 2.0f;
     float e = (speed*speed)*(dt*dt) / (dx*dx);
@@ -27,32 +686,251 @@ Waves::Waves(int m, int n, float dx, float dt, float speed, float damping)
     mK2 = (4.0f - 8.0f*e) / d;
     mK3 = (2.0f*e) / d;
 
-    mPrevSolution.resize(m*n);
-    mCurrSolution.resize(m*n);
-    mNormals.resize(m*n);
-    mTangentX.resize(m*n);
+    // Vertex x/z and texture coordinates depend only on the column or the row, so
+    // they are tabulated once instead of recomputed for every vertex of every frame.
+    mGridX.resize(n);
+    mTexU.resize(n);
+    for(int j = 0; j < n; ++j)
+    {
+        mGridX[j] = -mHalfWidth + j*dx;
+        mTexU[j] = 0.5f + mGridX[j] / Width();
+    }
+    mGridZ.resize(m);
+    mTexV.resize(m);
+    for(int i = 0; i < m; ++i)
+    {
+        mGridZ[i] = mHalfDepth - i*dx;
+        mTexV[i] = 0.5f - mGridZ[i] / Depth();
+    }
+
+    BuildLayout(wetMask);
+
+    // The water starts out flat.  Grid x/z coordinates are not stored; they are
+    // rebuilt from the grid index in Position().
+    if(mStorage == Storage::Float16)
+    {
+        mHalfVelocity.assign(mStoredCount, 0);
+        mHalfHeights.assign(mStoredCount, 0);
+    }
+    else
+    {
+        mPrevSolution.assign(mStoredCount, 0.0f);
+        mCurrSolution.assign(mStoredCount, 0.0f);
+    }
+    mNormals.assign(mStoredCount, XMFLOAT3(0.0f, 1.0f, 0.0f));
+    mTangentX.assign(mStoredCount, XMFLOAT3(1.0f, 0.0f, 0.0f));
+    mRowRevision.assign(m, mRevision);
+
+    // Interior points are covered by tiles of BandRows x TileColumns points.  A tile
+    // row is exactly one band of the solver sweep.  Tiles without water never wake up;
+    // every other tile starts out awake.
+    mTileRowCount = (m - 2 + BandRows - 1) / BandRows;
+    mTileColCount = (n - 2 + TileColumns - 1) / TileColumns;
+    mTileWet.assign(mTileRowCount*mTileColCount, 0);
+    for(const WetRun& run : mWetRuns)
+    {
+        int tileRow = (run.Row - 1) / BandRows;
+        for(int tileCol = (run.Col0 - 1) / TileColumns; tileCol <= (run.Col1 - 2) / TileColumns; ++tileCol)
+            mTileWet[tileRow*mTileColCount + tileCol] = 1;
+    }
+    mTileAwake = mTileWet;
+    mTileEnergy.assign(mTileRowCount*mTileColCount, 0.0f);
+}
+
+Waves::~Waves()
+{
+}
+
+void Waves::BuildLayout(const std::vector<bool>& wetMask)
+{
+    const int m = mNumRows;
+    const int n = mNumCols;
+
+    mMasked = !wetMask.empty();
+    assert(!mMasked || (int)wetMask.size() == m*n);
+
+    // Water points are the interior points the mask (if any) marks wet.  Without a
+    // mask every point is stored and the grid edge holds the zero boundary.  With a
+    // mask only water points and the dry points bordering them are stored.
+    auto isWet = [&](int i, int j)
+    {
+        return i > 0 && i < m - 1 && j > 0 && j < n - 1 && (!mMasked || wetMask[i*n + j]);
+    };
+    auto isStored = [&](int i, int j)
+    {
+        return !mMasked || isWet(i, j) ||
+            isWet(i - 1, j) || isWet(i + 1, j) || isWet(i, j - 1) || isWet(i, j + 1);
+    };
+
+    mSpans.clear();
+    mRowSpanStart.assign(m + 1, 0);
+    mStoredCount = 0;
+    for(int i = 0; i < m; ++i)
+    {
+        mRowSpanStart[i] = (int)mSpans.size();
+        for(int j = 0; j < n; )
+        {
+            if(!isStored(i, j))
+            {
+                ++j;
+                continue;
+            }
+
+            Span span;
+            span.Col0 = j;
+            while(j < n && isStored(i, j))
+                ++j;
+            span.Col1 = j;
+            span.Offset = mStoredCount;
+            mStoredCount += span.Col1 - span.Col0;
+            mSpans.push_back(span);
+        }
+    }
+    mRowSpanStart[m] = (int)mSpans.size();
+
+    // The points above and below a run of water points are water or shore, so
+    // they are stored contiguously and one offset per row is enough.
+    mWetRuns.clear();
+    mRowRunStart.assign(m + 1, 0);
+    for(int i = 0; i < m; ++i)
+    {
+        mRowRunStart[i] = (int)mWetRuns.size();
+        for(int j = 0; j < n; )
+        {
+            if(!isWet(i, j))
+            {
+                ++j;
+                continue;
+            }
+
+            WetRun run;
+            run.Row = i;
+            run.Col0 = j;
+            while(j < n && isWet(i, j))
+                ++j;
+            run.Col1 = j;
+            run.Center = StoredOffset(i, run.Col0);
+            run.Up = StoredOffset(i - 1, run.Col0);
+            run.Down = StoredOffset(i + 1, run.Col0);
+            mWetRuns.push_back(run);
+        }
+    }
+    mRowRunStart[m] = (int)mWetRuns.size();
 
-    // Generate grid vertices in system memory.
+    // Dry points bordering the water mirror their water neighbours, which gives a
+    // reflecting shoreline.  The water points next to them get their normals redone
+    // once the mirrored heights are in place.
+    mGhosts.clear();
+    mShore.clear();
+    if(!mMasked)
+        return;
 
-    float halfWidth = (n - 1)*dx*0.5f;
-    float halfDepth = (m - 1)*dx*0.5f;
     for(int i = 0; i < m; ++i)
     {
-        float z = halfDepth - i*dx;
-        for(int j = 0; j < n; ++j)
+        for(int s = mRowSpanStart[i]; s < mRowSpanStart[i+1]; ++s)
         {
-            float x = -halfWidth + j*dx;
+            for(int j = mSpans[s].Col0; j < mSpans[s].Col1; ++j)
+            {
+                const int neighbors[4][2] = { { i - 1, j }, { i + 1, j }, { i, j - 1 }, { i, j + 1 } };
+
+                if(isWet(i, j))
+                {
+                    bool onShore = false;
+                    for(int k = 0; k < 4; ++k)
+                        onShore = onShore || !isWet(neighbors[k][0], neighbors[k][1]);
+
+                    if(onShore)
+                    {
+                        WetRun point;
+                        point.Row = i;
+                        point.Col0 = j;
+                        point.Col1 = j + 1;
+                        point.Center = StoredOffset(i, j);
+                        point.Up = StoredOffset(i - 1, j);
+                        point.Down = StoredOffset(i + 1, j);
+                        mShore.push_back(point);
+                    }
+                    continue;
+                }
 
-            mPrevSolution[i*n + j] = XMFLOAT3(x, 0.0f, z);
-            mCurrSolution[i*n + j] = XMFLOAT3(x, 0.0f, z);
-            mNormals[i*n + j] = XMFLOAT3(0.0f, 1.0f, 0.0f);
-            mTangentX[i*n + j] = XMFLOAT3(1.0f, 0.0f, 0.0f);
+                Ghost ghost;
+                ghost.Offset = StoredOffset(i, j);
+                ghost.Count = 0;
+                for(int k = 0; k < 4; ++k)
+                {
+                    if(isWet(neighbors[k][0], neighbors[k][1]))
+                        ghost.Neighbors[ghost.Count++] = StoredOffset(neighbors[k][0], neighbors[k][1]);
+                }
+                mGhosts.push_back(ghost);
+            }
         }
     }
 }
 
-Waves::~Waves()
+int Waves::StoredOffset(int row, int col)const
+{
+    if(!mMasked)
+        return row*mNumCols + col;
+
+    for(int s = mRowSpanStart[row]; s < mRowSpanStart[row+1]; ++s)
+    {
+        if(col >= mSpans[s].Col0 && col < mSpans[s].Col1)
+            return mSpans[s].Offset + col - mSpans[s].Col0;
+    }
+
+    return -1;
+}
+
+int Waves::WetOffset(int row, int col)const
+{
+    for(int r = mRowRunStart[row]; r < mRowRunStart[row+1]; ++r)
+    {
+        if(col >= mWetRuns[r].Col0 && col < mWetRuns[r].Col1)
+            return mWetRuns[r].Center + col - mWetRuns[r].Col0;
+    }
+
+    return -1;
+}
+
+template<typename Fn>
+void Waves::ForEachActiveRun(int row, const std::vector<int>& columns, Fn fn)const
+{
+    // Visits the parts of the row's water runs that fall inside the [begin, end)
+    // column pairs, passing the offsets of the first point, the point above and
+    // the point below it, and the number of points.
+    for(int r = mRowRunStart[row]; r < mRowRunStart[row+1]; ++r)
+    {
+        const WetRun& run = mWetRuns[r];
+        for(size_t k = 0; k < columns.size(); k += 2)
+        {
+            int j0 = std::max(run.Col0, columns[k]);
+            int j1 = std::min(run.Col1, columns[k+1]);
+            if(j0 < j1)
+            {
+                int skip = j0 - run.Col0;
+                fn(run.Center + skip, run.Up + skip, run.Down + skip, j1 - j0);
+            }
+        }
+    }
+}
+
+template<typename Fn>
+void Waves::WithPlanes(Fn fn)
+{
+    // fn is instantiated for both storage types, so it must be generic.
+    if(mStorage == Storage::Float16)
+        fn(mHalfVelocity, mHalfHeights);
+    else
+        fn(mPrevSolution, mCurrSolution);
+}
+
+template<typename Fn>
+void Waves::WithPlanes(Fn fn)const
 {
+    if(mStorage == Storage::Float16)
+        fn(mHalfVelocity, mHalfHeights);
+    else
+        fn(mPrevSolution, mCurrSolution);
 }
 
 int Waves::RowCount()const
@@ -85,88 +963,1474 @@ float Waves::Depth()const
 	return mNumRows*mSpatialStep;
 }
 
-void Waves::Update(float dt)
+float Waves::TimeStep()const
 {
-	static float t = 0;
+	return mTimeStep;
+}
 
-	// Accumulate time.
-	t += dt;
+int Waves::StoredPointCount()const
+{
+	return mStoredCount;
+}
 
-	// Only update the simulation at the specified time step.
-	if( t >= mTimeStep )
-	{
-		// Only update interior points; we use zero boundary conditions.
-		concurrency::parallel_for(1, mNumRows - 1, [this](int i)
-		//for(int i = 1; i < mNumRows-1; ++i)
-		{
-			for(int j = 1; j < mNumCols-1; ++j)
-			{
-				// After this update we will be discarding the old previous
-				// buffer, so overwrite that buffer with the new update.
-				// Note how we can do this inplace (read/write to same element) 
-				// because we won't need prev_ij again and the assignment happens last.
-
-				// Note j indexes x and i indexes z: h(x_j, z_i, t_k)
-				// Moreover, our +z axis goes "down"; this is just to 
-				// keep consistent with our row indices going down.
-
-				mPrevSolution[i*mNumCols+j].y = 
-					mK1*mPrevSolution[i*mNumCols+j].y +
-					mK2*mCurrSolution[i*mNumCols+j].y +
-					mK3*(mCurrSolution[(i+1)*mNumCols+j].y + 
-					     mCurrSolution[(i-1)*mNumCols+j].y + 
-					     mCurrSolution[i*mNumCols+j+1].y + 
-						 mCurrSolution[i*mNumCols+j-1].y);
-			}
-		});
+Waves::Storage Waves::HeightStorage()const
+{
+	return mStorage;
+}
 
-		// We just overwrote the previous buffer with the new data, so
-		// this data needs to become the current solution and the old
-		// current solution becomes the new previous solution.
-		std::swap(mPrevSolution, mCurrSolution);
+int Waves::BytesPerHeight()const
+{
+	return mStorage == Storage::Float16 ? (int)sizeof(std::uint16_t) : (int)sizeof(float);
+}
 
-		t = 0.0f; // reset time
+XMFLOAT3 Waves::Position(int i)const
+{
+	return Position(i, Height(i));
+}
 
-		//
-		// Compute normals using finite difference scheme.
-		//
-		concurrency::parallel_for(1, mNumRows - 1, [this](int i)
-		//for(int i = 1; i < mNumRows - 1; ++i)
-		{
-			for(int j = 1; j < mNumCols-1; ++j)
-			{
-				float l = mCurrSolution[i*mNumCols+j-1].y;
-				float r = mCurrSolution[i*mNumCols+j+1].y;
-				float t = mCurrSolution[(i-1)*mNumCols+j].y;
-				float b = mCurrSolution[(i+1)*mNumCols+j].y;
-				mNormals[i*mNumCols+j].x = -r+l;
-				mNormals[i*mNumCols+j].y = 2.0f*mSpatialStep;
-				mNormals[i*mNumCols+j].z = b-t;
-
-				XMVECTOR n = XMVector3Normalize(XMLoadFloat3(&mNormals[i*mNumCols+j]));
-				XMStoreFloat3(&mNormals[i*mNumCols+j], n);
-
-				mTangentX[i*mNumCols+j] = XMFLOAT3(2.0f*mSpatialStep, r-l, 0.0f);
-				XMVECTOR T = XMVector3Normalize(XMLoadFloat3(&mTangentX[i*mNumCols+j]));
-				XMStoreFloat3(&mTangentX[i*mNumCols+j], T);
-			}
-		});
-	}
+XMFLOAT3 Waves::Position(int i, float height)const
+{
+	int row = i / mNumCols;
+	int col = i - row*mNumCols;
+
+	return XMFLOAT3(-mHalfWidth + col*mSpatialStep, height, mHalfDepth - row*mSpatialStep);
 }
 
-void Waves::Disturb(int i, int j, float magnitude)
+XMFLOAT3 Waves::RestPosition(int i)const
 {
-	// Don't disturb boundaries.
-	assert(i > 1 && i < mNumRows-2);
-	assert(j > 1 && j < mNumCols-2);
+	return Position(i, 0.0f);
+}
+
+float Waves::Height(int i)const
+{
+	int row = i / mNumCols;
+	int offset = StoredOffset(row, i - row*mNumCols);
+
+	if(offset < 0)
+		return 0.0f;
+
+	float height;
+	LoadDisplayHeights(offset, 1, &height);
+	return height;
+}
+
+XMFLOAT3 Waves::Normal(int i)const
+{
+	int row = i / mNumCols;
+	int offset = StoredOffset(row, i - row*mNumCols);
+
+	return offset >= 0 ? mNormals[offset] : XMFLOAT3(0.0f, 1.0f, 0.0f);
+}
+
+XMFLOAT3 Waves::TangentX(int i)const
+{
+	assert(mComputeTangents);
+
+	int row = i / mNumCols;
+	int offset = StoredOffset(row, i - row*mNumCols);
+
+	return offset >= 0 ? mTangentX[offset] : XMFLOAT3(1.0f, 0.0f, 0.0f);
+}
+
+void Waves::ReadSolution(float* heights, XMFLOAT3* normals)const
+{
+	// Without a mask the planes already are the grid.
+	if(!mMasked)
+	{
+		LoadDisplayHeights(0, mStoredCount, heights);
+		std::copy(mNormals.begin(), mNormals.end(), normals);
+		return;
+	}
+
+	std::fill(heights, heights + mVertexCount, 0.0f);
+	std::fill(normals, normals + mVertexCount, XMFLOAT3(0.0f, 1.0f, 0.0f));
+	for(int i = 0; i < mNumRows; ++i)
+	{
+		for(int s = mRowSpanStart[i]; s < mRowSpanStart[i+1]; ++s)
+		{
+			const Span& span = mSpans[s];
+			int count = span.Col1 - span.Col0;
+			LoadDisplayHeights(span.Offset, count, heights + i*mNumCols + span.Col0);
+			std::copy(&mNormals[span.Offset], &mNormals[span.Offset] + count, normals + i*mNumCols + span.Col0);
+		}
+	}
+}
+
+void Waves::ReadRow(int row, int col0, int cols, float* heights, XMFLOAT3* normals)const
+{
+	if(!mMasked)
+	{
+		int offset = row*mNumCols + col0;
+		LoadDisplayHeights(offset, cols, heights);
+		std::copy(&mNormals[offset], &mNormals[offset] + cols, normals);
+		return;
+	}
+
+	// Land points are flat; copy the parts of the stored spans inside [col0, col0+cols).
+	int col1 = col0 + cols;
+	std::fill(heights, heights + cols, 0.0f);
+	std::fill(normals, normals + cols, XMFLOAT3(0.0f, 1.0f, 0.0f));
+	for(int s = mRowSpanStart[row]; s < mRowSpanStart[row+1]; ++s)
+	{
+		const Span& span = mSpans[s];
+		int c0 = std::max(span.Col0, col0);
+		int c1 = std::min(span.Col1, col1);
+		if(c0 >= c1)
+			continue;
+
+		int offset = span.Offset + c0 - span.Col0;
+		LoadDisplayHeights(offset, c1 - c0, heights + c0 - col0);
+		std::copy(&mNormals[offset], &mNormals[offset] + (c1 - c0), normals + c0 - col0);
+	}
+}
+
+void Waves::LoadDisplayHeights(int offset, int count, float* heights)const
+{
+	WithPlanes([this, offset, count, heights](const auto& prev, const auto& curr)
+	{
+		if(mInterpolate)
+			LoadBlendedHeights(&prev[offset], &curr[offset], count, InterpolationFactor(), heights);
+		else
+			LoadHeights(&curr[offset], count, heights);
+	});
+}
+
+void Waves::WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const
+{
+	if(!mMasked && mStorage == Storage::Float32 && !mInterpolate)
+	{
+		WriteVertices(mCurrSolution.data(), mNormals.data(), row0, col0, rows, cols, dst);
+		return;
+	}
+
+	// Masked, half precision or interpolated planes are not a float grid; expand one
+	// row at a time.
+	std::vector<float> heights(cols);
+	std::vector<XMFLOAT3> normals(cols);
+	for(int r = row0; r < row0 + rows; ++r)
+	{
+		ReadRow(r, col0, cols, heights.data(), normals.data());
+		WriteVertexRow(heights.data(), normals.data(), &mGridX[col0], &mTexU[col0],
+			mGridZ[r], mTexV[r], cols, dst);
+		dst += cols;
+	}
+}
+
+void Waves::WriteVertices(const float* heights, const XMFLOAT3* normals,
+	int row0, int col0, int rows, int cols, SurfaceVertex* dst)const
+{
+	for(int r = row0; r < row0 + rows; ++r)
+	{
+		int i = r*mNumCols + col0;
+		WriteVertexRow(heights + i, normals + i, &mGridX[col0], &mTexU[col0],
+			mGridZ[r], mTexV[r], cols, dst);
+		dst += cols;
+	}
+}
+
+void Waves::WriteCompactVertices(int row0, int col0, int rows, int cols, CompactVertex* dst)const
+{
+	if(!mMasked && mStorage == Storage::Float32 && !mInterpolate)
+	{
+		WriteCompactVertices(mCurrSolution.data(), mNormals.data(), row0, col0, rows, cols, dst);
+		return;
+	}
+
+	std::vector<float> heights(cols);
+	std::vector<XMFLOAT3> normals(cols);
+	for(int r = row0; r < row0 + rows; ++r)
+	{
+		ReadRow(r, col0, cols, heights.data(), normals.data());
+		WriteCompactVertexRow(heights.data(), normals.data(), cols, dst);
+		dst += cols;
+	}
+}
+
+void Waves::WriteCompactVertices(const float* heights, const XMFLOAT3* normals,
+	int row0, int col0, int rows, int cols, CompactVertex* dst)const
+{
+	for(int r = row0; r < row0 + rows; ++r)
+	{
+		int i = r*mNumCols + col0;
+		WriteCompactVertexRow(heights + i, normals + i, cols, dst);
+		dst += cols;
+	}
+}
+
+void Waves::SampleHeights(const XMFLOAT2* xz, float* heights, int count)const
+{
+	if(!mMasked && mStorage == Storage::Float32 && !mInterpolate)
+	{
+		SampleHeights(mCurrSolution.data(), xz, heights, count);
+		return;
+	}
+
+	// Masked, half precision or interpolated planes are not a float grid; look the
+	// corners up one by one.
+	GridFrame frame = { mNumRows, mNumCols, mHalfWidth, mHalfDepth, 1.0f / mSpatialStep };
+	for(int k = 0; k < count; ++k)
+	{
+		int i, j;
+		float fu, fv;
+		LocateSample(frame, xz[k], i, j, fu, fv);
+
+		int p = i*mNumCols + j;
+		heights[k] = Bilerp(Height(p), Height(p + 1), Height(p + mNumCols), Height(p + mNumCols + 1), fu, fv);
+	}
+}
+
+void Waves::SampleNormals(const XMFLOAT2* xz, XMFLOAT3* normals, int count)const
+{
+	if(!mMasked)
+	{
+		SampleNormals(mNormals.data(), xz, normals, count);
+		return;
+	}
+
+	GridFrame frame = { mNumRows, mNumCols, mHalfWidth, mHalfDepth, 1.0f / mSpatialStep };
+	for(int k = 0; k < count; ++k)
+	{
+		int i, j;
+		float fu, fv;
+		LocateSample(frame, xz[k], i, j, fu, fv);
+
+		int p = i*mNumCols + j;
+		XMFLOAT3 n00 = Normal(p);
+		XMFLOAT3 n01 = Normal(p + 1);
+		XMFLOAT3 n10 = Normal(p + mNumCols);
+		XMFLOAT3 n11 = Normal(p + mNumCols + 1);
+		normals[k] = XMFLOAT3(
+			Bilerp(n00.x, n01.x, n10.x, n11.x, fu, fv),
+			Bilerp(n00.y, n01.y, n10.y, n11.y, fu, fv),
+			Bilerp(n00.z, n01.z, n10.z, n11.z, fu, fv));
+	}
+	NormalizeAll(normals, count);
+}
+
+void Waves::SampleHeights(const float* grid, const XMFLOAT2* xz, float* heights, int count)const
+{
+	GridFrame frame = { mNumRows, mNumCols, mHalfWidth, mHalfDepth, 1.0f / mSpatialStep };
+	SampleGrid<1>(frame, grid, xz, heights, count);
+}
+
+void Waves::SampleNormals(const XMFLOAT3* grid, const XMFLOAT2* xz, XMFLOAT3* normals, int count)const
+{
+	GridFrame frame = { mNumRows, mNumCols, mHalfWidth, mHalfDepth, 1.0f / mSpatialStep };
+	SampleGrid<3>(frame, &grid->x, xz, &normals->x, count);
+	NormalizeAll(normals, count);
+}
+
+std::uint64_t Waves::StepCount()const
+{
+	return mStepCount;
+}
+
+std::uint64_t Waves::Revision()const
+{
+	return mRevision;
+}
+
+void Waves::ReadRowRevisions(std::uint64_t* revisions)const
+{
+	std::copy(mRowRevision.begin(), mRowRevision.end(), revisions);
+}
+
+void Waves::ReadTimeLevels(int row0, int col0, int rows, int cols, float* prev, float* curr)const
+{
+	if(prev != nullptr)
+		std::fill(prev, prev + rows*cols, 0.0f);
+	if(curr != nullptr)
+		std::fill(curr, curr + rows*cols, 0.0f);
+
+	const bool velocities = mStorage == Storage::Float16;
+	WithPlanes([&](const auto& prevPlane, const auto& currPlane)
+	{
+		for(int i = 0; i < rows; ++i)
+		{
+			int row = row0 + i;
+			for(int s = mRowSpanStart[row]; s < mRowSpanStart[row+1]; ++s)
+			{
+				const Span& span = mSpans[s];
+				int c0 = std::max(span.Col0, col0);
+				int c1 = std::min(span.Col1, col0 + cols);
+
+				if(c0 >= c1)
+					continue;
+
+				int offset = span.Offset + c0 - span.Col0;
+				int k = i*cols + c0 - col0;
+				if(curr != nullptr)
+					LoadHeights(&currPlane[offset], c1 - c0, curr + k);
+				if(prev != nullptr)
+				{
+					LoadHeights(&prevPlane[offset], c1 - c0, prev + k);
+
+					// Half precision planes hold the change over the last step instead
+					// of the previous heights.
+					if(velocities)
+					{
+						for(int j = 0; j < c1 - c0; ++j)
+							prev[k + j] = LoadHeight(currPlane[offset + j]) - prev[k + j];
+					}
+				}
+			}
+		}
+	});
+}
+
+void Waves::WriteTimeLevels(int row0, int col0, int rows, int cols, const float* prev, const float* curr)
+{
+	const bool velocities = mStorage == Storage::Float16;
+	WithPlanes([&](auto& prevPlane, auto& currPlane)
+	{
+		for(int i = 0; i < rows; ++i)
+		{
+			int row = row0 + i;
+			for(int s = mRowSpanStart[row]; s < mRowSpanStart[row+1]; ++s)
+			{
+				const Span& span = mSpans[s];
+				int c0 = std::max(span.Col0, col0);
+				int c1 = std::min(span.Col1, col0 + cols);
+
+				for(int j = c0; j < c1; ++j)
+				{
+					int offset = span.Offset + j - span.Col0;
+					int k = i*cols + j - col0;
+
+					StoreHeight(prevPlane[offset], velocities ? curr[k] - prev[k] : prev[k]);
+					StoreHeight(currPlane[offset], curr[k]);
+				}
+			}
+		}
+	});
+
+	// The block's heights are also the neighbours of the points around it.
+	ComputeNormalsBlock(row0 - 1, row0 + rows + 1, col0 - 1, col0 + cols + 1);
+
+	// Wake the tiles under the block and those next to it, which read its edge.
+	int r0 = std::max(row0 - 1, 1);
+	int r1 = std::min(row0 + rows + 1, mNumRows - 1);
+	int c0 = std::max(col0 - 1, 1);
+	int c1 = std::min(col0 + cols + 1, mNumCols - 1);
+	if(r0 < r1 && c0 < c1)
+	{
+		for(int tr = (r0 - 1) / BandRows; tr <= (r1 - 2) / BandRows; ++tr)
+		{
+			for(int tc = (c0 - 1) / TileColumns; tc <= (c1 - 2) / TileColumns; ++tc)
+			{
+				int tile = tr*mTileColCount + tc;
+				mTileAwake[tile] = mTileWet[tile];
+			}
+		}
+	}
+
+	++mRevision;
+	MarkRowsChanged(row0 - 1, row0 + rows + 1);
+}
+
+void Waves::Shift(int rows, int cols)
+{
+	assert(!mMasked);
+
+	if(rows == 0 && cols == 0)
+		return;
+
+	const int m = mNumRows;
+	const int n = mNumCols;
+
+	// Columns [d0, d1) of every row take columns [d0 + cols, d1 + cols) of the source
+	// row.  The rows are visited in the order that reads each source row before it is
+	// overwritten.
+	const int d0 = std::max(0, -cols);
+	const int d1 = std::min(n, n - cols);
+	auto shift = [&](auto& plane, auto flat)
+	{
+		if(plane.empty())
+			return;
+
+		for(int k = 0; k < m; ++k)
+		{
+			int i = rows >= 0 ? k : m - 1 - k;
+			int source = i + rows;
+			auto* dst = &plane[i*n];
+
+			if(source < 0 || source >= m || d0 >= d1)
+			{
+				std::fill(dst, dst + n, flat);
+				continue;
+			}
+
+			std::memmove(dst + d0, &plane[source*n + d0 + cols], (d1 - d0)*sizeof(*dst));
+			std::fill(dst, dst + d0, flat);
+			std::fill(dst + d1, dst + n, flat);
+		}
+	};
+
+	// Zero has all bits clear in either storage type.
+	WithPlanes([&](auto& prev, auto& curr)
+	{
+		shift(prev, 0);
+		shift(curr, 0);
+	});
+	shift(mNormals, XMFLOAT3(0.0f, 1.0f, 0.0f));
+	shift(mTangentX, XMFLOAT3(1.0f, 0.0f, 0.0f));
+
+	// Waves may have moved into sleeping tiles.
+	mTileAwake = mTileWet;
+
+	++mRevision;
+	MarkRowsChanged(0, m);
+}
+
+std::uint32_t Waves::LayoutHash()const
+{
+	// FNV-1a over the stored spans; two grids with the same mask hash alike.
+	std::uint32_t hash = 2166136261u;
+	auto add = [&hash](int value)
+	{
+		for(int b = 0; b < 4; ++b)
+		{
+			hash ^= (std::uint32_t)(value >> (8*b)) & 0xff;
+			hash *= 16777619u;
+		}
+	};
+
+	for(int i = 0; i < mNumRows; ++i)
+	{
+		add(mRowSpanStart[i]);
+		for(int s = mRowSpanStart[i]; s < mRowSpanStart[i+1]; ++s)
+		{
+			add(mSpans[s].Col0);
+			add(mSpans[s].Col1);
+		}
+	}
+
+	return hash;
+}
+
+bool Waves::SaveSnapshot(const std::string& path)const
+{
+	const std::uint64_t planeBytes = (std::uint64_t)mStoredCount*BytesPerHeight();
+
+	SnapshotHeader header = {};
+	std::memcpy(header.Magic, SnapshotMagic, sizeof(header.Magic));
+	header.Version = SnapshotVersion;
+	header.Rows = mNumRows;
+	header.Cols = mNumCols;
+	header.StoredCount = mStoredCount;
+	header.LayoutHash = LayoutHash();
+	header.SpatialStep = mSpatialStep;
+	header.TimeStep = mTimeStep;
+	header.K1 = mK1;
+	header.K2 = mK2;
+	header.K3 = mK3;
+	header.StorageFormat = (std::uint32_t)mStorage;
+	header.StepCount = mStepCount;
+	header.PrevOffset = AlignSnapshotOffset(sizeof(SnapshotHeader));
+	header.CurrOffset = AlignSnapshotOffset(header.PrevOffset + planeBytes);
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if(!file)
+		return false;
+
+	static const char padding[SnapshotAlignment] = {};
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(padding, header.PrevOffset - sizeof(header));
+	WithPlanes([&](const auto& prev, const auto& curr)
+	{
+		file.write(reinterpret_cast<const char*>(prev.data()), planeBytes);
+		file.write(padding, header.CurrOffset - header.PrevOffset - planeBytes);
+		file.write(reinterpret_cast<const char*>(curr.data()), planeBytes);
+	});
+
+	return file.good();
+}
+
+bool Waves::LoadSnapshot(const std::string& path)
+{
+	MappedFile file(path);
+	if(file.Data() == nullptr || file.Size() < sizeof(SnapshotHeader))
+		return false;
+
+	SnapshotHeader header;
+	std::memcpy(&header, file.Data(), sizeof(header));
+
+	const std::uint64_t planeBytes = (std::uint64_t)mStoredCount*BytesPerHeight();
+	if(std::memcmp(header.Magic, SnapshotMagic, sizeof(header.Magic)) != 0 ||
+		header.Version != SnapshotVersion ||
+		header.Rows != mNumRows || header.Cols != mNumCols ||
+		header.StoredCount != mStoredCount || header.LayoutHash != LayoutHash() ||
+		header.StorageFormat != (std::uint32_t)mStorage ||
+		header.SpatialStep != mSpatialStep || header.TimeStep != mTimeStep ||
+		header.K1 != mK1 || header.K2 != mK2 || header.K3 != mK3 ||
+		header.PrevOffset > file.Size() || file.Size() - header.PrevOffset < planeBytes ||
+		header.CurrOffset > file.Size() || file.Size() - header.CurrOffset < planeBytes)
+	{
+		return false;
+	}
+
+	WithPlanes([&](auto& prev, auto& curr)
+	{
+		std::memcpy(prev.data(), file.Data() + header.PrevOffset, planeBytes);
+		std::memcpy(curr.data(), file.Data() + header.CurrOffset, planeBytes);
+	});
+
+	mStepCount = header.StepCount;
+
+	// Rebuild what derives from the heights: every water tile wakes up and sleeps
+	// again once calm, and the normals (and tangents) follow the restored solution.
+	mTileAwake = mTileWet;
+	ComputeNormals();
+
+	++mRevision;
+	MarkRowsChanged(0, mNumRows);
+
+	return true;
+}
+
+void Waves::SetSleepThreshold(float threshold)
+{
+	mSleepThreshold = threshold;
+
+	// Without a threshold nothing may stay asleep.
+	if(mSleepThreshold <= 0.0f)
+		mTileAwake = mTileWet;
+}
+
+Waves::TileStats Waves::GetTileStats()const
+{
+	TileStats stats;
+	stats.TotalTiles = (int)std::count(mTileWet.begin(), mTileWet.end(), (unsigned char)1);
+	stats.ActiveTiles = (int)std::count(mTileAwake.begin(), mTileAwake.end(), (unsigned char)1);
+
+	return stats;
+}
+
+void Waves::Update(float dt)
+{
+	Advance(AdvanceClock(dt));
+}
+
+int Waves::AdvanceClock(float dt)
+{
+	// Accumulate time and take a step for every whole time step in it, carrying the
+	// remainder over, so the water moves at the same speed at any frame rate.
+	mClock += dt;
+
+	int steps = 0;
+	while(mClock >= mTimeStep && steps < mMaxSubsteps)
+	{
+		mClock -= mTimeStep;
+		++steps;
+	}
+
+	// A backlog beyond the bound is dropped: after a long frame the water falls behind
+	// real time instead of the next frames falling further behind catching up.
+	if(mClock >= mTimeStep)
+		mClock = std::fmod(mClock, mTimeStep);
+
+	// The blend moves on with the clock wherever the water is moving.
+	if(mInterpolate && dt != 0.0f)
+	{
+		++mRevision;
+		MarkAwakeRowsChanged();
+	}
+
+	return steps;
+}
+
+void Waves::SetMaxSubsteps(int steps)
+{
+	mMaxSubsteps = std::max(1, steps);
+}
+
+float Waves::InterpolationFactor()const
+{
+	return mClock / mTimeStep;
+}
+
+void Waves::EnableInterpolation(bool enable)
+{
+	if(enable == mInterpolate)
+		return;
+
+	mInterpolate = enable;
+
+	++mRevision;
+	MarkRowsChanged(0, mNumRows);
+}
+
+void Waves::Advance(int steps)
+{
+	if(steps <= 0)
+		return;
+
+	// Pick the deepest temporal block whose tiles still fit in cache with a useful
+	// amount of non-halo rows.  Each tile carries 'depth' halo rows on either side,
+	// so deep blocks on wide grids would mostly recompute halo.
+	const int bytesPerRow = mNumCols*2*BytesPerHeight();
+	const int rowsInCache = TileCacheBytes / bytesPerRow;
+
+	int depth = std::min(steps, (int)MaxTemporalSteps);
+	while(depth > 1 && rowsInCache - 2*depth < 2*depth)
+		--depth;
+
+	// Grids that already fit in cache, or rows too wide to tile, gain nothing
+	// from blocking; just step them one at a time.  The same goes for sparse and
+	// masked simulation, which only sweep the awake tiles and the water, and need
+	// their bookkeeping after every step.
+	if(depth <= 1 || mNumRows*bytesPerRow <= TileCacheBytes || mSleepThreshold > 0.0f || mMasked)
+	{
+		for(int k = 0; k < steps; ++k)
+			StepSolution();
+		return;
+	}
+
+	while(steps > 0)
+	{
+		int blockSteps = std::min(steps, depth);
+		if(mStorage == Storage::Float16)
+			AdvanceBlocked(mHalfVelocity, mHalfHeights, mBlockHalfVelocity, mBlockHalfHeights, blockSteps, rowsInCache - 2*depth);
+		else
+			AdvanceBlocked(mPrevSolution, mCurrSolution, mBlockPrev, mBlockCurr, blockSteps, rowsInCache - 2*depth);
+		mStepCount += blockSteps;
+		steps -= blockSteps;
+	}
+
+	// Normals only depend on the final solution.
+	ComputeNormals();
+
+	++mRevision;
+	MarkRowsChanged(0, mNumRows);
+}
+
+void Waves::StepSolution()
+{
+	BeginStep();
+
+	const int passes = SweepPassCount();
+	for(int pass = 0; pass < passes; ++pass)
+	{
+		JobSystem::Default().ParallelFor(0, mTileRowCount, [this, pass](int band)
+		{
+			SweepBand(pass, band);
+		});
+	}
+
+	EndStep();
+}
+
+int Waves::BandCount()const
+{
+	return mTileRowCount;
+}
+
+int Waves::SweepPassCount()const
+{
+	return mStorage == Storage::Float16 ? 3 : 2;
+}
+
+void Waves::BeginStep()
+{
+	// Damp the absorbing band first, so the normals computed below match the heights.
+	if(mSpongeWidth > 0)
+		Absorb();
+}
+
+void Waves::SweepBand(int pass, int band)
+{
+	if(mStorage == Storage::Float16)
+		SweepVelocityBand(pass, band);
+	else
+		SweepHeightsBand(pass, band);
+}
+
+void Waves::EndStep()
+{
+	// We just overwrote the previous buffer with the new data, so
+	// this data needs to become the current solution and the old
+	// current solution becomes the new previous solution.  Half
+	// precision planes are updated in place.
+	if(mStorage == Storage::Float32)
+		std::swap(mPrevSolution, mCurrSolution);
+
+	ReflectShore();
+
+	// Tiles going to sleep below are still awake here.
+	++mRevision;
+	MarkAwakeRowsChanged();
+
+	if(mSleepThreshold > 0.0f)
+		UpdateTileActivity();
+
+	++mStepCount;
+}
+
+void Waves::SweepHeightsBand(int pass, int band)
+{
+	// The interior rows are split into bands, one per tile row.  Each band updates
+	// the water in the awake tiles of its rows top to bottom and computes the normals
+	// of row i-1 as soon as row i has its new height, while rows i-2..i are still in
+	// cache.  Rows on a band edge need a row of the neighbouring band, so their
+	// normals are finished in a second, short pass.  Sleeping tiles and dry points
+	// are skipped by both.
+	const int m = mNumRows;
+	int r0 = 1 + band*BandRows;
+	int r1 = std::min(m - 1, r0 + BandRows);
+
+	// Rows whose neighbour rows are all updated by this band (or are boundary rows).
+	int first = (r0 > 1) ? r0 + 1 : r0;
+	int last = (r1 < m - 1) ? r1 - 1 : r1;
+
+	// Merge neighbouring awake tiles into column runs.
+	thread_local std::vector<int> columns;
+	BuildAwakeColumns(band, columns);
+
+	float* next = mPrevSolution.data();
+	const float* curr = mCurrSolution.data();
+
+	auto normals = [&](int center, int up, int down, int count)
+	{
+		ComputeNormalsRun(next, center, up, down, count);
+	};
+
+	if(pass > 0)
+	{
+		for(int i = r0; i < r1; ++i)
+		{
+			if(i < first || i >= last)
+				ForEachActiveRun(i, columns, normals);
+		}
+		return;
+	}
+
+	auto step = [&](int center, int up, int down, int count)
+	{
+		StepRow(next + center, curr + center, curr + up, curr + down, count, mK1, mK2, mK3);
+	};
+
+	for(int i = r0; i < r1; ++i)
+	{
+		// After this update we will be discarding the old previous
+		// buffer, so overwrite that buffer with the new update.
+		// Note how we can do this inplace (read/write to same element) 
+		// because we won't need prev_ij again and the assignment happens last.
+
+		// Note j indexes x and i indexes z: h(x_j, z_i, t_k)
+		// Moreover, our +z axis goes "down"; this is just to 
+		// keep consistent with our row indices going down.
+		ForEachActiveRun(i, columns, step);
+
+		if(i - 1 >= first && i - 1 < last)
+			ForEachActiveRun(i - 1, columns, normals);
+	}
+
+	if(r1 - 1 >= first && r1 - 1 < last)
+		ForEachActiveRun(r1 - 1, columns, normals);
+
+	if(mSleepThreshold > 0.0f)
+		MeasureBandEnergy(band, r0, r1);
+}
+
+void Waves::SweepVelocityBand(int pass, int band)
+{
+	// Half precision heights cannot be updated in place like the float ones: the
+	// velocities are written in place, but a row's new height may only be committed
+	// once the rows next to it have read the old one.  Each band commits row i-1
+	// after stepping row i and computes the normals of row i-2 after that, all while
+	// the rows are in cache.  Band edge rows are read by the neighbouring band, so
+	// they are committed in a second pass and the normals around them finished in a
+	// third.
+	const int m = mNumRows;
+	int r0 = 1 + band*BandRows;
+	int r1 = std::min(m - 1, r0 + BandRows);
+
+	// Rows only this band reads (or boundary rows).
+	int first = (r0 > 1) ? r0 + 1 : r0;
+	int last = (r1 < m - 1) ? r1 - 1 : r1;
+
+	thread_local std::vector<int> columns;
+	BuildAwakeColumns(band, columns);
+
+	std::uint16_t* velocity = mHalfVelocity.data();
+	std::uint16_t* heights = mHalfHeights.data();
+
+	auto step = [&](int center, int up, int down, int count)
+	{
+		StepVelocityRow(velocity + center, heights + center, heights + up, heights + down, count, -mK1, mK3);
+	};
+	auto commit = [&](int center, int, int, int count)
+	{
+		CommitHeightRow(heights + center, velocity + center, count);
+	};
+	auto normals = [&](int center, int up, int down, int count)
+	{
+		ComputeNormalsRun(heights, center, up, down, count);
+	};
+
+	if(pass == 0)
+	{
+		for(int i = r0; i < r1 + 2; ++i)
+		{
+			if(i < r1)
+				ForEachActiveRun(i, columns, step);
+
+			if(i - 1 >= first && i - 1 < last)
+				ForEachActiveRun(i - 1, columns, commit);
+
+			if(i - 2 > first && i - 2 < last - 1)
+				ForEachActiveRun(i - 2, columns, normals);
+		}
+	}
+	else if(pass == 1)
+	{
+		for(int i = r0; i < r1; ++i)
+		{
+			if(i < first || i >= last)
+				ForEachActiveRun(i, columns, commit);
+		}
+	}
+	else
+	{
+		for(int i = r0; i < r1; ++i)
+		{
+			if(i <= first || i >= last - 1)
+				ForEachActiveRun(i, columns, normals);
+		}
+
+		// Every height of the band is final only now.
+		if(mSleepThreshold > 0.0f)
+			MeasureBandEnergy(band, r0, r1);
+	}
+}
+
+void Waves::ReflectShore()
+{
+	// Only masked grids have a shore.
+	WithPlanes([this](auto&, auto& curr)
+	{
+		auto* heights = curr.data();
+
+		for(const Ghost& ghost : mGhosts)
+		{
+			float sum = 0.0f;
+			for(int k = 0; k < ghost.Count; ++k)
+				sum += LoadHeight(heights[ghost.Neighbors[k]]);
+
+			StoreHeight(heights[ghost.Offset], sum / ghost.Count);
+		}
+
+		for(const WetRun& point : mShore)
+			ComputeNormalsRun(heights, point.Center, point.Up, point.Down, 1);
+	});
+}
+void Waves::SetAbsorbingBoundary(int width, float strength)
+{
+	mSpongeWidth = std::max(0, std::min(width, std::min(mNumRows, mNumCols) / 2));
+
+	// The band damps rows and columns independently; corners get the product.
+	auto profile = [this, strength](int d)
+	{
+		if(d >= mSpongeWidth)
+			return 1.0f;
+
+		float t = (float)(mSpongeWidth - d) / mSpongeWidth;
+		return 1.0f - strength*t*t;
+	};
+
+	mSpongeRow.resize(mNumRows);
+	for(int i = 0; i < mNumRows; ++i)
+		mSpongeRow[i] = profile(std::min(i, mNumRows - 1 - i));
+
+	mSpongeCol.resize(mNumCols);
+	for(int j = 0; j < mNumCols; ++j)
+		mSpongeCol[j] = profile(std::min(j, mNumCols - 1 - j));
+}
+
+void Waves::Absorb()
+{
+	// Both time levels are scaled, which damps the height and its rate of change
+	// alike.  Scaling only the new heights would make the band itself reflect.
+	WithPlanes([this](auto& prev, auto& curr)
+	{
+		for(int i = 0; i < mNumRows; ++i)
+		{
+			for(int s = mRowSpanStart[i]; s < mRowSpanStart[i+1]; ++s)
+			{
+				const Span& span = mSpans[s];
+				AbsorbRun(&prev[span.Offset], i, span.Col0, span.Col1);
+				AbsorbRun(&curr[span.Offset], i, span.Col0, span.Col1);
+			}
+		}
+	});
+}
+
+template<typename T>
+void Waves::AbsorbRun(T* values, int i, int j0, int j1)const
+{
+	// values[0] is column j0 of row i.  Rows inside the band are damped throughout,
+	// other rows only in their first and last mSpongeWidth columns.
+	auto scale = [values, j0](int j, float factor)
+	{
+		StoreHeight(values[j - j0], LoadHeight(values[j - j0])*factor);
+	};
+
+	const float rowFactor = mSpongeRow[i];
+	if(rowFactor < 1.0f)
+	{
+		for(int j = j0; j < j1; ++j)
+			scale(j, rowFactor*mSpongeCol[j]);
+		return;
+	}
+
+	for(int j = j0; j < std::min(j1, mSpongeWidth); ++j)
+		scale(j, mSpongeCol[j]);
+
+	for(int j = std::max(j0, mNumCols - mSpongeWidth); j < j1; ++j)
+		scale(j, mSpongeCol[j]);
+}
+
+void Waves::BuildAwakeColumns(int band, std::vector<int>& columns)const
+{
+	// Columns are stored as [begin, end) pairs.
+	columns.clear();
+
+	const unsigned char* awake = &mTileAwake[band*mTileColCount];
+	for(int c = 0; c < mTileColCount; ++c)
+	{
+		if(!awake[c])
+			continue;
+
+		int j0 = 1 + c*TileColumns;
+		int j1 = std::min(mNumCols - 1, j0 + TileColumns);
+		if(!columns.empty() && columns.back() == j0)
+			columns.back() = j1;
+		else
+		{
+			columns.push_back(j0);
+			columns.push_back(j1);
+		}
+	}
+}
+
+void Waves::MeasureBandEnergy(int band, int r0, int r1)
+{
+	// A tile's activity is the largest height it had over the last two steps.
+	// The new solution is in the previous buffer until the swap.  Half precision
+	// planes hold the new heights and their velocities instead.
+	thread_local std::vector<int> columns(2);
+
+	for(int c = 0; c < mTileColCount; ++c)
+	{
+		int tile = band*mTileColCount + c;
+		if(!mTileAwake[tile])
+			continue;
+
+		columns[0] = 1 + c*TileColumns;
+		columns[1] = std::min(mNumCols - 1, columns[0] + TileColumns);
+
+		float energy = 0.0f;
+		WithPlanes([&](const auto& prev, const auto& curr)
+		{
+			for(int i = r0; i < r1; ++i)
+			{
+				ForEachActiveRun(i, columns, [&](int center, int, int, int count)
+				{
+					energy = std::max(energy, MaxAbs(&prev[center], count));
+					energy = std::max(energy, MaxAbs(&curr[center], count));
+				});
+			}
+		});
+
+		mTileEnergy[tile] = energy;
+	}
+}
+
+void Waves::UpdateTileActivity()
+{
+	// A tile stays awake while it, or any of its eight neighbours, is above the
+	// threshold.  Waves move at most one grid point per step, so energy about to
+	// cross into a sleeping tile wakes it before it arrives.
+	const int rows = mTileRowCount;
+	const int cols = mTileColCount;
+
+	std::vector<unsigned char> loud(mTileAwake.size());
+	for(size_t t = 0; t < loud.size(); ++t)
+		loud[t] = mTileAwake[t] && mTileEnergy[t] >= mSleepThreshold;
+
+	for(int tr = 0; tr < rows; ++tr)
+	{
+		for(int tc = 0; tc < cols; ++tc)
+		{
+			int tile = tr*cols + tc;
+
+			bool awake = false;
+			for(int dr = std::max(0, tr - 1); dr <= std::min(rows - 1, tr + 1) && !awake; ++dr)
+			{
+				for(int dc = std::max(0, tc - 1); dc <= std::min(cols - 1, tc + 1) && !awake; ++dc)
+					awake = loud[dr*cols + dc] != 0;
+			}
+			awake = awake && mTileWet[tile];
+
+			if(mTileAwake[tile] && !awake)
+				FlattenTile(tr, tc);
+
+			mTileAwake[tile] = awake;
+		}
+	}
+}
+
+void Waves::FlattenTile(int tileRow, int tileCol)
+{
+	// The heights of a tile going to sleep are negligible; set them to exactly zero
+	// so the tile is at rest when it wakes up again.
+	int r0 = 1 + tileRow*BandRows;
+	int r1 = std::min(mNumRows - 1, r0 + BandRows);
+	int c0 = 1 + tileCol*TileColumns;
+	int c1 = std::min(mNumCols - 1, c0 + TileColumns);
+
+	for(int i = r0; i < r1; ++i)
+	{
+		for(int s = mRowSpanStart[i]; s < mRowSpanStart[i+1]; ++s)
+		{
+			int j0 = std::max(c0, mSpans[s].Col0);
+			int j1 = std::min(c1, mSpans[s].Col1);
+			if(j0 >= j1)
+				continue;
+
+			int begin = mSpans[s].Offset + j0 - mSpans[s].Col0;
+			int end = begin + j1 - j0;
+			WithPlanes([begin, end](auto& prev, auto& curr)
+			{
+				// Zero has all bits clear in either storage type.
+				std::fill(prev.begin() + begin, prev.begin() + end, 0);
+				std::fill(curr.begin() + begin, curr.begin() + end, 0);
+			});
+			std::fill(&mNormals[begin], &mNormals[end], XMFLOAT3(0.0f, 1.0f, 0.0f));
+			if(mComputeTangents)
+				std::fill(&mTangentX[begin], &mTangentX[end], XMFLOAT3(1.0f, 0.0f, 0.0f));
+		}
+	}
+}
+
+void Waves::WakeTile(int i, int j)
+{
+	int tileRow = std::min(std::max((i - 1) / BandRows, 0), mTileRowCount - 1);
+	int tileCol = std::min(std::max((j - 1) / TileColumns, 0), mTileColCount - 1);
+	int tile = tileRow*mTileColCount + tileCol;
+
+	mTileAwake[tile] = mTileWet[tile];
+}
+
+template<typename T>
+void Waves::AdvanceBlocked(std::vector<T>& prevPlane, std::vector<T>& currPlane,
+	std::vector<T>& blockPrev, std::vector<T>& blockCurr, int steps, int tileRows)
+{
+	// Dense grids only: the solution is stored as full rows of mNumCols points.
+	assert(!mMasked);
+
+	const int m = mNumRows;
+	const int n = mNumCols;
+
+	blockPrev.resize(prevPlane.size());
+	blockCurr.resize(currPlane.size());
+
+	int tileCount = (m + tileRows - 1) / tileRows;
+	JobSystem::Default().ParallelFor(0, tileCount, [&](int tile)
+	{
+		// Each tile copies its rows plus 'steps' halo rows on both sides into
+		// cache resident buffers.  Every local step the rows that still have valid
+		// neighbours shrink by one on each side, so after 'steps' steps exactly the
+		// tile's own rows are up to date.  Grid edges are fixed, so no halo shrinks
+		// away from them.
+		int r0 = tile*tileRows;
+		int r1 = std::min(m, r0 + tileRows);
+		int lo = std::max(0, r0 - steps);
+		int hi = std::min(m, r1 + steps);
+
+		thread_local std::vector<T> prev;
+		thread_local std::vector<T> curr;
+		prev.assign(prevPlane.begin() + lo*n, prevPlane.begin() + hi*n);
+		curr.assign(currPlane.begin() + lo*n, currPlane.begin() + hi*n);
+
+		for(int s = 1; s <= steps; ++s)
+		{
+			// Rows that went stale in earlier local steps are damped too; they are
+			// never read by a row that is still valid.
+			if(mSpongeWidth > 0)
+			{
+				for(int i = lo; i < hi; ++i)
+				{
+					AbsorbRun(&prev[(i - lo)*n], i, 0, n);
+					AbsorbRun(&curr[(i - lo)*n], i, 0, n);
+				}
+			}
+
+			int first = (lo == 0) ? 1 : lo + s;
+			int last = (hi == m) ? m - 1 : hi - s;
+			StepBlockRows(prev, curr, lo, first, last);
+		}
+
+		std::copy(prev.begin() + (r0 - lo)*n, prev.begin() + (r1 - lo)*n, blockPrev.begin() + r0*n);
+		std::copy(curr.begin() + (r0 - lo)*n, curr.begin() + (r1 - lo)*n, blockCurr.begin() + r0*n);
+	});
+
+	std::swap(prevPlane, blockPrev);
+	std::swap(currPlane, blockCurr);
+}
+
+void Waves::StepBlockRows(std::vector<float>& prev, std::vector<float>& curr, int lo, int first, int last)const
+{
+	// Rows [first, last) of a block of full rows starting at row lo.
+	const int n = mNumCols;
+	for(int i = first; i < last; ++i)
+	{
+		int row = (i - lo)*n + 1;
+		StepRow(&prev[row], &curr[row], &curr[row - n], &curr[row + n],
+			n - 2, mK1, mK2, mK3);
+	}
+	std::swap(prev, curr);
+}
+
+void Waves::StepBlockRows(std::vector<std::uint16_t>& velocity, std::vector<std::uint16_t>& heights,
+	int lo, int first, int last)const
+{
+	// A block is swept by one thread, so each row is committed right after the row
+	// below it has been stepped.
+	const int n = mNumCols;
+	for(int i = first; i < last; ++i)
+	{
+		int row = (i - lo)*n + 1;
+		StepVelocityRow(&velocity[row], &heights[row], &heights[row - n], &heights[row + n],
+			n - 2, -mK1, mK3);
+
+		if(i > first)
+			CommitHeightRow(&heights[row - n], &velocity[row - n], n - 2);
+	}
+
+	if(first < last)
+	{
+		int row = (last - 1 - lo)*n + 1;
+		CommitHeightRow(&heights[row], &velocity[row], n - 2);
+	}
+}
+
+void Waves::ComputeNormals()
+{
+	WithPlanes([this](const auto&, const auto& curr)
+	{
+		const auto* heights = curr.data();
+
+		// A single row is too little work for a job; hand them out a band at a time.
+		JobSystem::Default().ParallelFor(1, mNumRows - 1, BandRows, [this, heights](int i)
+		{
+			for(int r = mRowRunStart[i]; r < mRowRunStart[i+1]; ++r)
+			{
+				const WetRun& run = mWetRuns[r];
+				ComputeNormalsRun(heights, run.Center, run.Up, run.Down, run.Col1 - run.Col0);
+			}
+		});
+	});
+}
+
+void Waves::ComputeNormalsBlock(int r0, int r1, int c0, int c1)
+{
+	// Normals of the water points in rows [r0, r1) and columns [c0, c1).
+	r0 = std::max(r0, 1);
+	r1 = std::min(r1, mNumRows - 1);
+
+	WithPlanes([&](const auto&, const auto& curr)
+	{
+		for(int i = r0; i < r1; ++i)
+		{
+			for(int r = mRowRunStart[i]; r < mRowRunStart[i+1]; ++r)
+			{
+				const WetRun& run = mWetRuns[r];
+				int j0 = std::max(c0, run.Col0);
+				int j1 = std::min(c1, run.Col1);
+				if(j0 < j1)
+				{
+					int skip = j0 - run.Col0;
+					ComputeNormalsRun(curr.data(), run.Center + skip, run.Up + skip, run.Down + skip, j1 - j0);
+				}
+			}
+		}
+	});
+}
+
+template<typename T>
+void Waves::ComputeNormalsRun(const T* heights, int center, int up, int down, int count)
+{
+	//
+	// Compute normals using finite difference scheme.
+	//
+	const T* row = heights + center;
+	const T* upRow = heights + up;
+	const T* downRow = heights + down;
+	const float twoDx = 2.0f*mSpatialStep;
+
+	// Normals and tangents are normalized in registers and written straight to
+	// their XMFLOAT3 arrays, four grid points at a time.
+	XMFLOAT3* normals = &mNormals[center];
+	XMFLOAT3* tangents = mComputeTangents ? &mTangentX[center] : nullptr;
+
+	int j = 0;
+
+#if defined(WAVES_SIMD_AVX) || defined(WAVES_SIMD_SSE)
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 ny = _mm_set1_ps(twoDx);
+	const __m128 ny2 = _mm_set1_ps(twoDx*twoDx);
+	for(; j + 4 <= count; j += 4)
+	{
+		__m128 l = Load4(row + j - 1);
+		__m128 r = Load4(row + j + 1);
+		__m128 nx = _mm_sub_ps(l, r);
+		__m128 nz = _mm_sub_ps(Load4(downRow + j), Load4(upRow + j));
+
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), ny2), _mm_mul_ps(nz, nz));
+		__m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(length2));
+		StoreFloat3x4(normals + j, _mm_mul_ps(nx, invLength), _mm_mul_ps(ny, invLength), _mm_mul_ps(nz, invLength));
+
+		if(tangents)
+		{
+			__m128 ty = _mm_sub_ps(r, l);
+			invLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(ny2, _mm_mul_ps(ty, ty))));
+			StoreFloat3x4(tangents + j, _mm_mul_ps(ny, invLength), _mm_mul_ps(ty, invLength), zero);
+		}
+	}
+#endif
+
+	for(; j < count; ++j)
+	{
+		float l = LoadHeight(row[j-1]);
+		float r = LoadHeight(row[j+1]);
+		float nx = l - r;
+		float nz = LoadHeight(downRow[j]) - LoadHeight(upRow[j]);
+		float invLength = 1.0f / sqrtf(nx*nx + twoDx*twoDx + nz*nz);
+
+		normals[j] = XMFLOAT3(nx*invLength, twoDx*invLength, nz*invLength);
+
+		if(tangents)
+		{
+			float ty = r - l;
+			invLength = 1.0f / sqrtf(twoDx*twoDx + ty*ty);
+
+			tangents[j] = XMFLOAT3(twoDx*invLength, ty*invLength, 0.0f);
+		}
+	}
+}
+
+void Waves::EnableTangents(bool enable)
+{
+	if(enable == mComputeTangents)
+		return;
+
+	mComputeTangents = enable;
+
+	// Tangents are rebuilt by the next step; until then they describe flat water.
+	if(enable)
+		mTangentX.assign(mStoredCount, XMFLOAT3(1.0f, 0.0f, 0.0f));
+	else
+		std::vector<XMFLOAT3>().swap(mTangentX);
+}
+
+void Waves::Disturb(int i, int j, float magnitude)
+{
+	// Don't disturb boundaries.
+	assert(i > 1 && i < mNumRows-2);
+	assert(j > 1 && j < mNumCols-2);
 
 	float halfMag = 0.5f*magnitude;
 
-	// Disturb the ijth vertex height and its neighbors.
-	mCurrSolution[i*mNumCols+j].y     += magnitude;
-	mCurrSolution[i*mNumCols+j+1].y   += halfMag;
-	mCurrSolution[i*mNumCols+j-1].y   += halfMag;
-	mCurrSolution[(i+1)*mNumCols+j].y += halfMag;
-	mCurrSolution[(i-1)*mNumCols+j].y += halfMag;
+	++mRevision;
+	MarkRowsChanged(i - 1, i + 2);
+
+	// Disturb the ijth vertex height and its neighbors.  Points on land are left alone.
+	AddHeight(i, j, magnitude);
+	AddHeight(i, j+1, halfMag);
+	AddHeight(i, j-1, halfMag);
+	AddHeight(i+1, j, halfMag);
+	AddHeight(i-1, j, halfMag);
+}
+
+void Waves::AddHeight(int i, int j, float amount)
+{
+	int offset = WetOffset(i, j);
+	if(offset < 0)
+		return;
+
+	AddStoredHeight(offset, amount);
+	WakeTile(i, j);
+}
+
+void Waves::MarkRowsChanged(int r0, int r1)
+{
+	// Rows [r0, r1), clipped to the grid, take the current revision.
+	r0 = std::max(r0, 0);
+	r1 = std::min(r1, mNumRows);
+	if(r0 < r1)
+		std::fill(mRowRevision.begin() + r0, mRowRevision.begin() + r1, mRevision);
+}
+
+void Waves::MarkAwakeRowsChanged()
+{
+	// Only the awake tiles move.  The rows next to a band hold its shore and boundary
+	// points.
+	for(int band = 0; band < mTileRowCount; ++band)
+	{
+		const unsigned char* awake = &mTileAwake[band*mTileColCount];
+		if(std::find(awake, awake + mTileColCount, (unsigned char)1) == awake + mTileColCount)
+			continue;
+
+		int r0 = 1 + band*BandRows;
+		int r1 = std::min(mNumRows - 1, r0 + BandRows);
+		MarkRowsChanged(r0 - 1, r1 + 1);
+	}
+}
+
+void Waves::AddStoredHeight(int offset, float amount)
+{
+	// Raising only the current height also raises its rate of change; half precision
+	// planes store that rate, so it is raised explicitly.
+	if(mStorage == Storage::Float16)
+	{
+		mHalfHeights[offset] = FloatToHalf(HalfToFloat(mHalfHeights[offset]) + amount);
+		mHalfVelocity[offset] = FloatToHalf(HalfToFloat(mHalfVelocity[offset]) + amount);
+	}
+	else
+		mCurrSolution[offset] += amount;
+}
+
+void Waves::DisturbBatch(const Impulse* impulses, int count)
+{
+	// Bin the impulses by the tiles their footprints overlap.  The counting sort keeps
+	// each tile's impulses in submission order.
+	const int tileCount = mTileRowCount*mTileColCount;
+	std::vector<int> binStart(tileCount + 1, 0);
+
+	auto forEachTile = [&](const Impulse& impulse, auto fn)
+	{
+		int r0, r1, c0, c1;
+		if(!ClipImpulse(impulse, r0, r1, c0, c1))
+			return;
+
+		for(int tr = (r0 - 1) / BandRows; tr <= (r1 - 2) / BandRows; ++tr)
+		{
+			for(int tc = (c0 - 1) / TileColumns; tc <= (c1 - 2) / TileColumns; ++tc)
+				fn(tr*mTileColCount + tc);
+		}
+	};
+
+	for(int k = 0; k < count; ++k)
+		forEachTile(impulses[k], [&](int tile) { ++binStart[tile + 1]; });
+
+	for(int tile = 0; tile < tileCount; ++tile)
+		binStart[tile + 1] += binStart[tile];
+
+	std::vector<int> bins(binStart[tileCount]);
+	std::vector<int> binEnd(binStart.begin(), binStart.end() - 1);
+	for(int k = 0; k < count; ++k)
+		forEachTile(impulses[k], [&](int tile) { bins[binEnd[tile]++] = k; });
+
+	std::vector<int> tiles;
+	++mRevision;
+	for(int tile = 0; tile < tileCount; ++tile)
+	{
+		if(binEnd[tile] > binStart[tile] && mTileWet[tile])
+		{
+			tiles.push_back(tile);
+
+			int r0 = 1 + (tile / mTileColCount)*BandRows;
+			MarkRowsChanged(r0, r0 + BandRows);
+		}
+	}
+
+	// Each task only writes the points of its own tile, so tiles splat in parallel
+	// without conflicts.
+	JobSystem::Default().ParallelFor(0, (int)tiles.size(), [&](int t)
+	{
+		int tile = tiles[t];
+		SplatTile(tile, impulses, &bins[binStart[tile]], binEnd[tile] - binStart[tile]);
+	});
+}
+
+bool Waves::ClipImpulse(const Impulse& impulse, int& r0, int& r1, int& c0, int& c1)const
+{
+	float radius = std::max(impulse.Radius, mSpatialStep);
+
+	// Grid coordinates of the footprint, clamped before converting so far away
+	// impulses cannot overflow.
+	float col0 = std::ceil((impulse.X - radius + mHalfWidth) / mSpatialStep);
+	float col1 = std::floor((impulse.X + radius + mHalfWidth) / mSpatialStep) + 1.0f;
+	float row0 = std::ceil((mHalfDepth - impulse.Z - radius) / mSpatialStep);
+	float row1 = std::floor((mHalfDepth - impulse.Z + radius) / mSpatialStep) + 1.0f;
+
+	// Also rejects NaN positions.
+	if(!(col0 < mNumCols - 1.0f && col1 > 1.0f && row0 < mNumRows - 1.0f && row1 > 1.0f))
+		return false;
+
+	c0 = (int)std::max(col0, 1.0f);
+	c1 = std::min(mNumCols - 1, (int)std::min(col1, (float)mNumCols));
+	r0 = (int)std::max(row0, 1.0f);
+	r1 = std::min(mNumRows - 1, (int)std::min(row1, (float)mNumRows));
+
+	return c0 < c1 && r0 < r1;
+}
+
+void Waves::SplatTile(int tile, const Impulse* impulses, const int* indices, int count)
+{
+	int tileRow = tile / mTileColCount;
+	int tileCol = tile - tileRow*mTileColCount;
+	int tileR0 = 1 + tileRow*BandRows;
+	int tileR1 = std::min(mNumRows - 1, tileR0 + BandRows);
+	int tileC0 = 1 + tileCol*TileColumns;
+	int tileC1 = std::min(mNumCols - 1, tileC0 + TileColumns);
+
+	bool touched = false;
+	for(int k = 0; k < count; ++k)
+	{
+		const Impulse& impulse = impulses[indices[k]];
+
+		int r0, r1, c0, c1;
+		ClipImpulse(impulse, r0, r1, c0, c1);
+		r0 = std::max(r0, tileR0);
+		r1 = std::min(r1, tileR1);
+		c0 = std::max(c0, tileC0);
+		c1 = std::min(c1, tileC1);
+
+		float radius = std::max(impulse.Radius, mSpatialStep);
+		float invRadiusSq = 1.0f / (radius*radius);
+
+		for(int i = r0; i < r1; ++i)
+		{
+			float dz = mHalfDepth - i*mSpatialStep - impulse.Z;
+
+			for(int r = mRowRunStart[i]; r < mRowRunStart[i+1]; ++r)
+			{
+				const WetRun& run = mWetRuns[r];
+				int j0 = std::max(c0, run.Col0);
+				int j1 = std::min(c1, run.Col1);
+
+				for(int j = j0; j < j1; ++j)
+				{
+					float dx = -mHalfWidth + j*mSpatialStep - impulse.X;
+					float t = (dx*dx + dz*dz)*invRadiusSq;
+					if(t >= 1.0f)
+						continue;
+
+					// The Gaussian has its standard deviation at a third of the radius.
+					float weight = (impulse.Kernel == SplatKernel::Gaussian) ?
+						std::exp(-4.5f*t) :
+						0.5f + 0.5f*std::cos(XM_PI*std::sqrt(t));
+
+					AddStoredHeight(run.Center + j - run.Col0, impulse.Magnitude*weight);
+					touched = true;
+				}
+			}
+		}
+	}
+
+	if(touched)
+		mTileAwake[tile] = 1;
 }
-	
@@ -4,42 +4,329 @@
 // Performs the calculations for the wave simulation.  After the simulation has been
 // updated, the client must copy the current solution into vertex buffers for rendering.
 // This class only does the calculations, it does not do any drawing.
+//
+// Only the heights of the grid points change over time, so the solution is stored as
+// contiguous height planes, in single or half precision; the x/z coordinates are
+// rebuilt on demand.
+//
+// An optional wet/dry mask limits the simulation to the water points.  The planes then
+// hold, row by row, only the runs of water points and the dry points bordering them,
+// and waves reflect off the shoreline.
 //***************************************************************************************
 
 #ifndef WAVES_H
 #define WAVES_H
 
+#include "IWaveSimulator.h"
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <DirectXMath.h>
 
-class Waves
+class Waves : public IWaveSimulator
 {
 public:
-    Waves(int m, int n, float dx, float dt, float speed, float damping);
+	// Storage type of the solution.  Half precision halves the memory footprint and
+	// traffic of the solver, which is bandwidth bound on large grids; the stencil still
+	// computes in single precision and the accessors return floats either way.  The
+	// half planes hold the heights and their change per step rather than two time
+	// levels, so slow waves whose per-step change is below the precision of the height
+	// keep moving instead of freezing in place.
+	enum class Storage
+	{
+		Float32,
+		Float16
+	};
+
+    // wetMask, if not empty, holds m*n flags in row major order marking the grid points
+    // that are water.  The outermost ring of the grid is always treated as dry.
+    Waves(int m, int n, float dx, float dt, float speed, float damping,
+        const std::vector<bool>& wetMask = std::vector<bool>(),
+        Storage storage = Storage::Float32);
     Waves(const Waves& rhs) = delete;
     Waves& operator=(const Waves& rhs) = delete;
-    ~Waves();
+    ~Waves()override;
+
+	int RowCount()const override;
+	int ColumnCount()const override;
+	int VertexCount()const override;
+	int TriangleCount()const override;
+	float Width()const override;
+	float Depth()const override;
+	float TimeStep()const;
+
+	// Number of grid points the solver stores: all of them without a mask, otherwise
+	// the water points and the dry points bordering them.
+	int StoredPointCount()const;
+
+	Storage HeightStorage()const;
+
+	// Returns the solution at the ith grid point.  Points on land are flat at height 0.
+    DirectX::XMFLOAT3 Position(int i)const override;
 
-	int RowCount()const;
-	int ColumnCount()const;
-	int VertexCount()const;
-	int TriangleCount()const;
-	float Width()const;
-	float Depth()const;
+	// Returns the ith grid point at the given height.  Only reads the grid layout, so it
+	// may be called while another thread steps the simulation.
+    DirectX::XMFLOAT3 Position(int i, float height)const;
 
-	// Returns the solution at the ith grid point.
-    const DirectX::XMFLOAT3& Position(int i)const { return mCurrSolution[i]; }
+    DirectX::XMFLOAT3 RestPosition(int i)const override;
+
+	// Returns the solution height at the ith grid point.
+    float Height(int i)const;
 
 	// Returns the solution normal at the ith grid point.
-    const DirectX::XMFLOAT3& Normal(int i)const { return mNormals[i]; }
+    DirectX::XMFLOAT3 Normal(int i)const override;
 
 	// Returns the unit tangent vector at the ith grid point in the local x-axis direction.
-    const DirectX::XMFLOAT3& TangentX(int i)const { return mTangentX[i]; }
+	// Only available while tangent generation is enabled.
+    DirectX::XMFLOAT3 TangentX(int i)const;
+
+	// Tangents are generated by default; clients whose vertices have no tangent can
+	// turn them off to skip their computation and storage.
+	void EnableTangents(bool enable);
+
+	// Copies the current heights and normals of all VertexCount() grid points, in row
+	// major order, into the given arrays.
+	void ReadSolution(float* heights, DirectX::XMFLOAT3* normals)const;
+
+	// Bilinearly interpolates the current solution at 'count' x/z positions in the frame
+	// of Position().  Positions outside the grid are clamped to its edge.
+	void SampleHeights(const DirectX::XMFLOAT2* xz, float* heights, int count)const;
+	void SampleNormals(const DirectX::XMFLOAT2* xz, DirectX::XMFLOAT3* normals, int count)const;
+
+	// The same for a full grid copy of the solution, such as one filled by ReadSolution.
+	// Only reads the grid layout of this object.
+	void SampleHeights(const float* grid, const DirectX::XMFLOAT2* xz, float* heights, int count)const;
+	void SampleNormals(const DirectX::XMFLOAT3* grid, const DirectX::XMFLOAT2* xz,
+		DirectX::XMFLOAT3* normals, int count)const;
+
+	void WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const override;
+
+	// The same for a full grid copy of the solution, such as one filled by ReadSolution.
+	// Only reads the grid layout of this object.
+	void WriteVertices(const float* heights, const DirectX::XMFLOAT3* normals,
+		int row0, int col0, int rows, int cols, SurfaceVertex* dst)const;
+
+	// A vertex of the compact stream: the height in IEEE half precision and the normal
+	// octahedron encoded in two snorm8 values, with the pole on +y.  The x/z and texture
+	// coordinates of a grid point never change, so renderers keep them in a static
+	// stream and only upload these 4 bytes per vertex.
+	struct CompactVertex
+	{
+		std::uint16_t Height;
+		std::int8_t Normal[2];
+	};
+
+	// WriteVertices for the compact stream.
+	void WriteCompactVertices(int row0, int col0, int rows, int cols, CompactVertex* dst)const;
+	void WriteCompactVertices(const float* heights, const DirectX::XMFLOAT3* normals,
+		int row0, int col0, int rows, int cols, CompactVertex* dst)const;
+
+	void Update(float dt)override;
+	void Disturb(int i, int j, float magnitude)override;
+
+	// Accumulates dt seconds on this simulation's clock and returns the number of time
+	// steps now due, which Update(dt) takes.  Time left over carries to the next call,
+	// so the simulation keeps real time at any frame rate.  At most the substep limit
+	// is returned; a longer backlog is dropped, which bounds the cost of a frame.
+	int AdvanceClock(float dt);
+
+	// Most time steps one Update may take; 4 by default.
+	void SetMaxSubsteps(int steps);
+
+	// Fraction of a time step accumulated since the last step, in [0, 1).
+	float InterpolationFactor()const;
+
+	// With interpolation on, the heights read back (Position, Height, ReadSolution,
+	// SampleHeights, WriteVertices, ...) are blended between the last two solutions by
+	// InterpolationFactor, so the surface moves smoothly whatever the frame rate, one
+	// time step behind the simulation.  Normals are those of the current solution.
+	void EnableInterpolation(bool enable);
+
+	// Stepping in phases, for schedulers that batch the work of several simulations
+	// into one parallel dispatch (see WaveWorld).  One time step is BeginStep(), then
+	// for each of the SweepPassCount() passes in order SweepBand() for every one of
+	// the BandCount() bands, which may run concurrently, then EndStep().
+	int BandCount()const;
+	int SweepPassCount()const;
+	void BeginStep();
+	void SweepBand(int pass, int band);
+	void EndStep();
+
+	enum class SplatKernel
+	{
+		Gaussian,
+		Cosine
+	};
+
+	// A disturbance spread over a disc centred at (X, Z), in the x/z frame of Position().
+	// The kernel falls from Magnitude at the centre to (nearly) zero at Radius; radii
+	// below the grid spacing are widened to it.
+	struct Impulse
+	{
+		float X = 0.0f;
+		float Z = 0.0f;
+		float Radius = 1.0f;
+		float Magnitude = 0.0f;
+		SplatKernel Kernel = SplatKernel::Gaussian;
+	};
+
+	// Applies 'count' impulses at once.  Impulses are clipped to the water interior, so
+	// they may overlap the grid edge, the shore or lie entirely outside the grid.
+	void DisturbBatch(const Impulse* impulses, int count);
+
+	// Sparse simulation: the interior is split into tiles that go to sleep once all
+	// their heights stay below the threshold, and are skipped by the solver until a
+	// Disturb or a wave from a neighbouring tile wakes them.  A threshold of zero
+	// (the default) keeps every tile awake.
+	void SetSleepThreshold(float threshold);
 
-	void Update(float dt);
-	void Disturb(int i, int j, float magnitude);
+	// Absorbing boundary: waves are damped over a band of 'width' points along the grid
+	// edge, so they leave the grid instead of reflecting off it and the grid only needs
+	// to cover the visible water.  'strength' is the fraction of the height removed per
+	// step next to the edge; it fades quadratically to zero at the inner side of the
+	// band.  A width of zero (the default) keeps the reflecting edge.
+	void SetAbsorbingBoundary(int width, float strength = 0.05f);
+
+	struct TileStats
+	{
+		int ActiveTiles = 0;
+		int TotalTiles = 0;
+	};
+	TileStats GetTileStats()const;
+
+	// Number of time steps taken since construction, or since the loaded snapshot
+	// was saved.
+	std::uint64_t StepCount()const;
+
+	// Change tracking for incremental uploads.  Revision() grows whenever the solution
+	// changes and each row keeps the revision of its last change, so a client holding
+	// a copy of some rows made at revision r only needs to recopy the rows whose
+	// revision is above r.  Revisions start at 1; 0 stands for no copy at all.  The
+	// tracking is conservative: rows of awake tiles count as changed every step.
+	std::uint64_t Revision()const;
+	void ReadRowRevisions(std::uint64_t* revisions)const;
+
+	// Reads both time levels of the rows x cols block of grid points starting at row
+	// row0, column col0, in row major order: the heights one step ago and now.  Points
+	// on land read as 0.  Either array may be null.
+	void ReadTimeLevels(int row0, int col0, int rows, int cols, float* prev, float* curr)const;
+
+	// Overwrites both time levels of the block, in the layout ReadTimeLevels reads.
+	// Land points are left alone.  This is how nested grids exchange their solutions:
+	// the outer ring of grid points is never stepped, so writing it sets the boundary
+	// the next steps see.  The normals around the block follow the new heights and
+	// sleeping tiles in it wake up.
+	void WriteTimeLevels(int row0, int col0, int rows, int cols, const float* prev, const float* curr);
+
+	// Scrolls the solution by whole grid points, so that the point at row i+rows,
+	// column j+cols moves to (i, j).  Points scrolled in from outside the grid are flat.
+	// Grids without a mask only.
+	void Shift(int rows, int cols);
+
+	// Writes the height planes, the solver constants and the step counter to a binary
+	// file.  Returns false if the file could not be written.
+	bool SaveSnapshot(const std::string& path)const;
+
+	// Restores a snapshot saved from a grid of the same size, spacing, mask, storage type
+	// and solver constants (time step, speed and damping).  The file is mapped and its
+	// planes copied straight into the solution without any parsing.  Returns false,
+	// leaving the simulation untouched, if the file is missing, of another format
+	// version, from another grid or from other physics.
+	bool LoadSnapshot(const std::string& path);
+
+	// Advances the simulation by 'steps' time steps, with the same result as that many
+	// Update calls that each trigger a step.  Grids larger than the cache are advanced
+	// in row tiles several steps at a time (temporal blocking), so the solution streams
+	// through memory once per block instead of twice per step.
+	void Advance(int steps);
 
 private:
+	// A run of consecutive stored points [Col0, Col1) of one row.  Offset indexes
+	// the first point in the solution arrays.
+	struct Span
+	{
+		int Col0 = 0;
+		int Col1 = 0;
+		int Offset = 0;
+	};
+
+	// A run of consecutive water points of one row, with the solution offsets of its
+	// first point and of the points directly above and below it.
+	struct WetRun
+	{
+		int Row = 0;
+		int Col0 = 0;
+		int Col1 = 0;
+		int Center = 0;
+		int Up = 0;
+		int Down = 0;
+	};
+
+	// A dry point bordering the water; it takes the mean height of its water neighbours.
+	struct Ghost
+	{
+		int Offset = 0;
+		int Count = 0;
+		int Neighbors[4];
+	};
+
+	void BuildLayout(const std::vector<bool>& wetMask);
+	std::uint32_t LayoutHash()const;
+	int BytesPerHeight()const;
+	int StoredOffset(int row, int col)const;
+	int WetOffset(int row, int col)const;
+	void ReadRow(int row, int col0, int cols, float* heights, DirectX::XMFLOAT3* normals)const;
+	void LoadDisplayHeights(int offset, int count, float* heights)const;
+	template<typename Fn>
+	void ForEachActiveRun(int row, const std::vector<int>& columns, Fn fn)const;
+
+	// Calls fn(prev, curr) with the two solution planes in their storage type: the
+	// previous and current heights, or for half precision the velocities and heights.
+	template<typename Fn>
+	void WithPlanes(Fn fn);
+	template<typename Fn>
+	void WithPlanes(Fn fn)const;
+
+	void StepSolution();
+	void SweepHeightsBand(int pass, int band);
+	void SweepVelocityBand(int pass, int band);
+	void StepBlockRows(std::vector<float>& prev, std::vector<float>& curr, int lo, int first, int last)const;
+	void StepBlockRows(std::vector<std::uint16_t>& velocity, std::vector<std::uint16_t>& heights,
+		int lo, int first, int last)const;
+	template<typename T>
+	void AdvanceBlocked(std::vector<T>& prevPlane, std::vector<T>& currPlane,
+		std::vector<T>& blockPrev, std::vector<T>& blockCurr, int steps, int tileRows);
+	void ComputeNormals();
+	template<typename T>
+	void ComputeNormalsRun(const T* heights, int center, int up, int down, int count);
+	void ComputeNormalsBlock(int r0, int r1, int c0, int c1);
+	void ReflectShore();
+	void Absorb();
+	template<typename T>
+	void AbsorbRun(T* values, int i, int j0, int j1)const;
+	void AddHeight(int i, int j, float amount);
+	void MarkRowsChanged(int r0, int r1);
+	void MarkAwakeRowsChanged();
+	void AddStoredHeight(int offset, float amount);
+	bool ClipImpulse(const Impulse& impulse, int& r0, int& r1, int& c0, int& c1)const;
+	void SplatTile(int tile, const Impulse* impulses, const int* indices, int count);
+
+	void BuildAwakeColumns(int band, std::vector<int>& columns)const;
+	void MeasureBandEnergy(int band, int r0, int r1);
+	void UpdateTileActivity();
+	void FlattenTile(int tileRow, int tileCol);
+	void WakeTile(int i, int j);
+
+private:
+	// Rough per-core L2 budget for one temporal block tile, and the deepest block.
+	static const int TileCacheBytes = 256*1024;
+	static const int MaxTemporalSteps = 8;
+
+	// Rows per task of the fused height/normal pass, which is also the tile height,
+	// and columns per tile.
+	static const int BandRows = 16;
+	static const int TileColumns = 32;
+
     int mNumRows = 0;
     int mNumCols = 0;
 
@@ -52,12 +339,63 @@ private:
     float mK3 = 0.0f;
 
     float mTimeStep = 0.0f;
+    float mClock = 0.0f;
+    int mMaxSubsteps = 4;
+    bool mInterpolate = false;
+    std::uint64_t mStepCount = 0;
+    std::uint64_t mRevision = 1;
+    std::vector<std::uint64_t> mRowRevision;
     float mSpatialStep = 0.0f;
+    float mHalfWidth = 0.0f;
+    float mHalfDepth = 0.0f;
 
-    std::vector<DirectX::XMFLOAT3> mPrevSolution;
-    std::vector<DirectX::XMFLOAT3> mCurrSolution;
+    // x and texture u of every column, z and texture v of every row, for WriteVertices.
+    std::vector<float> mGridX;
+    std::vector<float> mGridZ;
+    std::vector<float> mTexU;
+    std::vector<float> mTexV;
+
+    bool mComputeTangents = true;
+
+    // Layout of the solution arrays.  Stored points are listed per row in
+    // mSpans[mRowSpanStart[i], mRowSpanStart[i+1]), water runs likewise.
+    bool mMasked = false;
+    int mStoredCount = 0;
+    std::vector<Span> mSpans;
+    std::vector<int> mRowSpanStart;
+    std::vector<WetRun> mWetRuns;
+    std::vector<int> mRowRunStart;
+    std::vector<Ghost> mGhosts;
+    std::vector<WetRun> mShore;
+
+    // Solution planes, one value per stored point in row major order.  Only the pair
+    // matching mStorage is allocated; half precision values are IEEE binary16 bits.
+    Storage mStorage = Storage::Float32;
+    std::vector<float> mPrevSolution;
+    std::vector<float> mCurrSolution;
+    std::vector<std::uint16_t> mHalfVelocity;
+    std::vector<std::uint16_t> mHalfHeights;
     std::vector<DirectX::XMFLOAT3> mNormals;
     std::vector<DirectX::XMFLOAT3> mTangentX;
+
+    // Sparse simulation state, one entry per tile in row major order.
+    int mTileRowCount = 0;
+    int mTileColCount = 0;
+    float mSleepThreshold = 0.0f;
+    std::vector<unsigned char> mTileWet;
+    std::vector<unsigned char> mTileAwake;
+    std::vector<float> mTileEnergy;
+
+    // Absorbing boundary: per row and per column damping factors, one outside the band.
+    int mSpongeWidth = 0;
+    std::vector<float> mSpongeRow;
+    std::vector<float> mSpongeCol;
+
+    // Output planes for Advance; only allocated once a grid is large enough to block.
+    std::vector<float> mBlockPrev;
+    std::vector<float> mBlockCurr;
+    std::vector<std::uint16_t> mBlockHalfVelocity;
+    std::vector<std::uint16_t> mBlockHalfHeights;
 };
 
 #endif // WAVES_H
\ No newline at end of file
@@ -0,0 +1,193 @@
+//***************************************************************************************
+// WavesWorker.cpp
+//***************************************************************************************
+
+#include "WavesWorker.h"
+#include <chrono>
+
+WavesWorker::WavesWorker(Waves& waves)
+	: mWaves(waves), mMiddleSnapshot(1), mQueueHead(0), mQueueTail(0), mRunning(true)
+{
+	// Every slot starts out as the initial solution, so the reader always has
+	// something to draw.
+	for(Snapshot& snapshot : mSnapshots)
+	{
+		snapshot.Heights.resize(mWaves.VertexCount());
+		snapshot.Normals.resize(mWaves.VertexCount());
+		snapshot.RowRevisions.resize(mWaves.RowCount());
+		mWaves.ReadSolution(snapshot.Heights.data(), snapshot.Normals.data());
+		snapshot.Revision = mWaves.Revision();
+		mWaves.ReadRowRevisions(snapshot.RowRevisions.data());
+	}
+
+	mThread = std::thread(&WavesWorker::Run, this);
+}
+
+WavesWorker::~WavesWorker()
+{
+	mRunning.store(false, std::memory_order_release);
+	mThread.join();
+}
+
+int WavesWorker::RowCount()const
+{
+	return mWaves.RowCount();
+}
+
+int WavesWorker::ColumnCount()const
+{
+	return mWaves.ColumnCount();
+}
+
+int WavesWorker::VertexCount()const
+{
+	return mWaves.VertexCount();
+}
+
+int WavesWorker::TriangleCount()const
+{
+	return mWaves.TriangleCount();
+}
+
+float WavesWorker::Width()const
+{
+	return mWaves.Width();
+}
+
+float WavesWorker::Depth()const
+{
+	return mWaves.Depth();
+}
+
+DirectX::XMFLOAT3 WavesWorker::Position(int i)const
+{
+	return mWaves.Position(i, mSnapshots[mFrontSnapshot].Heights[i]);
+}
+
+DirectX::XMFLOAT3 WavesWorker::Normal(int i)const
+{
+	return mSnapshots[mFrontSnapshot].Normals[i];
+}
+
+DirectX::XMFLOAT3 WavesWorker::RestPosition(int i)const
+{
+	return mWaves.RestPosition(i);
+}
+
+void WavesWorker::WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const
+{
+	const Snapshot& snapshot = mSnapshots[mFrontSnapshot];
+	mWaves.WriteVertices(snapshot.Heights.data(), snapshot.Normals.data(), row0, col0, rows, cols, dst);
+}
+
+void WavesWorker::WriteCompactVertices(int row0, int col0, int rows, int cols, Waves::CompactVertex* dst)const
+{
+	const Snapshot& snapshot = mSnapshots[mFrontSnapshot];
+	mWaves.WriteCompactVertices(snapshot.Heights.data(), snapshot.Normals.data(), row0, col0, rows, cols, dst);
+}
+
+void WavesWorker::Update(float /*dt*/)
+{
+	AcquireSnapshot();
+}
+
+void WavesWorker::Disturb(int i, int j, float magnitude)
+{
+	unsigned tail = mQueueTail.load(std::memory_order_relaxed);
+	if(tail - mQueueHead.load(std::memory_order_acquire) == QueueCapacity)
+		return;
+
+	Disturbance& d = mQueue[tail & (QueueCapacity - 1)];
+	d.Row = i;
+	d.Col = j;
+	d.Magnitude = magnitude;
+
+	mQueueTail.store(tail + 1, std::memory_order_release);
+}
+
+const WavesWorker::Snapshot& WavesWorker::AcquireSnapshot()
+{
+	// Trade the front slot for the middle one only if the worker has published since
+	// the last call; otherwise keep drawing the current front.
+	if(mMiddleSnapshot.load(std::memory_order_relaxed) & FreshSnapshot)
+	{
+		unsigned middle = mMiddleSnapshot.exchange((unsigned)mFrontSnapshot, std::memory_order_acq_rel);
+		mFrontSnapshot = (int)(middle & ~FreshSnapshot);
+	}
+
+	return mSnapshots[mFrontSnapshot];
+}
+
+void WavesWorker::SampleHeights(const DirectX::XMFLOAT2* xz, float* heights, int count)const
+{
+	mWaves.SampleHeights(mSnapshots[mFrontSnapshot].Heights.data(), xz, heights, count);
+}
+
+void WavesWorker::SampleNormals(const DirectX::XMFLOAT2* xz, DirectX::XMFLOAT3* normals, int count)const
+{
+	mWaves.SampleNormals(mSnapshots[mFrontSnapshot].Normals.data(), xz, normals, count);
+}
+
+void WavesWorker::Run()
+{
+	using Clock = std::chrono::steady_clock;
+
+	const Clock::duration stepDuration = std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<float>(mWaves.TimeStep()));
+
+	Clock::time_point nextStep = Clock::now() + stepDuration;
+	while(mRunning.load(std::memory_order_acquire))
+	{
+		std::this_thread::sleep_until(nextStep);
+
+		// Count the steps that are due, catching up on a short backlog only.
+		Clock::time_point now = Clock::now();
+		int steps = 0;
+		while(nextStep <= now && steps < MaxCatchUpSteps)
+		{
+			nextStep += stepDuration;
+			++steps;
+		}
+		if(nextStep <= now)
+			nextStep = now + stepDuration;
+
+		if(steps == 0)
+			continue;
+
+		// Disturbances land before the first step, as they do when Disturb is
+		// called between Update calls.
+		ApplyDisturbances();
+		mWaves.Advance(steps);
+		mStepCount += steps;
+
+		Publish();
+	}
+}
+
+void WavesWorker::ApplyDisturbances()
+{
+	unsigned head = mQueueHead.load(std::memory_order_relaxed);
+	unsigned tail = mQueueTail.load(std::memory_order_acquire);
+
+	for(; head != tail; ++head)
+	{
+		const Disturbance& d = mQueue[head & (QueueCapacity - 1)];
+		mWaves.Disturb(d.Row, d.Col, d.Magnitude);
+	}
+
+	mQueueHead.store(head, std::memory_order_release);
+}
+
+void WavesWorker::Publish()
+{
+	Snapshot& back = mSnapshots[mBackSnapshot];
+	back.Step = mStepCount;
+	mWaves.ReadSolution(back.Heights.data(), back.Normals.data());
+	back.Revision = mWaves.Revision();
+	mWaves.ReadRowRevisions(back.RowRevisions.data());
+
+	// The previous middle slot, fresh or not, becomes the next back slot; a snapshot
+	// the reader never took is simply overwritten.
+	unsigned middle = mMiddleSnapshot.exchange((unsigned)mBackSnapshot | FreshSnapshot, std::memory_order_acq_rel);
+	mBackSnapshot = (int)(middle & ~FreshSnapshot);
+}
@@ -0,0 +1,117 @@
+//***************************************************************************************
+// WavesWorker.h
+//
+// Steps a Waves simulation on its own thread at the simulation time step, so the frame
+// thread never waits on the solver.
+//
+// As an IWaveSimulator it shows the snapshot taken by the last Update, which never waits
+// for the worker, and queues disturbances for the worker's next step.
+//
+// Finished steps are published as snapshots through a lock-free triple buffer: the
+// worker fills the back snapshot and swaps it with the middle one, and the render
+// thread swaps the middle one into the front whenever a newer snapshot is waiting.
+// Neither side ever blocks the other.  Disturbances travel the other way through a
+// fixed-size single producer/single consumer ring, which is wait-free on both ends.
+//***************************************************************************************
+
+#pragma once
+
+#include "Waves.h"
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+class WavesWorker : public IWaveSimulator
+{
+public:
+	// A copy of the solution after some number of steps, in row major grid order.
+	struct Snapshot
+	{
+		std::uint64_t Step = 0;
+		std::vector<float> Heights;
+		std::vector<DirectX::XMFLOAT3> Normals;
+
+		// Waves::Revision and the per row revisions of the copied solution.
+		std::uint64_t Revision = 0;
+		std::vector<std::uint64_t> RowRevisions;
+	};
+
+	// The worker starts stepping 'waves' as soon as it is constructed and stops when it
+	// is destroyed.  'waves' must outlive the worker and may only be read for its grid
+	// layout (RowCount, Position(i, height), RestPosition, ...) while the worker runs.
+	explicit WavesWorker(Waves& waves);
+	WavesWorker(const WavesWorker& rhs) = delete;
+	WavesWorker& operator=(const WavesWorker& rhs) = delete;
+	~WavesWorker()override;
+
+	int RowCount()const override;
+	int ColumnCount()const override;
+	int VertexCount()const override;
+	int TriangleCount()const override;
+	float Width()const override;
+	float Depth()const override;
+
+	// Read the snapshot returned by the last AcquireSnapshot.
+	DirectX::XMFLOAT3 Position(int i)const override;
+	DirectX::XMFLOAT3 Normal(int i)const override;
+	DirectX::XMFLOAT3 RestPosition(int i)const override;
+	void WriteVertices(int row0, int col0, int rows, int cols, SurfaceVertex* dst)const override;
+	void WriteCompactVertices(int row0, int col0, int rows, int cols, Waves::CompactVertex* dst)const;
+
+	// Acquires the newest snapshot; the worker keeps its own clock, so dt is unused.
+	void Update(float dt)override;
+
+	// Queues a Waves::Disturb for the next step.  Must only be called from one thread.
+	// The disturbance is dropped if the queue is full.
+	void Disturb(int i, int j, float magnitude)override;
+
+	// Returns the newest published snapshot without waiting for the worker.  The
+	// snapshot stays valid and unchanged until the next call.  Must only be called
+	// from one thread.
+	const Snapshot& AcquireSnapshot();
+
+	// Bilinearly samples the snapshot returned by the last AcquireSnapshot, so queries
+	// agree with what is drawn.  Must be called from the thread that acquires snapshots.
+	void SampleHeights(const DirectX::XMFLOAT2* xz, float* heights, int count)const;
+	void SampleNormals(const DirectX::XMFLOAT2* xz, DirectX::XMFLOAT3* normals, int count)const;
+
+private:
+	struct Disturbance
+	{
+		int Row = 0;
+		int Col = 0;
+		float Magnitude = 0.0f;
+	};
+
+	void Run();
+	void ApplyDisturbances();
+	void Publish();
+
+private:
+	// When the worker falls behind (e.g. the process was suspended) it catches up at
+	// most this many steps at once and drops the rest of the backlog.
+	static const int MaxCatchUpSteps = 4;
+
+	// Capacity of the disturbance ring; a power of two.
+	static const unsigned QueueCapacity = 256;
+
+	// The middle slot index carries this bit while it holds a snapshot the reader
+	// has not taken yet.
+	static const unsigned FreshSnapshot = 4;
+
+	Waves& mWaves;
+
+	Snapshot mSnapshots[3];
+	int mBackSnapshot = 0;   // owned by the worker
+	int mFrontSnapshot = 2;  // owned by the reader
+	alignas(64) std::atomic<unsigned> mMiddleSnapshot;
+	std::uint64_t mStepCount = 0;
+
+	Disturbance mQueue[QueueCapacity];
+	alignas(64) std::atomic<unsigned> mQueueHead; // next entry to apply, written by the worker
+	alignas(64) std::atomic<unsigned> mQueueTail; // next free entry, written by the producer
+
+	std::atomic<bool> mRunning;
+	std::thread mThread;
+};
@@ -353,13 +353,6 @@ GeometryGenerator::MeshData GeometryGenerator::CreateSphere(float radius, uint32
  
 void GeometryGenerator::Subdivide(MeshData& meshData)
 {
-	// Save a copy of the input geometry.
-	MeshData inputCopy = meshData;
-
-
-	meshData.Vertices.resize(0);
-	meshData.Indices32.resize(0);
-
 	//       v1
 	//       *
 	//      / \
@@ -370,47 +363,70 @@ void GeometryGenerator::Subdivide(MeshData& meshData)
 	// *-----*-----*
 	// v0    m2     v2
 
-	uint32 numTris = (uint32)inputCopy.Indices32.size()/3;
-	for(uint32 i = 0; i < numTris; ++i)
+	// Each edge is split once, and the triangles on both sides of it share the new
+	// vertex.  Edges are found by their vertex indices, so edges along hard creases
+	// and texture seams, whose vertices are duplicated, still get one midpoint per side.
+	const uint32 numVerts = (uint32)meshData.Vertices.size();
+	const uint32 numTris = (uint32)meshData.Indices32.size()/3;
+	const uint32 noEdge = ~0u;
+
+	// The edges found so far, chained from their lower vertex.  Edge e gets the
+	// midpoint numVerts + e.
+	struct Edge
 	{
-		Vertex v0 = inputCopy.Vertices[ inputCopy.Indices32[i*3+0] ];
-		Vertex v1 = inputCopy.Vertices[ inputCopy.Indices32[i*3+1] ];
-		Vertex v2 = inputCopy.Vertices[ inputCopy.Indices32[i*3+2] ];
-
-		//
-		// Generate the midpoints.
-		//
-
-        Vertex m0 = MidPoint(v0, v1);
-        Vertex m1 = MidPoint(v1, v2);
-        Vertex m2 = MidPoint(v0, v2);
-
-		//
-		// Add new geometry.
-		//
-
-		meshData.Vertices.push_back(v0); // 0
-		meshData.Vertices.push_back(v1); // 1
-		meshData.Vertices.push_back(v2); // 2
-		meshData.Vertices.push_back(m0); // 3
-		meshData.Vertices.push_back(m1); // 4
-		meshData.Vertices.push_back(m2); // 5
- 
-		meshData.Indices32.push_back(i*6+0);
-		meshData.Indices32.push_back(i*6+3);
-		meshData.Indices32.push_back(i*6+5);
+		uint32 Lower;
+		uint32 Upper;
+		uint32 Next;
+	};
+	std::vector<uint32> firstEdge(numVerts, noEdge);
+	std::vector<Edge> edges;
+	edges.reserve(numTris*3);
+
+	// The index of each triangle's m0, m1 and m2.
+	std::vector<uint32> midpoints(numTris*3);
+	for(uint32 i = 0; i < numTris*3; ++i)
+	{
+		// Edge v2-v0 is the triangle's m2.
+		uint32 a = meshData.Indices32[i];
+		uint32 b = meshData.Indices32[i % 3 == 2 ? i - 2 : i + 1];
+		uint32 lower = std::min(a, b);
+		uint32 upper = std::max(a, b);
 
-		meshData.Indices32.push_back(i*6+3);
-		meshData.Indices32.push_back(i*6+4);
-		meshData.Indices32.push_back(i*6+5);
+		uint32 e = firstEdge[lower];
+		while(e != noEdge && edges[e].Upper != upper)
+			e = edges[e].Next;
 
-		meshData.Indices32.push_back(i*6+5);
-		meshData.Indices32.push_back(i*6+4);
-		meshData.Indices32.push_back(i*6+2);
+		if(e == noEdge)
+		{
+			e = (uint32)edges.size();
+			edges.push_back({ lower, upper, firstEdge[lower] });
+			firstEdge[lower] = e;
+		}
 
-		meshData.Indices32.push_back(i*6+3);
-		meshData.Indices32.push_back(i*6+1);
-		meshData.Indices32.push_back(i*6+4);
+		midpoints[i] = numVerts + e;
+	}
+
+	meshData.Vertices.resize(numVerts + edges.size());
+	for(size_t e = 0; e < edges.size(); ++e)
+		meshData.Vertices[numVerts + e] = MidPoint(meshData.Vertices[edges[e].Lower], meshData.Vertices[edges[e].Upper]);
+
+	// Every triangle becomes four in place.  Going from the last triangle down, the
+	// four written never overlap an input triangle still to be read.
+	meshData.Indices32.resize(numTris*12);
+	for(uint32 i = numTris; i-- > 0; )
+	{
+		uint32 v0 = meshData.Indices32[i*3+0];
+		uint32 v1 = meshData.Indices32[i*3+1];
+		uint32 v2 = meshData.Indices32[i*3+2];
+		uint32 m0 = midpoints[i*3+0];
+		uint32 m1 = midpoints[i*3+1];
+		uint32 m2 = midpoints[i*3+2];
+
+		uint32* out = &meshData.Indices32[i*12];
+		out[0] = v0; out[1]  = m0; out[2]  = m2;
+		out[3] = m0; out[4]  = m1; out[5]  = m2;
+		out[6] = m2; out[7]  = m1; out[8]  = v2;
+		out[9] = m0; out[10] = v1; out[11] = m1;
 	}
 }
 
@@ -0,0 +1,356 @@
+//***************************************************************************************
+// JobSystem.cpp
+//***************************************************************************************
+
+#include "JobSystem.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+struct JobSystem::Job
+{
+	// Either a plain function or a slice of a ParallelFor range.
+	std::function<void()> Function;
+	const RangeFunction* Range = nullptr;
+	int Begin = 0;
+	int End = 0;
+
+	Counter* Signal = nullptr;
+};
+
+// Fixed capacity Chase-Lev deque, after Le, Pop, Cohen and Zappa Nardelli, "Correct and
+// Efficient Work-Stealing for Weak Memory Models".  Only the owning worker pushes and
+// pops at the bottom; any thread may steal from the top.
+class JobSystem::WorkQueue
+{
+public:
+	WorkQueue() : mTop(0), mBottom(0)
+	{
+		for(auto& slot : mJobs)
+			slot.store(nullptr, std::memory_order_relaxed);
+	}
+
+	// Returns false if the deque is full.
+	bool Push(Job* job)
+	{
+		std::int64_t b = mBottom.load(std::memory_order_relaxed);
+		std::int64_t t = mTop.load(std::memory_order_acquire);
+		if(b - t >= Capacity)
+			return false;
+
+		mJobs[b & (Capacity - 1)].store(job, std::memory_order_relaxed);
+		mBottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+
+	Job* Pop()
+	{
+		std::int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+		mBottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t t = mTop.load(std::memory_order_relaxed);
+
+		if(t > b)
+		{
+			// Empty.
+			mBottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		Job* job = mJobs[b & (Capacity - 1)].load(std::memory_order_relaxed);
+		if(t == b)
+		{
+			// The last job; race the thieves for it.
+			if(!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				job = nullptr;
+			mBottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		return job;
+	}
+
+	// May return nullptr while jobs remain, if another thread won the race.
+	Job* Steal()
+	{
+		std::int64_t t = mTop.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t b = mBottom.load(std::memory_order_acquire);
+		if(t >= b)
+			return nullptr;
+
+		Job* job = mJobs[t & (Capacity - 1)].load(std::memory_order_relaxed);
+		if(!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr;
+
+		return job;
+	}
+
+private:
+	static const int Capacity = 1024;
+
+	alignas(64) std::atomic<std::int64_t> mTop;
+	alignas(64) std::atomic<std::int64_t> mBottom;
+	std::atomic<Job*> mJobs[Capacity];
+};
+
+namespace
+{
+	// The job system whose worker this thread is, and the worker's deque.
+	struct LocalWorker
+	{
+		const JobSystem* System = nullptr;
+		void* Queue = nullptr;
+	};
+
+	thread_local LocalWorker tLocalWorker;
+
+	// Idle workers look this many times for work before they go to sleep.
+	const int SpinCount = 64;
+}
+
+JobSystem::Counter::Counter() : mPending(0), mReleasing(0)
+{
+}
+
+bool JobSystem::Counter::Done()const
+{
+	return mPending.load(std::memory_order_acquire) == 0 &&
+		mReleasing.load(std::memory_order_acquire) == 0;
+}
+
+JobSystem::JobSystem(int workerCount)
+	: mInjectedCount(0), mEpoch(0), mSleepers(0), mRunning(true)
+{
+	if(workerCount < 0)
+		workerCount = std::max(1, (int)std::thread::hardware_concurrency()) - 1;
+
+	for(int i = 0; i < workerCount; ++i)
+		mQueues.push_back(std::make_unique<WorkQueue>());
+
+	for(int i = 0; i < workerCount; ++i)
+		mWorkers.emplace_back(&JobSystem::WorkerLoop, this, i);
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mRunning.store(false);
+	}
+	mWake.notify_all();
+
+	for(std::thread& worker : mWorkers)
+		worker.join();
+
+	assert(mInjected.empty());
+}
+
+JobSystem& JobSystem::Default()
+{
+	static JobSystem system;
+	return system;
+}
+
+int JobSystem::ThreadCount()const
+{
+	return (int)mWorkers.size() + 1;
+}
+
+void JobSystem::Run(std::function<void()> fn, Counter* signal, Counter* after)
+{
+	Job* job = new Job;
+	job->Function = std::move(fn);
+	job->Signal = signal;
+
+	if(signal != nullptr)
+		signal->mPending.fetch_add(1);
+
+	if(after != nullptr)
+	{
+		// Park the job on the counter it waits for; the job that brings the counter
+		// to zero submits it.  Checking under the lock closes the race with that job.
+		std::lock_guard<std::mutex> lock(after->mMutex);
+		if(after->mPending.load() != 0)
+		{
+			after->mContinuations.push_back(job);
+			return;
+		}
+	}
+
+	Submit(job);
+}
+
+void JobSystem::Wait(Counter& counter)
+{
+	WorkQueue* own = LocalQueue();
+	while(!counter.Done())
+	{
+		if(Job* job = FindJob(own, 0))
+			Execute(job);
+		else
+			std::this_thread::yield();
+	}
+}
+
+void JobSystem::RunRange(const RangeFunction& range, int begin, int end, Counter& done)
+{
+	// Hand out the upper half until a single grain is left, and run that here.  Each
+	// half is split again by whichever thread picks it up.
+	while(end - begin > range.Grain)
+	{
+		int mid = begin + (end - begin) / 2;
+
+		Job* job = new Job;
+		job->Range = &range;
+		job->Begin = mid;
+		job->End = end;
+		job->Signal = &done;
+		done.mPending.fetch_add(1);
+		Submit(job);
+
+		end = mid;
+	}
+
+	range.Body(range.Fn, begin, end);
+}
+
+void JobSystem::Submit(Job* job)
+{
+	WorkQueue* own = LocalQueue();
+	if(own == nullptr || !own->Push(job))
+	{
+		std::lock_guard<std::mutex> lock(mInjectedMutex);
+		mInjected.push_back(job);
+		mInjectedCount.fetch_add(1);
+	}
+
+	// Moving the epoch before looking for sleepers pairs with a worker registering as
+	// a sleeper before checking the epoch, so one of the two always sees the other.
+	mEpoch.fetch_add(1);
+	if(mSleepers.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mWake.notify_one();
+	}
+}
+
+JobSystem::Job* JobSystem::FindJob(WorkQueue* own, int first)
+{
+	if(own != nullptr)
+	{
+		if(Job* job = own->Pop())
+			return job;
+	}
+
+	if(mInjectedCount.load(std::memory_order_relaxed) > 0)
+	{
+		std::lock_guard<std::mutex> lock(mInjectedMutex);
+		if(!mInjected.empty())
+		{
+			Job* job = mInjected.front();
+			mInjected.pop_front();
+			mInjectedCount.fetch_sub(1);
+			return job;
+		}
+	}
+
+	// Steal from the other workers, each thread starting at a different victim.
+	const int count = (int)mQueues.size();
+	for(int k = 0; k < count; ++k)
+	{
+		WorkQueue* victim = mQueues[(first + k) % count].get();
+		if(victim == own)
+			continue;
+
+		if(Job* job = victim->Steal())
+			return job;
+	}
+
+	return nullptr;
+}
+
+void JobSystem::Execute(Job* job)
+{
+	if(job->Range != nullptr)
+		RunRange(*job->Range, job->Begin, job->End, *job->Signal);
+	else
+		job->Function();
+
+	Counter* signal = job->Signal;
+	delete job;
+
+	if(signal != nullptr)
+		Finish(*signal);
+}
+
+void JobSystem::Finish(Counter& counter)
+{
+	// The last job to finish releases the jobs waiting on the counter.  mReleasing
+	// keeps the counter from reading as done until this is over.
+	counter.mReleasing.fetch_add(1);
+	if(counter.mPending.fetch_sub(1) == 1)
+	{
+		std::vector<Job*> ready;
+		{
+			std::lock_guard<std::mutex> lock(counter.mMutex);
+			ready.swap(counter.mContinuations);
+		}
+
+		for(Job* job : ready)
+			Submit(job);
+	}
+	counter.mReleasing.fetch_sub(1);
+}
+
+JobSystem::WorkQueue* JobSystem::LocalQueue()const
+{
+	return tLocalWorker.System == this ? static_cast<WorkQueue*>(tLocalWorker.Queue) : nullptr;
+}
+
+void JobSystem::WorkerLoop(int index)
+{
+	WorkQueue* own = mQueues[index].get();
+	tLocalWorker.System = this;
+	tLocalWorker.Queue = own;
+
+	const int firstVictim = index + 1;
+	while(mRunning.load())
+	{
+		Job* job = nullptr;
+		for(int spin = 0; spin < SpinCount && job == nullptr; ++spin)
+		{
+			job = FindJob(own, firstVictim);
+			if(job == nullptr)
+				std::this_thread::yield();
+		}
+
+		if(job != nullptr)
+		{
+			Execute(job);
+			continue;
+		}
+
+		// Register as a sleeper, then look once more: a job submitted after the last
+		// look either shows up here or moves the epoch past the one read.
+		unsigned epoch = mEpoch.load();
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mSleepers.fetch_add(1);
+		lock.unlock();
+
+		job = FindJob(own, firstVictim);
+
+		lock.lock();
+		if(job == nullptr)
+		{
+			mWake.wait(lock, [this, epoch]
+			{
+				return mEpoch.load() != epoch || !mRunning.load();
+			});
+		}
+		mSleepers.fetch_sub(1);
+		lock.unlock();
+
+		if(job != nullptr)
+			Execute(job);
+	}
+}
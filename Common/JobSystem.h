@@ -0,0 +1,148 @@
+//***************************************************************************************
+// JobSystem.h
+//
+// A small portable job system: a fixed pool of worker threads, each owning a Chase-Lev
+// work-stealing deque.  A worker pushes and pops jobs at the bottom of its own deque
+// and idle workers steal from the top of the others', so work spreads to every core
+// without a shared queue becoming the bottleneck.
+//
+// Threads outside the pool (the main thread, WavesWorker, ...) submit through a small
+// locked queue instead, and any thread that waits on jobs runs queued jobs meanwhile.
+//***************************************************************************************
+
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobSystem
+{
+	struct Job;
+	class WorkQueue;
+
+public:
+	// Counts the unfinished jobs that signal it.  Jobs may also be queued to start only
+	// once a counter is done, which is how dependencies between jobs are expressed.
+	class Counter
+	{
+	public:
+		Counter();
+		Counter(const Counter& rhs) = delete;
+		Counter& operator=(const Counter& rhs) = delete;
+
+		// True once every job signalling this counter so far has finished.
+		bool Done()const;
+
+	private:
+		friend class JobSystem;
+
+		std::atomic<int> mPending;
+
+		// Nonzero while a finishing job may still touch the counter, so a waiter does
+		// not destroy it under the job's feet.
+		std::atomic<int> mReleasing;
+
+		std::mutex mMutex;
+		std::vector<Job*> mContinuations;
+	};
+
+	// Starts 'workerCount' worker threads; by default one less than the hardware
+	// threads, since a thread waiting on jobs runs them too.
+	explicit JobSystem(int workerCount = -1);
+	JobSystem(const JobSystem& rhs) = delete;
+	JobSystem& operator=(const JobSystem& rhs) = delete;
+
+	// Every submitted job must have finished.
+	~JobSystem();
+
+	// The process wide job system, started on first use.
+	static JobSystem& Default();
+
+	// Number of threads that run jobs: the workers and one waiting thread.
+	int ThreadCount()const;
+
+	// Queues fn.  'signal', if given, counts the job until fn returns; 'after', if
+	// given, holds the job back until that counter is done.
+	void Run(std::function<void()> fn, Counter* signal = nullptr, Counter* after = nullptr);
+
+	// Returns once 'counter' is done, running queued jobs meanwhile.
+	void Wait(Counter& counter);
+
+	// Calls fn(i) for every i in [begin, end) and returns once all calls have finished.
+	// The range is split in halves on demand, down to 'grain' indices per job, and idle
+	// threads steal the halves; the calling thread takes part.
+	template<typename Fn>
+	void ParallelFor(int begin, int end, int grain, const Fn& fn);
+
+	template<typename Fn>
+	void ParallelFor(int begin, int end, const Fn& fn)
+	{
+		ParallelFor(begin, end, 1, fn);
+	}
+
+private:
+	// A ParallelFor body with its element type erased.
+	struct RangeFunction
+	{
+		void (*Body)(const void* fn, int begin, int end);
+		const void* Fn;
+		int Grain;
+	};
+
+	template<typename Fn>
+	static void CallRange(const void* fn, int begin, int end)
+	{
+		const Fn& f = *static_cast<const Fn*>(fn);
+		for(int i = begin; i < end; ++i)
+			f(i);
+	}
+
+	void RunRange(const RangeFunction& range, int begin, int end, Counter& done);
+	void Submit(Job* job);
+	Job* FindJob(WorkQueue* own, int first);
+	void Execute(Job* job);
+	void Finish(Counter& counter);
+	WorkQueue* LocalQueue()const;
+	void WorkerLoop(int index);
+
+private:
+	std::vector<std::unique_ptr<WorkQueue>> mQueues;
+	std::vector<std::thread> mWorkers;
+
+	// Jobs submitted by threads outside the pool, or by workers whose deque is full.
+	std::mutex mInjectedMutex;
+	std::deque<Job*> mInjected;
+	std::atomic<int> mInjectedCount;
+
+	// Idle workers sleep until the epoch moves on, which every submission does.
+	std::mutex mSleepMutex;
+	std::condition_variable mWake;
+	std::atomic<unsigned> mEpoch;
+	std::atomic<int> mSleepers;
+	std::atomic<bool> mRunning;
+};
+
+template<typename Fn>
+void JobSystem::ParallelFor(int begin, int end, int grain, const Fn& fn)
+{
+	grain = grain > 1 ? grain : 1;
+	if(end - begin <= grain || mWorkers.empty())
+	{
+		CallRange<Fn>(&fn, begin, end);
+		return;
+	}
+
+	RangeFunction range = { &CallRange<Fn>, &fn, grain };
+	Counter done;
+	RunRange(range, begin, end, done);
+	Wait(done);
+}
+
+#endif // JOBSYSTEM_H
@@ -0,0 +1,373 @@
+//***************************************************************************************
+// MeshOptimizer.cpp
+//***************************************************************************************
+
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+const int MeshOptimizer::DefaultCacheSize;
+const float MeshOptimizer::DefaultOverdrawThreshold = 1.05f;
+const MeshOptimizer::uint32 MeshOptimizer::Unused;
+
+namespace
+{
+	// A FIFO cache kept as the time each vertex entered it.  A vertex is cached while
+	// fewer than cacheSize other vertices have entered since.
+	class CacheSimulator
+	{
+	public:
+		CacheSimulator(std::size_t vertexCount, int cacheSize)
+			: mEntered(vertexCount, 0), mCacheSize((unsigned)cacheSize), mTime((unsigned)cacheSize + 1)
+		{
+		}
+
+		// Returns the misses the triangle takes.
+		int Triangle(const MeshOptimizer::uint32* t)
+		{
+			int misses = 0;
+			for(int k = 0; k < 3; ++k)
+			{
+				if(mTime - mEntered[t[k]] > mCacheSize)
+				{
+					mEntered[t[k]] = mTime++;
+					++misses;
+				}
+			}
+			return misses;
+		}
+
+		void Clear()
+		{
+			mTime += mCacheSize + 1;
+		}
+
+	private:
+		std::vector<unsigned> mEntered;
+		unsigned mCacheSize;
+		unsigned mTime;
+	};
+
+	const float* Position(const float* positions, std::size_t stride, MeshOptimizer::uint32 v)
+	{
+		return reinterpret_cast<const float*>(reinterpret_cast<const char*>(positions) + v*stride);
+	}
+}
+
+float MeshOptimizer::CacheStats::Acmr()const
+{
+	return Triangles > 0 ? (float)Transforms / Triangles : 0.0f;
+}
+
+float MeshOptimizer::CacheStats::Atvr()const
+{
+	return Vertices > 0 ? (float)Transforms / Vertices : 0.0f;
+}
+
+MeshOptimizer::CacheStats& MeshOptimizer::CacheStats::operator+=(const CacheStats& rhs)
+{
+	Transforms += rhs.Transforms;
+	Triangles += rhs.Triangles;
+	Vertices += rhs.Vertices;
+	return *this;
+}
+
+MeshOptimizer::CacheStats MeshOptimizer::AnalyzeVertexCache(const uint32* indices, std::size_t indexCount,
+	std::size_t vertexCount, int cacheSize)
+{
+	CacheStats stats;
+	stats.Triangles = indexCount / 3;
+
+	CacheSimulator cache(vertexCount, cacheSize);
+	std::vector<bool> used(vertexCount, false);
+	for(std::size_t i = 0; i + 2 < indexCount; i += 3)
+	{
+		stats.Transforms += cache.Triangle(&indices[i]);
+		for(int k = 0; k < 3; ++k)
+		{
+			if(!used[indices[i + k]])
+			{
+				used[indices[i + k]] = true;
+				++stats.Vertices;
+			}
+		}
+	}
+
+	return stats;
+}
+
+void MeshOptimizer::OptimizeVertexCache(uint32* indices, std::size_t indexCount, std::size_t vertexCount,
+	int cacheSize, std::vector<uint32>* clusters)
+{
+	const std::size_t triCount = indexCount / 3;
+	const std::vector<uint32> input(indices, indices + triCount*3);
+
+	// The triangles around each vertex, and how many of them are still to be emitted.
+	std::vector<uint32> live(vertexCount, 0);
+	for(std::size_t i = 0; i < triCount*3; ++i)
+		++live[input[i]];
+
+	std::vector<uint32> firstAdjacent(vertexCount + 1, 0);
+	for(std::size_t v = 0; v < vertexCount; ++v)
+		firstAdjacent[v + 1] = firstAdjacent[v] + live[v];
+
+	std::vector<uint32> adjacent(triCount*3);
+	{
+		std::vector<uint32> fill(firstAdjacent.begin(), firstAdjacent.end() - 1);
+		for(std::size_t i = 0; i < triCount*3; ++i)
+			adjacent[fill[input[i]]++] = (uint32)(i / 3);
+	}
+
+	std::vector<unsigned> entered(vertexCount, 0);
+	unsigned time = (unsigned)cacheSize + 1;
+	std::vector<bool> emitted(triCount, false);
+
+	// Vertices of recently emitted triangles, to fall back on when the fan vertex has
+	// no useful neighbour left; then the first vertex with triangles left.
+	std::vector<uint32> deadEnds;
+	deadEnds.reserve(triCount*3);
+	std::size_t cursor = 0;
+
+	auto skipDeadEnd = [&]() -> uint32
+	{
+		while(!deadEnds.empty())
+		{
+			uint32 v = deadEnds.back();
+			deadEnds.pop_back();
+			if(live[v] > 0)
+				return v;
+		}
+
+		for(; cursor < vertexCount; ++cursor)
+		{
+			if(live[cursor] > 0)
+				return (uint32)cursor;
+		}
+
+		return Unused;
+	};
+
+	if(clusters != nullptr)
+		clusters->clear();
+
+	std::vector<uint32> candidates;
+	std::size_t written = 0;
+	uint32 fan = skipDeadEnd();
+	if(clusters != nullptr && fan != Unused)
+		clusters->push_back(0);
+
+	while(fan != Unused)
+	{
+		// Emit every triangle left around the fan vertex.
+		candidates.clear();
+		for(uint32 a = firstAdjacent[fan]; a < firstAdjacent[fan + 1]; ++a)
+		{
+			uint32 t = adjacent[a];
+			if(emitted[t])
+				continue;
+
+			for(int k = 0; k < 3; ++k)
+			{
+				uint32 v = input[t*3 + k];
+				indices[written++] = v;
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				--live[v];
+				if(time - entered[v] > (unsigned)cacheSize)
+					entered[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// Fan around the neighbour that stays cached longest while its triangles are
+		// emitted; a neighbour that would drop out first scores zero.
+		uint32 next = Unused;
+		int bestPriority = -1;
+		for(uint32 v : candidates)
+		{
+			if(live[v] == 0)
+				continue;
+
+			int priority = 0;
+			if(time - entered[v] + 2*live[v] <= (unsigned)cacheSize)
+				priority = (int)(time - entered[v]);
+
+			if(priority > bestPriority)
+			{
+				bestPriority = priority;
+				next = v;
+			}
+		}
+
+		if(next == Unused)
+		{
+			next = skipDeadEnd();
+			if(clusters != nullptr && next != Unused)
+				clusters->push_back((uint32)(written / 3));
+		}
+
+		fan = next;
+	}
+
+	assert(written == triCount*3);
+}
+
+void MeshOptimizer::OptimizeOverdraw(uint32* indices, std::size_t indexCount,
+	const float* positions, std::size_t positionStride, std::size_t vertexCount,
+	const std::vector<uint32>& clusters, int cacheSize, float threshold)
+{
+	const uint32 triCount = (uint32)(indexCount / 3);
+	if(triCount == 0)
+		return;
+
+	// Cut each run where the piece so far costs little more than the whole run does,
+	// starting from an empty cache as it will once the pieces are moved around.
+	std::vector<uint32> pieces;
+	CacheSimulator cache(vertexCount, cacheSize);
+	for(std::size_t c = 0; c < clusters.size(); ++c)
+	{
+		uint32 begin = clusters[c];
+		uint32 end = c + 1 < clusters.size() ? clusters[c + 1] : triCount;
+
+		cache.Clear();
+		int runMisses = 0;
+		for(uint32 t = begin; t < end; ++t)
+			runMisses += cache.Triangle(&indices[t*3]);
+		float limit = threshold * runMisses / (float)(end - begin);
+
+		cache.Clear();
+		pieces.push_back(begin);
+		int misses = 0;
+		for(uint32 t = begin; t < end; ++t)
+		{
+			misses += cache.Triangle(&indices[t*3]);
+			if(t + 1 < end && misses <= limit * (t + 1 - pieces.back()))
+			{
+				pieces.push_back(t + 1);
+				cache.Clear();
+				misses = 0;
+			}
+		}
+	}
+
+	// Area weighted centroid and normal of each piece, and of the mesh.
+	struct Piece
+	{
+		uint32 Begin = 0;
+		uint32 End = 0;
+		float Centroid[3] = { 0.0f, 0.0f, 0.0f };
+		float Normal[3] = { 0.0f, 0.0f, 0.0f };
+		float Area = 0.0f;
+		float Sort = 0.0f;
+	};
+
+	std::vector<Piece> order(pieces.size());
+	float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+	float meshArea = 0.0f;
+	for(std::size_t p = 0; p < pieces.size(); ++p)
+	{
+		Piece& piece = order[p];
+		piece.Begin = pieces[p];
+		piece.End = p + 1 < pieces.size() ? pieces[p + 1] : triCount;
+
+		for(uint32 t = piece.Begin; t < piece.End; ++t)
+		{
+			const float* p0 = Position(positions, positionStride, indices[t*3 + 0]);
+			const float* p1 = Position(positions, positionStride, indices[t*3 + 1]);
+			const float* p2 = Position(positions, positionStride, indices[t*3 + 2]);
+
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float n[3] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+			float area = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+
+			for(int k = 0; k < 3; ++k)
+			{
+				piece.Centroid[k] += area * (p0[k] + p1[k] + p2[k]) / 3.0f;
+				piece.Normal[k] += n[k];
+			}
+			piece.Area += area;
+		}
+
+		for(int k = 0; k < 3; ++k)
+			meshCentroid[k] += piece.Centroid[k];
+		meshArea += piece.Area;
+	}
+
+	if(meshArea <= 0.0f)
+		return;
+
+	for(Piece& piece : order)
+	{
+		if(piece.Area <= 0.0f)
+			continue;
+
+		float length = std::sqrt(piece.Normal[0]*piece.Normal[0] + piece.Normal[1]*piece.Normal[1] + piece.Normal[2]*piece.Normal[2]);
+		for(int k = 0; k < 3; ++k)
+			piece.Sort += (piece.Centroid[k] / piece.Area - meshCentroid[k] / meshArea) * (length > 0.0f ? piece.Normal[k] / length : 0.0f);
+	}
+
+	std::stable_sort(order.begin(), order.end(),
+		[](const Piece& a, const Piece& b) { return a.Sort > b.Sort; });
+
+	const std::vector<uint32> input(indices, indices + triCount*3);
+	std::size_t written = 0;
+	for(const Piece& piece : order)
+	{
+		std::copy(&input[piece.Begin*3], &input[0] + piece.End*3, &indices[written]);
+		written += (piece.End - piece.Begin)*3;
+	}
+}
+
+std::size_t MeshOptimizer::BuildFetchRemap(uint32* indices, std::size_t indexCount,
+	std::size_t vertexCount, std::vector<uint32>& remap)
+{
+	remap.assign(vertexCount, Unused);
+
+	uint32 next = 0;
+	for(std::size_t i = 0; i < indexCount; ++i)
+	{
+		uint32& target = remap[indices[i]];
+		if(target == Unused)
+			target = next++;
+		indices[i] = target;
+	}
+
+	return next;
+}
+
+void MeshOptimizer::Optimize(GeometryGenerator::MeshData& mesh, CacheStats* before, CacheStats* after)
+{
+	std::vector<uint32>& indices = mesh.Indices32;
+	const std::size_t vertexCount = mesh.Vertices.size();
+	if(indices.empty())
+		return;
+
+	// Small meshes are often cache friendly as generated, and the reordering passes can
+	// only make them worse, so each pass is kept only if it still beats the input.
+	const std::vector<uint32> input = indices;
+	const CacheStats inputStats = AnalyzeVertexCache(indices.data(), indices.size(), vertexCount);
+	if(before != nullptr)
+		*before = inputStats;
+
+	std::vector<uint32> clusters;
+	OptimizeVertexCache(indices.data(), indices.size(), vertexCount, DefaultCacheSize, &clusters);
+	if(AnalyzeVertexCache(indices.data(), indices.size(), vertexCount).Transforms >= inputStats.Transforms)
+	{
+		indices = input;
+	}
+	else
+	{
+		const std::vector<uint32> cacheOrder = indices;
+		OptimizeOverdraw(indices.data(), indices.size(), &mesh.Vertices[0].Position.x, sizeof(GeometryGenerator::Vertex),
+			vertexCount, clusters);
+		if(AnalyzeVertexCache(indices.data(), indices.size(), vertexCount).Transforms >= inputStats.Transforms)
+			indices = cacheOrder;
+	}
+
+	OptimizeVertexFetch(indices.data(), indices.size(), mesh.Vertices);
+
+	if(after != nullptr)
+		*after = AnalyzeVertexCache(indices.data(), indices.size(), mesh.Vertices.size());
+}
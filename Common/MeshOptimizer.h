@@ -0,0 +1,105 @@
+//***************************************************************************************
+// MeshOptimizer.h
+//
+// Reorders indexed triangle lists for the GPU:
+//
+//   1. Vertex cache: triangles are ordered with Tipsify (Sander, Nehab and Barczak,
+//      "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"), so most
+//      vertices are still in the post-transform cache when they are used again.
+//   2. Overdraw: the ordering is cut into clusters where the cache cost allows it, and
+//      the clusters facing away from the mesh's centre, which are most likely to hide
+//      the others, are moved to the front.
+//   3. Vertex fetch: vertices are stored in the order the triangles first use them.
+//
+// Nothing here depends on Direct3D, so the same calls serve at load time and in an
+// offline tool that cooks meshes ahead of time.
+//***************************************************************************************
+
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include "GeometryGenerator.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class MeshOptimizer
+{
+public:
+	using uint32 = std::uint32_t;
+
+	// Post-transform cache size assumed by default, in vertices.
+	static const int DefaultCacheSize = 16;
+
+	// How much worse than the best cache order the overdraw pass may make each part of
+	// the mesh, as a ratio of vertex shader runs.
+	static const float DefaultOverdrawThreshold;
+
+	// The vertex shader runs a triangle list takes through a FIFO cache.
+	struct CacheStats
+	{
+		std::size_t Transforms = 0;
+		std::size_t Triangles = 0;
+		std::size_t Vertices = 0;
+
+		// Average cache miss ratio: shader runs per triangle, 3 at worst and about 0.5
+		// at best for large regular meshes.
+		float Acmr()const;
+
+		// Average transformed vertex ratio: shader runs per vertex used, 1 at best.
+		float Atvr()const;
+
+		CacheStats& operator+=(const CacheStats& rhs);
+	};
+
+	// Simulates a FIFO cache of cacheSize entries over the triangle list.
+	static CacheStats AnalyzeVertexCache(const uint32* indices, std::size_t indexCount,
+		std::size_t vertexCount, int cacheSize = DefaultCacheSize);
+
+	// Reorders the triangles in place for a cache of cacheSize entries.  If 'clusters'
+	// is given it receives the first triangle of every run that starts from an empty
+	// cache; such runs can be moved around without costing cache misses.
+	static void OptimizeVertexCache(uint32* indices, std::size_t indexCount, std::size_t vertexCount,
+		int cacheSize = DefaultCacheSize, std::vector<uint32>* clusters = nullptr);
+
+	// Cuts the runs from OptimizeVertexCache further wherever a piece's own cache cost is
+	// within 'threshold' of its run's, then orders the pieces outward facing first.
+	// 'positions' points at the first vertex's x, y and z; positionStride is in bytes.
+	static void OptimizeOverdraw(uint32* indices, std::size_t indexCount,
+		const float* positions, std::size_t positionStride, std::size_t vertexCount,
+		const std::vector<uint32>& clusters, int cacheSize = DefaultCacheSize,
+		float threshold = DefaultOverdrawThreshold);
+
+	// Stores the vertices in the order the triangles first use them and drops unused
+	// ones, rewriting the indices to match.
+	template<typename T>
+	static void OptimizeVertexFetch(uint32* indices, std::size_t indexCount, std::vector<T>& vertices)
+	{
+		std::vector<uint32> remap;
+		std::size_t used = BuildFetchRemap(indices, indexCount, vertices.size(), remap);
+
+		std::vector<T> reordered(used);
+		for(std::size_t v = 0; v < vertices.size(); ++v)
+		{
+			if(remap[v] != Unused)
+				reordered[remap[v]] = vertices[v];
+		}
+		vertices.swap(reordered);
+	}
+
+	// All three passes on a generated mesh.  The triangle order from the vertex cache and
+	// overdraw passes is only kept if it takes fewer vertex shader runs than the input's.
+	// Call it before GetIndices16.
+	static void Optimize(GeometryGenerator::MeshData& mesh,
+		CacheStats* before = nullptr, CacheStats* after = nullptr);
+
+private:
+	static const uint32 Unused = ~0u;
+
+	// Renumbers the indices in first-use order; remap[v] is the new index of vertex v,
+	// or Unused.  Returns the number of vertices used.
+	static std::size_t BuildFetchRemap(uint32* indices, std::size_t indexCount,
+		std::size_t vertexCount, std::vector<uint32>& remap);
+};
+
+#endif // MESHOPTIMIZER_H
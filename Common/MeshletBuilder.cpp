@@ -0,0 +1,242 @@
+//***************************************************************************************
+// MeshletBuilder.cpp
+//***************************************************************************************
+
+#include "MeshletBuilder.h"
+#include "JobSystem.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using namespace DirectX;
+
+namespace
+{
+	const float* Position(const float* positions, std::size_t stride, MeshletBuilder::uint32 v)
+	{
+		return reinterpret_cast<const float*>(reinterpret_cast<const char*>(positions) + v*stride);
+	}
+
+	// Clusters the triangles [firstTriangle, lastTriangle) in order, starting a new
+	// meshlet whenever the next triangle would not fit.  Offsets are block relative.
+	void BuildBlock(const MeshletBuilder::uint32* indices, std::size_t firstTriangle, std::size_t lastTriangle,
+		std::size_t vertexCount, MeshletBuilder::MeshletData& block)
+	{
+		using uint32 = MeshletBuilder::uint32;
+
+		MeshletBuilder::Meshlet current;
+		auto finish = [&]()
+		{
+			if(current.TriangleCount > 0)
+			{
+				block.Meshlets.push_back(current);
+				current.VertexOffset = (uint32)block.VertexIndices.size();
+				current.VertexCount = 0;
+				current.TriangleOffset = (uint32)(block.Triangles.size() / 3);
+				current.TriangleCount = 0;
+			}
+		};
+
+		for(std::size_t t = firstTriangle; t < lastTriangle; ++t)
+		{
+			const uint32* tri = &indices[t*3];
+
+			// The meshlet's vertices are few enough that a linear search beats a map.
+			int local[3];
+			int added = 0;
+			for(int k = 0; k < 3; ++k)
+			{
+				assert(tri[k] < vertexCount);
+				local[k] = -1;
+				for(uint32 v = 0; v < current.VertexCount; ++v)
+				{
+					if(block.VertexIndices[current.VertexOffset + v] == tri[k])
+					{
+						local[k] = (int)v;
+						break;
+					}
+				}
+
+				if(local[k] < 0 && (k < 1 || tri[k] != tri[0]) && (k < 2 || tri[k] != tri[1]))
+					++added;
+			}
+
+			if(current.VertexCount + added > (uint32)MeshletBuilder::MaxVertices ||
+				current.TriangleCount + 1 > (uint32)MeshletBuilder::MaxTriangles)
+			{
+				finish();
+				local[0] = local[1] = local[2] = -1;
+			}
+
+			for(int k = 0; k < 3; ++k)
+			{
+				if(local[k] < 0)
+				{
+					// A vertex repeated within the triangle is only added once.
+					for(int j = 0; j < k; ++j)
+					{
+						if(tri[j] == tri[k])
+							local[k] = local[j];
+					}
+				}
+
+				if(local[k] < 0)
+				{
+					local[k] = (int)current.VertexCount++;
+					block.VertexIndices.push_back(tri[k]);
+				}
+
+				block.Triangles.push_back((std::uint8_t)local[k]);
+			}
+			++current.TriangleCount;
+		}
+
+		finish();
+	}
+
+	void ComputeBounds(const MeshletBuilder::MeshletData& meshlets, const float* positions, std::size_t positionStride,
+		MeshletBuilder::Meshlet& meshlet)
+	{
+		XMFLOAT3 points[MeshletBuilder::MaxVertices];
+		for(MeshletBuilder::uint32 v = 0; v < meshlet.VertexCount; ++v)
+		{
+			const float* p = Position(positions, positionStride, meshlets.VertexIndices[meshlet.VertexOffset + v]);
+			points[v] = XMFLOAT3(p[0], p[1], p[2]);
+		}
+		BoundingSphere::CreateFromPoints(meshlet.Bounds, meshlet.VertexCount, points, sizeof(XMFLOAT3));
+
+		// Front faces are clockwise, so with left handed coordinates the cross product of
+		// the first two edges points out of the front.
+		XMVECTOR normals[MeshletBuilder::MaxTriangles];
+		int normalCount = 0;
+		XMVECTOR axis = XMVectorZero();
+		const std::uint8_t* tri = &meshlets.Triangles[meshlet.TriangleOffset*3];
+		for(MeshletBuilder::uint32 t = 0; t < meshlet.TriangleCount; ++t, tri += 3)
+		{
+			XMVECTOR p0 = XMLoadFloat3(&points[tri[0]]);
+			XMVECTOR p1 = XMLoadFloat3(&points[tri[1]]);
+			XMVECTOR p2 = XMLoadFloat3(&points[tri[2]]);
+			XMVECTOR n = XMVector3Cross(p1 - p0, p2 - p0);
+
+			// Degenerate triangles cover nothing, so they do not widen the cone.
+			float length = XMVectorGetX(XMVector3Length(n));
+			if(length <= 0.0f)
+				continue;
+
+			normals[normalCount] = n / length;
+			axis += normals[normalCount++];
+		}
+
+		float axisLength = XMVectorGetX(XMVector3Length(axis));
+		if(normalCount == 0 || axisLength <= 0.0f)
+			return;
+		axis /= axisLength;
+
+		float minDot = 1.0f;
+		for(int i = 0; i < normalCount; ++i)
+			minDot = std::min(minDot, XMVectorGetX(XMVector3Dot(normals[i], axis)));
+
+		// Normals within acos(minDot) of the axis all face away from a view direction
+		// within 90 - acos(minDot) degrees of it; the sine of that spread is the cutoff.
+		// A spread near or past 90 degrees leaves nothing to cull.
+		XMStoreFloat3(&meshlet.ConeAxis, axis);
+		meshlet.ConeCutoff = minDot <= 0.1f ? 1.0f : std::sqrt(1.0f - minDot*minDot);
+	}
+}
+
+void MeshletBuilder::Build(const uint32* indices, std::size_t indexCount,
+	const float* positions, std::size_t positionStride, std::size_t vertexCount,
+	MeshletData& meshlets)
+{
+	meshlets = MeshletData();
+
+	const std::size_t triCount = indexCount / 3;
+	const int blockCount = (int)((triCount + BlockTriangles - 1) / BlockTriangles);
+	std::vector<MeshletData> blocks(blockCount);
+
+	JobSystem::Default().ParallelFor(0, blockCount, [&](int b)
+	{
+		std::size_t first = (std::size_t)b*BlockTriangles;
+		BuildBlock(indices, first, std::min(first + BlockTriangles, triCount), vertexCount, blocks[b]);
+	});
+
+	// Join the blocks in order, moving their offsets past the blocks before them.
+	std::size_t meshletCount = 0;
+	std::size_t vertexIndexCount = 0;
+	for(const MeshletData& block : blocks)
+	{
+		meshletCount += block.Meshlets.size();
+		vertexIndexCount += block.VertexIndices.size();
+	}
+
+	meshlets.Meshlets.reserve(meshletCount);
+	meshlets.VertexIndices.reserve(vertexIndexCount);
+	meshlets.Triangles.reserve(triCount*3);
+	for(const MeshletData& block : blocks)
+	{
+		const uint32 vertexOffset = (uint32)meshlets.VertexIndices.size();
+		const uint32 triangleOffset = (uint32)(meshlets.Triangles.size() / 3);
+		for(Meshlet meshlet : block.Meshlets)
+		{
+			meshlet.VertexOffset += vertexOffset;
+			meshlet.TriangleOffset += triangleOffset;
+			meshlets.Meshlets.push_back(meshlet);
+		}
+
+		meshlets.VertexIndices.insert(meshlets.VertexIndices.end(), block.VertexIndices.begin(), block.VertexIndices.end());
+		meshlets.Triangles.insert(meshlets.Triangles.end(), block.Triangles.begin(), block.Triangles.end());
+	}
+
+	JobSystem::Default().ParallelFor(0, (int)meshlets.Meshlets.size(), 16, [&](int m)
+	{
+		ComputeBounds(meshlets, positions, positionStride, meshlets.Meshlets[m]);
+	});
+}
+
+void MeshletBuilder::Build(const GeometryGenerator::MeshData& mesh, MeshletData& meshlets)
+{
+	if(mesh.Indices32.empty())
+	{
+		meshlets = MeshletData();
+		return;
+	}
+
+	Build(mesh.Indices32.data(), mesh.Indices32.size(), &mesh.Vertices[0].Position.x,
+		sizeof(GeometryGenerator::Vertex), mesh.Vertices.size(), meshlets);
+}
+
+void MeshletBuilder::Cull(const MeshletData& meshlets, const BoundingFrustum& frustum,
+	const XMFLOAT3& eye, std::vector<IndexRange>& visible)
+{
+	XMVECTOR eyePos = XMLoadFloat3(&eye);
+	for(const Meshlet& meshlet : meshlets.Meshlets)
+	{
+		if(frustum.Contains(meshlet.Bounds) == DISJOINT)
+			continue;
+
+		if(meshlet.ConeCutoff < 1.0f)
+		{
+			// Back facing when the view direction to every point of the bounds is within
+			// the cone's cutoff of its axis.
+			XMVECTOR toCenter = XMLoadFloat3(&meshlet.Bounds.Center) - eyePos;
+			float along = XMVectorGetX(XMVector3Dot(toCenter, XMLoadFloat3(&meshlet.ConeAxis)));
+			float distance = XMVectorGetX(XMVector3Length(toCenter));
+			if(along >= meshlet.ConeCutoff*distance + meshlet.Bounds.Radius)
+				continue;
+		}
+
+		const uint32 start = meshlet.TriangleOffset*3;
+		const uint32 count = meshlet.TriangleCount*3;
+		if(!visible.empty() && visible.back().StartIndex + visible.back().IndexCount == start)
+		{
+			visible.back().IndexCount += count;
+		}
+		else
+		{
+			IndexRange range;
+			range.StartIndex = start;
+			range.IndexCount = count;
+			visible.push_back(range);
+		}
+	}
+}
@@ -0,0 +1,82 @@
+//***************************************************************************************
+// MeshletBuilder.h
+//
+// Splits an indexed triangle list into meshlets: clusters of at most MaxVertices
+// vertices and MaxTriangles triangles, each with a bounding sphere and a normal cone,
+// so whole clusters can be culled before any of their triangles are drawn.
+//
+// The triangles are taken in their index order, so a list already ordered for the
+// vertex cache (see MeshOptimizer) gives compact clusters.  The list is cut into fixed
+// blocks that are clustered in parallel and joined in order, so the result does not
+// depend on the number of threads or on how the jobs were scheduled.
+//***************************************************************************************
+
+#ifndef MESHLETBUILDER_H
+#define MESHLETBUILDER_H
+
+#include "GeometryGenerator.h"
+#include <DirectXCollision.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class MeshletBuilder
+{
+public:
+	using uint32 = std::uint32_t;
+
+	static const int MaxVertices = 64;
+	static const int MaxTriangles = 124;
+
+	struct Meshlet
+	{
+		// The meshlet's vertices are VertexIndices[VertexOffset, VertexOffset + VertexCount)
+		// and its triangles are Triangles[TriangleOffset*3, (TriangleOffset + TriangleCount)*3),
+		// given as positions in its own vertex list.  Meshlets keep the source order, so
+		// TriangleOffset*3 is also where its triangles start in the source index list.
+		uint32 VertexOffset = 0;
+		uint32 VertexCount = 0;
+		uint32 TriangleOffset = 0;
+		uint32 TriangleCount = 0;
+
+		DirectX::BoundingSphere Bounds;
+
+		// The normal cone.  No triangle faces a point p for which
+		// dot(normalize(Bounds.Center - p), ConeAxis) >= ConeCutoff; Cull allows for the
+		// radius of Bounds as well.  A cutoff of 1 means the normals spread too far to
+		// cull by.
+		DirectX::XMFLOAT3 ConeAxis = { 0.0f, 0.0f, 0.0f };
+		float ConeCutoff = 1.0f;
+	};
+
+	struct MeshletData
+	{
+		std::vector<Meshlet> Meshlets;
+		std::vector<uint32> VertexIndices;
+		std::vector<std::uint8_t> Triangles;
+	};
+
+	// A run of the source index list to draw.
+	struct IndexRange
+	{
+		uint32 StartIndex = 0;
+		uint32 IndexCount = 0;
+	};
+
+	// Triangles taken per job while building.
+	static const int BlockTriangles = 4096;
+
+	// 'positions' points at the first vertex's x, y and z; positionStride is in bytes.
+	static void Build(const uint32* indices, std::size_t indexCount,
+		const float* positions, std::size_t positionStride, std::size_t vertexCount,
+		MeshletData& meshlets);
+
+	static void Build(const GeometryGenerator::MeshData& mesh, MeshletData& meshlets);
+
+	// Appends the index ranges of the meshlets not outside 'frustum' and not facing away
+	// from 'eye', joining neighbours into one range.  Both are in the mesh's space.
+	static void Cull(const MeshletData& meshlets, const DirectX::BoundingFrustum& frustum,
+		const DirectX::XMFLOAT3& eye, std::vector<IndexRange>& visible);
+};
+
+#endif // MESHLETBUILDER_H
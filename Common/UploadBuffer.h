@@ -55,6 +55,13 @@ public:
         memcpy(&mMappedData[elementIndex*mElementByteSize], &data, sizeof(T));
     }
 
+    // Returns the mapped memory of an element, for clients that build elements in place.
+    // The upload heap is write-combined: write it sequentially and never read it back.
+    T* MappedData(int elementIndex)
+    {
+        return reinterpret_cast<T*>(&mMappedData[elementIndex*mElementByteSize]);
+    }
+
 private:
     Microsoft::WRL::ComPtr<ID3D12Resource> mUploadBuffer;
     BYTE* mMappedData = nullptr;